@@ -0,0 +1,55 @@
+// burst_sampler.h - evenly timed bursts of readings
+#pragma once
+
+namespace ustd {
+
+/*! \brief Evenly timed bursts of sensor readings
+
+Readings are timed with `micros()` against the start of the burst, so the time taken by a
+reading itself does not accumulate as timing error. A burst blocks for its whole duration and
+should be kept short (a few tens of milliseconds).
+*/
+class BurstSampler {
+  public:
+    template <typename R, typename C>
+    static void sample(R read, unsigned int count, unsigned long intervalUs, C consume) {
+        /*! Take readings at a fixed rate
+        @param read Callable returning one reading as double
+        @param count Number of readings
+        @param intervalUs Interval between two readings [µs]
+        @param consume Callable receiving each reading as double
+        */
+        unsigned long start = micros();
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned long due = (unsigned long)i * intervalUs;
+            unsigned long elapsed = micros() - start;
+            if (elapsed < due) {
+                delayMicroseconds(due - elapsed);
+            }
+            consume(read());
+        }
+    }
+
+    template <typename R>
+    static double spreadMean(R read, unsigned int count, unsigned long periodUs) {
+        /*! Average readings spread evenly over one period of a periodic disturbance
+
+        The readings sample all phases of the disturbance equally, so its fundamental and all
+        harmonics up to count / 2 cancel out in the mean, e.g. the 100/120 Hz ripple of lamps
+        on 50/60 Hz mains.
+
+        @param read Callable returning one reading as double
+        @param count Number of readings, at least 4 for mains ripple
+        @param periodUs Period of the disturbance [µs], e.g. 20000 for 50 Hz mains
+        @return Mean of the readings
+        */
+        double sum = 0.0;
+        if (!count) {
+            return 0.0;
+        }
+        sample(read, count, periodUs / count, [&sum](double v) { sum += v; });
+        return sum / count;
+    }
+};
+
+}  // namespace ustd
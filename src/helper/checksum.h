@@ -0,0 +1,50 @@
+// checksum.h - checksums for persisted data
+#pragma once
+
+namespace ustd {
+
+inline uint8_t crc8Update(uint8_t crc, uint8_t data) {
+    /*! Update a CRC-8 (polynomial 0x07) with one byte
+    @param crc Current CRC value (0 to start)
+    @param data Data byte
+    @return New CRC value
+    */
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+inline uint8_t crc8(const void *data, unsigned int len, uint8_t crc = 0) {
+    /*! Compute a CRC-8 (polynomial 0x07)
+    @param data Data
+    @param len Length of data in bytes
+    @param crc Initial value, allows to continue a previous computation
+    @return CRC value
+    */
+    const uint8_t *p = (const uint8_t *)data;
+    while (len--) {
+        crc = crc8Update(crc, *p++);
+    }
+    return crc;
+}
+
+inline uint32_t crc32(const void *data, unsigned int len) {
+    /*! Compute a CRC-32 (IEEE 802.3, bitwise, no table)
+    @param data Data
+    @param len Length of data in bytes
+    @return CRC value
+    */
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *p++;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+}  // namespace ustd
@@ -0,0 +1,109 @@
+// duty_cycle.h - deep sleep duty cycle decisions and energy estimation
+#pragma once
+
+namespace ustd {
+
+/*! \brief Current consumption and timing of one wake cycle
+
+Default values are typical for an ESP8266 module (e.g. Wemos D1 mini without USB chip).
+*/
+struct DutyCycleProfile {
+    double sleepCurrent = 0.02;    //!< Current in deep sleep [mA]
+    double measureCurrent = 15.0;  //!< Current while booting and measuring [mA]
+    double measureMs = 60.0;       //!< Boot and measurement time of every wake [ms]
+    double publishCurrent = 80.0;  //!< Current while connecting and publishing [mA]
+    double publishMs = 2500.0;     //!< Additional awake time for connecting and publishing [ms]
+};
+
+/*! \brief Estimated wake time and energy per hour of a duty cycle configuration */
+struct DutyCycleEstimate {
+    double wakesPerHour;      //!< Number of wake cycles per hour
+    double publishesPerHour;  //!< Number of wake cycles with publish per hour
+    double awakeSecPerHour;   //!< Time spent awake per hour [s]
+    double mAhPerHour;        //!< Charge used per hour [mAh], equals the average current [mA]
+    double mWhPerHour;        //!< Energy used per hour [mWh] at the given supply voltage
+};
+
+/*! \brief Publish decisions for deep sleep duty cycling
+
+The state of the controller is small and meant to be kept in RTC memory across deep sleep.
+Each wake, decide() compares the new measurement against the last published value and the
+deadband. Without a relevant change, the node can go back to sleep immediately without
+starting the radio. A publish is forced after maxSkips consecutive wakes without a publish,
+so that the backend still receives a periodic heartbeat.
+
+The same logic runs on hosts, which allows simulating configurations on recorded traces and
+estimating their energy consumption with estimate().
+*/
+class DutyCycleController {
+  public:
+    /*! \brief State to be persisted across deep sleep */
+    struct State {
+        double lastPublished;  //!< Last published value
+        uint32_t skipped;      //!< Consecutive wakes without publish
+        uint32_t wakes;        //!< Total number of wakes
+        uint32_t publishes;    //!< Total number of wakes with publish
+        uint32_t valid;        //!< Nonzero if lastPublished is valid
+    };
+
+    State state;
+    double deadband;
+    uint32_t maxSkips;
+
+    DutyCycleController(double deadband = 0.005, uint32_t maxSkips = 60)
+        : deadband(deadband), maxSkips(maxSkips) {
+        /*! Instantiate a duty cycle controller
+        @param deadband Minimum change against the last published value that causes a publish
+        @param maxSkips Maximum number of consecutive wakes without publish
+        */
+        memset(&state, 0, sizeof(state));
+    }
+
+    bool decide(double value) {
+        /*! Decide whether a measurement has to be published
+        @param value Measurement of this wake
+        @return true if the value has to be published (it then becomes the last published value)
+        */
+        ++state.wakes;
+        double delta = value - state.lastPublished;
+        if (delta < 0.0) {
+            delta = -delta;
+        }
+        if (state.valid && delta <= deadband && state.skipped < maxSkips) {
+            ++state.skipped;
+            return false;
+        }
+        state.lastPublished = value;
+        state.valid = 1;
+        state.skipped = 0;
+        ++state.publishes;
+        return true;
+    }
+
+    static DutyCycleEstimate estimate(const DutyCycleProfile &profile, double sleepSec,
+                                      double publishRatio, double voltage = 3.3) {
+        /*! Estimate wake time and energy per hour
+        @param profile Current consumption and timing of the hardware
+        @param sleepSec Deep sleep time between two wakes [s]
+        @param publishRatio Fraction of wakes that publish, e.g. state.publishes / state.wakes
+        from a simulation
+        @param voltage Supply voltage for the energy estimation [V]
+        @return Estimated values per hour
+        */
+        DutyCycleEstimate e;
+        double cycleSec = sleepSec + (profile.measureMs + publishRatio * profile.publishMs) / 1000.0;
+        e.wakesPerHour = 3600.0 / cycleSec;
+        e.publishesPerHour = e.wakesPerHour * publishRatio;
+        double measureSec = e.wakesPerHour * profile.measureMs / 1000.0;
+        double publishSec = e.publishesPerHour * profile.publishMs / 1000.0;
+        e.awakeSecPerHour = measureSec + publishSec;
+        double sleepSecPerHour = 3600.0 - e.awakeSecPerHour;
+        e.mAhPerHour = (measureSec * profile.measureCurrent + publishSec * profile.publishCurrent +
+                        sleepSecPerHour * profile.sleepCurrent) /
+                       3600.0;
+        e.mWhPerHour = e.mAhPerHour * voltage;
+        return e;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,498 @@
+// filter_pipeline.h - composable processing stages for sensor values
+#pragma once
+
+#include "progmem.h"
+#include "sliding_median.h"
+
+namespace ustd {
+
+// names of the DynamicPipeline stages and of OutlierStage::Mode
+static const char filterStageNames[][11] PROGMEM = {"oversample", "calibrate", "outlier", "ema",
+                                                    "deadband"};
+static const char filterOutlierModeNames[][7] PROGMEM = {"OFF", "MEDIAN", "HAMPEL"};
+
+/*! \brief Pipeline stage: average and decimate
+
+Emits the mean of every `factor` consecutive samples and drops the samples in between.
+*/
+class OversampleStage {
+  public:
+    unsigned int factor = 1;  //!< Number of samples averaged, 1: pass-through
+
+  private:
+    double sum = 0.0;
+    unsigned int count = 0;
+
+  public:
+    bool process(double &value, unsigned long) {
+        if (factor <= 1) {
+            return true;
+        }
+        sum += value;
+        if (++count < factor) {
+            return false;
+        }
+        value = sum / count;
+        sum = 0.0;
+        count = 0;
+        return true;
+    }
+
+    void reset() {
+        sum = 0.0;
+        count = 0;
+    }
+};
+
+/*! \brief Pipeline stage: linear calibration `gain * value + offset`, optionally clamped */
+class CalibrateStage {
+  public:
+    double gain = 1.0;    //!< Factor applied to the value
+    double offset = 0.0;  //!< Offset added after applying the gain
+    bool clamp = false;   //!< Clamp the result to [minVal, maxVal]
+    double minVal = 0.0;  //!< Lower limit if clamp is set
+    double maxVal = 1.0;  //!< Upper limit if clamp is set
+
+    bool process(double &value, unsigned long) {
+        if (gain != 1.0 || offset != 0.0) {
+            value = value * gain + offset;
+        }
+        if (clamp) {
+            value = value < minVal ? minVal : (value > maxVal ? maxVal : value);
+        }
+        return true;
+    }
+
+    void reset() {
+    }
+};
+
+/*! \brief Pipeline stage: sliding median or Hampel outlier rejection, see HampelFilter
+
+@tparam N Window size
+*/
+template <unsigned int N> class OutlierStage {
+  public:
+    enum Mode { OFF, MEDIAN, HAMPEL };
+    Mode mode = OFF;  //!< OFF: pass-through
+    HampelFilter<N> hampel;
+
+    void setMode(Mode newMode) {
+        mode = newMode;
+        hampel.medianOnly = mode == MEDIAN;
+        hampel.reset();
+    }
+
+    bool process(double &value, unsigned long) {
+        if (mode != OFF) {
+            value = hampel.filter(value);
+        }
+        return true;
+    }
+
+    void reset() {
+        hampel.reset();
+    }
+};
+
+/*! \brief Pipeline stage: exponential moving average
+
+The smoothing is either given as fixed weight `alpha` of a new sample, which makes the
+effective time constant depend on the sampling rate, or as `timeConstant` in seconds. With a
+time constant, the weight of a new sample is derived from the time elapsed since the previous
+sample: `alpha = 1 - exp(-dt / timeConstant)`. Filters parameterized that way keep their
+behaviour when the sampling interval is changed or jitters.
+*/
+class EmaStage {
+  public:
+    double alpha = 1.0;         //!< Weight of a new sample (0.0-1.0], 1.0: pass-through
+    double timeConstant = 0.0;  //!< Time constant [s], if > 0 it is used instead of alpha
+
+  private:
+    double state = 0.0;
+    unsigned long lastMs = 0;
+    bool first = true;
+
+  public:
+    bool process(double &value, unsigned long nowMs) {
+        if (first) {
+            first = false;
+            state = value;
+        } else {
+            double a = alpha;
+            if (timeConstant > 0.0) {
+                a = 1.0 - exp(-(double)(nowMs - lastMs) / (timeConstant * 1000.0));
+            }
+            state += a * (value - state);
+        }
+        lastMs = nowMs;
+        value = state;
+        return true;
+    }
+
+    void reset() {
+        first = true;
+    }
+
+    bool valid() const {
+        /*! @return true if the average has been started by a first value */
+        return !first;
+    }
+
+    double value() const {
+        /*! @return Current average, only meaningful if valid() */
+        return state;
+    }
+
+    void restore(double value, unsigned long nowMs) {
+        /*! Continue with a previously saved average, e.g. after a reset
+        @param value Average returned by value()
+        @param nowMs Current time [ms], the next sample is weighted against it
+        */
+        state = value;
+        lastMs = nowMs;
+        first = false;
+    }
+};
+
+/*! \brief Pipeline stage: drop values that did not change by more than a deadband
+
+A value is passed on if it differs from the last passed value by more than `eps`, or if
+`maxSilenceMs` have passed since the last passed value.
+*/
+class DeadbandStage {
+  public:
+    double eps = 0.0;                //!< Deadband
+    unsigned long maxSilenceMs = 0;  //!< Maximum time without passed value, 0: unlimited
+
+  private:
+    double last = 0.0;
+    unsigned long lastMs = 0;
+    bool first = true;
+
+  public:
+    bool process(double &value, unsigned long nowMs) {
+        double delta = value > last ? value - last : last - value;
+        if (first || delta > eps || (maxSilenceMs && nowMs - lastMs >= maxSilenceMs)) {
+            first = false;
+            last = value;
+            lastMs = nowMs;
+            return true;
+        }
+        return false;
+    }
+
+    void reset() {
+        first = true;
+    }
+};
+
+/*! \brief Statically composed filter pipeline
+
+The stages are fixed at compile time and called without any indirection, e.g.
+```cpp
+ustd::Pipeline<ustd::CalibrateStage, ustd::OutlierStage<7>, ustd::EmaStage> pipeline;
+pipeline.first.gain = 1.05;            // CalibrateStage
+pipeline.rest.rest.first.alpha = 0.2;  // EmaStage
+double val = raw;
+if (pipeline.process(val, millis())) {
+    // val passed all stages
+}
+```
+A stage is any class with `bool process(double &value, unsigned long nowMs)` (returning false
+drops the value) and `void reset()`.
+*/
+template <typename... Stages> class Pipeline;
+
+template <> class Pipeline<> {
+  public:
+    bool process(double &, unsigned long) {
+        return true;
+    }
+    void reset() {
+    }
+};
+
+template <typename First, typename... Rest> class Pipeline<First, Rest...> {
+  public:
+    First first;             //!< First stage
+    Pipeline<Rest...> rest;  //!< Remaining stages
+
+    bool process(double &value, unsigned long nowMs) {
+        /*! Process a value through all stages
+        @param value Value, modified by the stages
+        @param nowMs Current time [ms]
+        @return false if a stage dropped the value
+        */
+        return first.process(value, nowMs) && rest.process(value, nowMs);
+    }
+
+    void reset() {
+        /*! Reset the state of all stages */
+        first.reset();
+        rest.reset();
+    }
+};
+
+/*! \brief Filter pipeline configurable at runtime
+
+Contains one instance of each stage type; the order and selection of stages is configured
+with a comma separated list of stage names, e.g. `"calibrate,outlier,ema"`. Stages are called
+through a switch, without virtual functions or allocations.
+
+Stage names: `oversample`, `calibrate`, `outlier`, `ema`, `deadband`. The parameters of the
+stages can be set and formatted as text, see setParameter(), which lets every sensor offer the
+same `pipeline/<stage>/set` commands:
+
+| stage | parameter
+| ----- | ---------
+| `oversample` | factor
+| `calibrate` | `<gain>,<offset>`
+| `outlier` | `OFF`, `MEDIAN` or `HAMPEL`
+| `ema` | alpha (0.0-1.0], or time constant in seconds with suffix `s`, e.g. `2.5s`
+| `deadband` | eps
+
+@tparam OUTLIER_WINDOW Window size of the outlier stage
+*/
+template <unsigned int OUTLIER_WINDOW = 7> class DynamicPipeline {
+  public:
+    enum Stage { NONE, OVERSAMPLE, CALIBRATE, OUTLIER, EMA, DEADBAND };
+    static const uint8_t MAX_STAGES = 5;
+
+    OversampleStage oversample;
+    CalibrateStage calibrate;
+    OutlierStage<OUTLIER_WINDOW> outlier;
+    EmaStage ema;
+    DeadbandStage deadband;
+    uint8_t order[MAX_STAGES];  //!< Stage sequence, terminated by NONE if shorter
+
+    DynamicPipeline() {
+        memset(order, NONE, sizeof(order));
+    }
+
+    bool process(double &value, unsigned long nowMs) {
+        /*! Process a value through all configured stages
+        @param value Value, modified by the stages
+        @param nowMs Current time [ms]
+        @return false if a stage dropped the value
+        */
+        for (uint8_t i = 0; i < MAX_STAGES && order[i] != NONE; i++) {
+            bool pass = true;
+            switch (order[i]) {
+            case OVERSAMPLE:
+                pass = oversample.process(value, nowMs);
+                break;
+            case CALIBRATE:
+                pass = calibrate.process(value, nowMs);
+                break;
+            case OUTLIER:
+                pass = outlier.process(value, nowMs);
+                break;
+            case EMA:
+                pass = ema.process(value, nowMs);
+                break;
+            case DEADBAND:
+                pass = deadband.process(value, nowMs);
+                break;
+            }
+            if (!pass) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void reset() {
+        /*! Reset the state of all stages */
+        oversample.reset();
+        calibrate.reset();
+        outlier.reset();
+        ema.reset();
+        deadband.reset();
+    }
+
+    bool configure(const char *spec) {
+        /*! Configure the stage sequence
+        @param spec Comma separated list of stage names, empty for no stages
+        @return false if the list contains unknown names or too many stages, the configuration
+        is unchanged in that case
+        */
+        uint8_t newOrder[MAX_STAGES];
+        memset(newOrder, NONE, sizeof(newOrder));
+        uint8_t n = 0;
+        while (*spec) {
+            const char *end = spec;
+            while (*end && *end != ',') {
+                ++end;
+            }
+            uint8_t stage = NONE;
+            for (uint8_t s = OVERSAMPLE; s <= DEADBAND; s++) {
+                const char *stageName = name(s);
+                if ((size_t)(end - spec) == strlen_P(stageName) &&
+                    !strncasecmp_P(spec, stageName, end - spec)) {
+                    stage = s;
+                }
+            }
+            if (end != spec) {
+                if (stage == NONE || n == MAX_STAGES) {
+                    return false;
+                }
+                newOrder[n++] = stage;
+            }
+            spec = *end ? end + 1 : end;
+        }
+        memcpy(order, newOrder, sizeof(order));
+        reset();
+        return true;
+    }
+
+    bool setOrder(const uint8_t *newOrder) {
+        /*! Set the stage sequence from a copy of `order`, e.g. a persisted configuration
+        @param newOrder MAX_STAGES stage ids, terminated by NONE if shorter
+        @return false if it contains unknown stage ids or stages after NONE, the configuration
+        is unchanged in that case
+        */
+        bool end = false;
+        for (uint8_t i = 0; i < MAX_STAGES; i++) {
+            if (newOrder[i] > DEADBAND || (end && newOrder[i] != NONE)) {
+                return false;
+            }
+            end = newOrder[i] == NONE;
+        }
+        memcpy(order, newOrder, sizeof(order));
+        reset();
+        return true;
+    }
+
+    bool contains(uint8_t stage) const {
+        /*! @return true if the stage is part of the configured sequence */
+        for (uint8_t i = 0; i < MAX_STAGES && order[i] != NONE; i++) {
+            if (order[i] == stage) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool setParameter(uint8_t stage, const char *value) {
+        /*! Set the parameter of a stage from text, see the table above
+        @param stage Stage, e.g. from find()
+        @param value Parameter
+        @return false if the stage or the value is invalid, nothing is changed in that case
+        */
+        char *end;
+        double v = strtod(value, &end);
+        if (stage != OUTLIER && end == value) {
+            return false;
+        }
+        switch (stage) {
+        case OVERSAMPLE:
+            oversample.factor = v > 1.0 ? (unsigned int)v : 1;
+            break;
+        case CALIBRATE:
+            if (*end != ',') {
+                return false;
+            }
+            calibrate.gain = v;
+            calibrate.offset = strtod(end + 1, nullptr);
+            break;
+        case OUTLIER: {
+            int mode = OutlierStage<OUTLIER_WINDOW>::HAMPEL;
+            while (mode >= 0 && strcasecmp_P(value, filterOutlierModeNames[mode])) {
+                --mode;
+            }
+            if (mode < 0) {
+                return false;
+            }
+            outlier.setMode((typename OutlierStage<OUTLIER_WINDOW>::Mode)mode);
+            break;
+        }
+        case EMA:
+            if (*end == 's') {
+                ema.timeConstant = v > 0.0 ? v : 0.0;
+            } else {
+                ema.timeConstant = 0.0;
+                ema.alpha = v > 0.0 && v <= 1.0 ? v : 1.0;
+            }
+            break;
+        case DEADBAND:
+            deadband.eps = v > 0.0 ? v : 0.0;
+            break;
+        default:
+            return false;
+        }
+        reset();
+        return true;
+    }
+
+    int formatParameter(uint8_t stage, char *buf, unsigned int len) const {
+        /*! Format the parameter of a stage as accepted by setParameter()
+        @return Length of the formatted string (as snprintf), -1 if the stage is invalid
+        */
+        switch (stage) {
+        case OVERSAMPLE:
+            return snprintf_P(buf, len, PSTR("%u"), oversample.factor);
+        case CALIBRATE:
+            return snprintf_P(buf, len, PSTR("%.4f,%.4f"), calibrate.gain, calibrate.offset);
+        case OUTLIER:
+            return copyName(buf, len, filterOutlierModeNames[outlier.mode]);
+        case EMA:
+            if (ema.timeConstant > 0.0) {
+                return snprintf_P(buf, len, PSTR("%.3fs"), ema.timeConstant);
+            }
+            return snprintf_P(buf, len, PSTR("%.4f"), ema.alpha);
+        case DEADBAND:
+            return snprintf_P(buf, len, PSTR("%.4f"), deadband.eps);
+        default:
+            return -1;
+        }
+    }
+
+    int describe(char *buf, unsigned int len) const {
+        /*! Format the stage sequence as comma separated list
+        @return Length of the formatted string (as snprintf)
+        */
+        int pos = 0;
+        if (len) {
+            buf[0] = 0;
+        }
+        for (uint8_t i = 0; i < MAX_STAGES && order[i] != NONE; i++) {
+            if (i) {
+                pos += copyName(buf + pos, pos < (int)len ? len - pos : 0, PSTR(","));
+            }
+            pos += copyName(buf + pos, pos < (int)len ? len - pos : 0, name(order[i]));
+        }
+        return pos;
+    }
+
+    static uint8_t find(const char *stageName) {
+        /*! @return Stage with the given name (case insensitive), NONE if there is none */
+        for (uint8_t s = OVERSAMPLE; s <= DEADBAND; s++) {
+            if (!strcasecmp_P(stageName, name(s))) {
+                return s;
+            }
+        }
+        return NONE;
+    }
+
+    static const char *name(uint8_t stage) {
+        /*! @return Name of a stage in flash, empty if the stage is invalid */
+        if (stage < OVERSAMPLE || stage > DEADBAND) {
+            return PSTR("");
+        }
+        return filterStageNames[stage - OVERSAMPLE];
+    }
+
+  private:
+    static int copyName(char *buf, unsigned int len, const char *src) {
+        // strncpy_P with the result of snprintf, "%s" cannot read flash strings on all MCUs
+        int srcLen = strlen_P(src);
+        if (len) {
+            strncpy_P(buf, src, len);
+            buf[srcLen < (int)len ? srcLen : len - 1] = 0;
+        }
+        return srcLen;
+    }
+};
+
+}  // namespace ustd
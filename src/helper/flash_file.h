@@ -0,0 +1,200 @@
+// flash_file.h - minimal binary file access for flash file systems and host builds
+#pragma once
+
+#if defined(__ESP__)
+#include <FS.h>
+#if defined(__USE_SPIFFS_FS__)
+#if defined(__ESP32__)
+#include <SPIFFS.h>
+#endif
+#define MUP_FLASH_FS SPIFFS
+#else
+#include <LittleFS.h>
+#define MUP_FLASH_FS LittleFS
+#endif
+#elif defined(__UNIXOID__)
+#include <stdio.h>
+#ifndef FLASH_FILE_HOST_DIR
+#define FLASH_FILE_HOST_DIR "."  //!< Host directory that stands in for the root of the flash file system
+#endif
+#endif
+
+namespace ustd {
+
+/*! \brief Binary file on the flash file system
+
+On ESP8266 and ESP32 the file lives on LittleFS (or SPIFFS if `__USE_SPIFFS_FS__` is
+defined), on Unix-like hosts it is a regular file below `FLASH_FILE_HOST_DIR` (default: the
+current directory), which allows testing persistence code on Linux. Paths are absolute on the
+flash file system, `/ldr.cfg` is `./ldr.cfg` on hosts. On other platforms all operations fail.
+
+The file system must have been mounted (e.g. `LittleFS.begin()`) before use.
+*/
+class FlashFile {
+  private:
+#if defined(__ESP__)
+    fs::File file;
+#elif defined(__UNIXOID__)
+    FILE *file = nullptr;
+#endif
+
+  public:
+    ~FlashFile() {
+        close();
+    }
+
+    bool open(const char *path, const char *mode) {
+        /*! Open a file
+        @param path File name
+        @param mode `"r"`, `"w"`, `"a"` or `"r+"` as for fopen()
+        @return true on success
+        */
+        close();
+#if defined(__ESP__)
+        file = MUP_FLASH_FS.open(path, mode);
+        return (bool)file;
+#elif defined(__UNIXOID__)
+        // binary mode for hosts that distinguish text files
+        char m[4] = {mode[0], mode[1] == '+' ? '+' : 'b', (char)(mode[1] == '+' ? 'b' : 0), 0};
+        char host[128];
+        file = fopen(hostPath(path, host, sizeof(host)), m);
+        return file != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    bool isOpen() {
+        /*! @return true if the file is open */
+#if defined(__ESP__)
+        return (bool)file;
+#elif defined(__UNIXOID__)
+        return file != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    void close() {
+        /*! Close the file, pending writes are committed */
+#if defined(__ESP__)
+        if (file) {
+            file.close();
+        }
+#elif defined(__UNIXOID__)
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+#endif
+    }
+
+    size_t read(void *buf, size_t len) {
+        /*! Read from the current position
+        @return Number of bytes read
+        */
+#if defined(__ESP__)
+        return file ? file.read((uint8_t *)buf, len) : 0;
+#elif defined(__UNIXOID__)
+        return file ? fread(buf, 1, len, file) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    size_t write(const void *buf, size_t len) {
+        /*! Write at the current position
+        @return Number of bytes written
+        */
+#if defined(__ESP__)
+        return file ? file.write((const uint8_t *)buf, len) : 0;
+#elif defined(__UNIXOID__)
+        return file ? fwrite(buf, 1, len, file) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    bool seek(size_t pos) {
+        /*! Set the position for the next read or write */
+#if defined(__ESP__)
+        return file ? file.seek(pos, fs::SeekSet) : false;
+#elif defined(__UNIXOID__)
+        return file ? fseek(file, pos, SEEK_SET) == 0 : false;
+#else
+        return false;
+#endif
+    }
+
+    size_t size() {
+        /*! @return Size of the file in bytes */
+#if defined(__ESP__)
+        return file ? file.size() : 0;
+#elif defined(__UNIXOID__)
+        if (!file) {
+            return 0;
+        }
+        long pos = ftell(file);
+        fseek(file, 0, SEEK_END);
+        long len = ftell(file);
+        fseek(file, pos, SEEK_SET);
+        return len;
+#else
+        return 0;
+#endif
+    }
+
+    void flush() {
+        /*! Commit pending writes to the medium */
+#if defined(__ESP__)
+        if (file) {
+            file.flush();
+        }
+#elif defined(__UNIXOID__)
+        if (file) {
+            fflush(file);
+        }
+#endif
+    }
+
+    static bool exists(const char *path) {
+        /*! @return true if the file exists */
+#if defined(__ESP__)
+        return MUP_FLASH_FS.exists(path);
+#elif defined(__UNIXOID__)
+        char host[128];
+        FILE *f = fopen(hostPath(path, host, sizeof(host)), "rb");
+        if (f) {
+            fclose(f);
+        }
+        return f != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    static bool remove(const char *path) {
+        /*! Delete a file
+        @return true on success
+        */
+#if defined(__ESP__)
+        return MUP_FLASH_FS.remove(path);
+#elif defined(__UNIXOID__)
+        char host[128];
+        return ::remove(hostPath(path, host, sizeof(host))) == 0;
+#else
+        return false;
+#endif
+    }
+
+#if defined(__UNIXOID__)
+  private:
+    static const char *hostPath(const char *path, char *buf, size_t len) {
+        // the root of the flash file system is FLASH_FILE_HOST_DIR, never the root of the host
+        snprintf(buf, len, "%s/%s", FLASH_FILE_HOST_DIR, path[0] == '/' ? path + 1 : path);
+        return buf;
+    }
+#endif
+};
+
+}  // namespace ustd
@@ -0,0 +1,119 @@
+// gdk101_simulator.h - simulated GDK101 gamma sensor for host tests
+#pragma once
+
+#include "i2c_bus.h"
+
+#if defined(__UNIXOID__)
+
+namespace ustd {
+
+/*! \brief Simulated GDK101 gamma radiation sensor (hosts only)
+
+Implements the I2C command set of the GDK101: a one byte command is written, the two byte
+response is read afterwards. Dose rates are encoded as integer part and hundredths. Attach
+an instance to an I2CBus and pass the bus to GammaGDK101 to run the mupplet on a host:
+
+```cpp
+ustd::I2CBus bus;
+ustd::Gdk101Simulator sim(0x18);
+bus.attach(&sim);
+sim.doseRate10 = 0.12;
+sim.advance(700);  // 700 s of measurement, the 10-minute average is valid
+gamma.begin(&sched, &bus);
+```
+
+Setting `responding` to false simulates a device that does not acknowledge, setting
+`stuck` simulates a device that acknowledges commands but returns no data.
+*/
+class Gdk101Simulator : public I2CSimDevice {
+  public:
+    double doseRate10 = 0.0;   //!< 10-minute average dose rate [µSv/h]
+    double doseRate1 = 0.0;    //!< 1-minute average dose rate [µSv/h]
+    bool vibration = false;    //!< Vibration detected
+    uint8_t fwMajor = 0;       //!< Firmware version, major
+    uint8_t fwMinor = 6;       //!< Firmware version, minor
+    bool responding = true;    //!< false: the device does not acknowledge
+    bool stuck = false;        //!< true: commands are acknowledged, reads return no data
+    unsigned long measuringTime = 0;  //!< Seconds since reset
+    unsigned long writes = 0;  //!< Number of command writes received
+    unsigned long reads = 0;   //!< Number of response reads received
+
+  private:
+    uint8_t response[2] = {0, 0};
+
+  public:
+    Gdk101Simulator(uint8_t address = 0x18) : I2CSimDevice(address) {
+    }
+
+    void advance(unsigned long seconds) {
+        /*! Advance the measuring time of the simulated sensor */
+        measuringTime += seconds;
+    }
+
+    uint8_t status() const {
+        /*! @return Status: 0 ready, 1 waiting for the first 10 minutes, 2 normal operation */
+        if (measuringTime == 0) {
+            return 0;
+        }
+        return measuringTime < 600 ? 1 : 2;
+    }
+
+    virtual bool onWrite(const uint8_t *data, uint8_t len) override {
+        if (!responding || len != 1) {
+            return false;
+        }
+        ++writes;
+        switch (data[0]) {
+        case 0xA0:  // reset
+            measuringTime = 0;
+            setResponse(1, 0);
+            break;
+        case 0xB0:  // status and vibration
+            setResponse(status(), vibration ? 1 : 0);
+            break;
+        case 0xB1:  // measuring time
+            setResponse((measuringTime / 60) % 256, measuringTime % 60);
+            break;
+        case 0xB2:  // 10-minute average
+            setDoseRate(doseRate10);
+            break;
+        case 0xB3:  // 1-minute average
+            setDoseRate(doseRate1);
+            break;
+        case 0xB4:  // firmware version
+            setResponse(fwMajor, fwMinor);
+            break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    virtual uint8_t onRead(uint8_t *data, uint8_t len) override {
+        if (!responding) {
+            return 0;
+        }
+        ++reads;
+        if (stuck) {
+            return 0;
+        }
+        uint8_t n = len < 2 ? len : 2;
+        memcpy(data, response, n);
+        return n;
+    }
+
+  private:
+    void setResponse(uint8_t b0, uint8_t b1) {
+        response[0] = b0;
+        response[1] = b1;
+    }
+
+    void setDoseRate(double value) {
+        unsigned int hundredths = (unsigned int)(value * 100.0 + 0.5);
+        setResponse(hundredths / 100, hundredths % 100);
+    }
+};
+
+}  // namespace ustd
+
+#endif  // __UNIXOID__
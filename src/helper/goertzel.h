@@ -0,0 +1,56 @@
+// goertzel.h - single frequency bin detection with the Goertzel algorithm
+#pragma once
+
+namespace ustd {
+
+/*! \brief Goertzel filter for the amplitude of a single frequency
+
+Computes one DFT bin incrementally with two multiply-adds per sample and no sample buffer,
+which is much cheaper than a full FFT if only a few frequencies are of interest. For an exact
+result, the number of samples should be a multiple of sampleRate / frequency.
+*/
+class Goertzel {
+  private:
+    double coeff;
+    double s1;
+    double s2;
+    unsigned long count;
+
+  public:
+    Goertzel(double frequency, double sampleRate) {
+        /*! Instantiate a Goertzel filter
+        @param frequency Frequency to detect [Hz]
+        @param sampleRate Sampling rate [Hz]
+        */
+        coeff = 2.0 * cos(2.0 * M_PI * frequency / sampleRate);
+        reset();
+    }
+
+    void reset() {
+        /*! Discard all samples */
+        s1 = 0.0;
+        s2 = 0.0;
+        count = 0;
+    }
+
+    void add(double x) {
+        /*! Add a sample */
+        double s0 = x + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s0;
+        ++count;
+    }
+
+    double amplitude() const {
+        /*! Get the amplitude of the frequency in the samples added so far
+        @return Amplitude (peak) of the sinusoidal component
+        */
+        if (!count) {
+            return 0.0;
+        }
+        double power = s1 * s1 + s2 * s2 - coeff * s1 * s2;
+        return 2.0 * sqrt(power > 0.0 ? power : 0.0) / count;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,157 @@
+// i2c_bus.h - minimal I2C transfer interface with a host-side simulation
+#pragma once
+
+#if !defined(__UNIXOID__)
+#include <Wire.h>
+#endif
+
+#ifndef I2C_SIM_DEVICES
+#define I2C_SIM_DEVICES 8  //!< Maximum number of simulated devices on a host I2C bus
+#endif
+
+namespace ustd {
+
+#if defined(__UNIXOID__)
+/*! \brief Base class of simulated I2C devices (hosts only)
+
+A simulated device is attached to an I2CBus at its address and receives the transfers
+addressed to it, which allows running mupplets against simulated hardware on a host.
+*/
+class I2CSimDevice {
+  public:
+    uint8_t address;  //!< I2C address of the device
+
+    I2CSimDevice(uint8_t address) : address(address) {
+    }
+
+    virtual ~I2CSimDevice() {
+    }
+
+    /*! Called for a write transfer to the device
+    @return false if the device does not acknowledge
+    */
+    virtual bool onWrite(const uint8_t *data, uint8_t len) = 0;
+
+    /*! Called for a read transfer from the device
+    @return Number of bytes supplied by the device, 0 if it does not acknowledge
+    */
+    virtual uint8_t onRead(uint8_t *data, uint8_t len) = 0;
+};
+#endif
+
+/*! \brief Minimal I2C transfer interface
+
+Wraps the few transfers sensor mupplets need: a write of a command or register address and
+a read of a response. On Arduino platforms the transfers go through a `TwoWire` instance, on
+hosts (`__UNIXOID__`) they are dispatched to attached I2CSimDevice instances.
+*/
+class I2CBus {
+  public:
+    unsigned long clockHz = 100000;  //!< Bus clock used to compute transfer times
+
+  private:
+#if defined(__UNIXOID__)
+    I2CSimDevice *devices[I2C_SIM_DEVICES];
+    uint8_t deviceCount = 0;
+#else
+    TwoWire *pWire = nullptr;
+#endif
+
+  public:
+#if defined(__UNIXOID__)
+    bool attach(I2CSimDevice *pDevice) {
+        /*! Attach a simulated device (hosts only)
+        @param pDevice Simulated device, answers transfers to its address
+        @return false if too many devices are attached
+        */
+        if (deviceCount >= I2C_SIM_DEVICES) {
+            return false;
+        }
+        devices[deviceCount++] = pDevice;
+        return true;
+    }
+
+    void detach(I2CSimDevice *pDevice) {
+        /*! Detach a simulated device (hosts only), e.g. to simulate a failing device */
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (devices[i] == pDevice) {
+                devices[i] = devices[--deviceCount];
+                return;
+            }
+        }
+    }
+#else
+    void begin(TwoWire *_pWire = &Wire) {
+        /*! Use a TwoWire instance for the transfers
+        @param _pWire TwoWire instance, must already be initialized with `begin()`
+        */
+        pWire = _pWire;
+    }
+#endif
+
+    unsigned long transferUs(uint8_t len) const {
+        /*! Compute the bus time of a transfer
+        @param len Number of data bytes of the transfer
+        @return Bus time [µs] of start condition, address byte, data bytes (each with
+        acknowledge bit) and stop condition at `clockHz`
+        */
+        return ((len + 1UL) * 9UL + 2UL) * 1000000UL / clockHz;
+    }
+
+    bool write(uint8_t address, const uint8_t *data, uint8_t len) {
+        /*! Write bytes to a device
+        @param address I2C address of the device
+        @param data Bytes to write
+        @param len Number of bytes
+        @return true if the device acknowledged the transfer
+        */
+#if defined(__UNIXOID__)
+        I2CSimDevice *pDevice = find(address);
+        return pDevice && pDevice->onWrite(data, len);
+#else
+        if (!pWire) {
+            return false;
+        }
+        pWire->beginTransmission(address);
+        pWire->write(data, len);
+        return pWire->endTransmission() == 0;
+#endif
+    }
+
+    uint8_t read(uint8_t address, uint8_t *data, uint8_t len) {
+        /*! Read bytes from a device
+        @param address I2C address of the device
+        @param data Buffer for the bytes read
+        @param len Number of bytes to read
+        @return Number of bytes received, less than len if the transfer failed
+        */
+#if defined(__UNIXOID__)
+        I2CSimDevice *pDevice = find(address);
+        return pDevice ? pDevice->onRead(data, len) : 0;
+#else
+        if (!pWire) {
+            return 0;
+        }
+        uint8_t n = pWire->requestFrom(address, len);
+        uint8_t i = 0;
+        while (i < n && pWire->available()) {
+            data[i++] = pWire->read();
+        }
+        return i;
+#endif
+    }
+
+  private:
+#if defined(__UNIXOID__)
+    I2CSimDevice *find(uint8_t address) {
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (devices[i]->address == address) {
+                return devices[i];
+            }
+        }
+        return nullptr;
+    }
+#endif
+};
+
+}  // namespace ustd
@@ -0,0 +1,375 @@
+// i2c_bus_manager.h - shared asynchronous I2C transaction queue
+#pragma once
+
+#include "scheduler.h"
+#include "i2c_bus.h"
+#include "sensor_mupplet.h"
+
+#ifndef I2C_QUEUE_SIZE
+#define I2C_QUEUE_SIZE 16  //!< Maximum number of queued transactions of an I2CBusManager
+#endif
+#ifndef I2C_SLICE_US
+#define I2C_SLICE_US 1000  //!< Bus time after which a manager tick yields to the scheduler [µs]
+#endif
+#ifndef I2C_AGING_MS
+#define I2C_AGING_MS 100  //!< Queue wait that raises a transaction by one priority level [ms]
+#endif
+#ifndef I2C_PRIORITY_DEVICES
+#define I2C_PRIORITY_DEVICES 8  //!< Maximum number of devices with an individual priority
+#endif
+
+namespace ustd {
+
+// topic infix of the I2C bus manager, <name>/<command>
+static const char i2cTopicInfix[] PROGMEM = "/";
+
+/*! \brief A queued I2C transaction
+
+A transaction writes up to 4 bytes (e.g. a command or register address) and optionally reads
+up to 8 bytes. If the device needs time between write and read (e.g. for a conversion), the
+read is performed `readDelayMs` later and the bus is free for other devices in the meantime.
+*/
+struct I2CTransaction {
+    //! Completion callback, called with the transaction and the result of the transfers
+    typedef void (*Callback)(void *context, const I2CTransaction &t, bool ok);
+
+    uint8_t address;        //!< I2C address of the device
+    uint8_t writeData[4];   //!< Bytes to write
+    uint8_t writeLen;       //!< Number of bytes to write, 0 for a pure read
+    uint8_t readData[8];    //!< Bytes read
+    uint8_t readLen;        //!< Number of bytes to read, 0 for a pure write
+    uint8_t readDelayMs;    //!< Time between write and read [ms]
+    uint8_t priority;       //!< 0 (highest) - 3 (lowest), set by the manager
+    uint8_t state;          //!< Internal state
+    Callback callback;      //!< Called on completion, may be nullptr
+    void *context;          //!< Passed to the callback
+    unsigned long queued;   //!< Time of queueing [ms]
+    unsigned long written;  //!< Time of the write transfer [ms]
+    unsigned long busUs;    //!< Measured bus time of the transaction [µs]
+};
+
+// clang - format off
+/*! \brief Shared asynchronous I2C bus manager
+
+Sensor mupplets that talk to devices on the same I2C bus submit transactions to a common
+I2CBusManager instead of performing blocking transfers from their own tasks. The manager runs
+one scheduler task that performs queued transactions in the order of the priority of their
+device, first come first served within a priority. A tick returns to the scheduler as soon as
+`I2C_SLICE_US` of bus time are used, so the bus never stalls the cooperative scheduler for
+long. Transactions that need time between write and read release the bus in the meantime;
+further transactions to the same device are held back until the read is complete.
+Transactions that waited longer than `I2C_AGING_MS` are raised by one priority level per
+interval, so low priority devices cannot starve.
+
+The completion callback is called from the task of the manager with the result of the
+transfers and the data read. The task, the subscription and the dispatch of the received
+commands are those of the SensorMupplet base, without the `sensor` part of the topics.
+
+#### Messages sent by the I2C bus manager:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<name>/stats` | JSON object | `transactions`, `failed`, `rejected` (queue full), `utilization` (bus busy time / elapsed time in percent), `busy` (bus busy time [ms]), `wait` (average queue wait [ms]), `maxwait` (maximum queue wait [ms]) and `maxdepth` (maximum queue length) since the last statistics reset
+
+#### Messages received by the I2C bus manager:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<name>/stats/get` | - | Returns the statistics
+| `<name>/stats/reset/set` | - | Resets the statistics
+
+Sample code:
+```cpp
+ustd::I2CBusManager i2c("i2c");
+ustd::GammaGDK101 gamma("gamma", 0x18);
+
+void setup() {
+    Wire.begin();
+    i2c.begin(&sched, &Wire);
+    i2c.setDevicePriority(0x18, ustd::I2CBusManager::PRIORITY_LOW);
+    gamma.begin(&sched, &i2c);
+}
+```
+*/
+// clang-format on
+class I2CBusManager : public SensorMupplet<I2CBusManager> {
+    friend class SensorMupplet<I2CBusManager>;
+
+  public:
+    enum Priority { PRIORITY_HIGH = 0, PRIORITY_NORMAL = 1, PRIORITY_LOW = 2, PRIORITY_IDLE = 3 };
+    // transaction state
+    enum State { FREE, QUEUED, WAITING };
+
+    I2CBus bus;  //!< Bus used for the transfers, on hosts simulated devices are attached here
+
+  private:
+    I2CTransaction queue[I2C_QUEUE_SIZE];
+    uint32_t sequence[I2C_QUEUE_SIZE];
+    uint32_t nextSequence = 0;
+    uint8_t depth = 0;
+    uint8_t priorityAddress[I2C_PRIORITY_DEVICES];
+    uint8_t priorityValue[I2C_PRIORITY_DEVICES];
+    uint8_t priorityCount = 0;
+    // statistics
+    unsigned long statsStart = 0;
+    unsigned long transactions = 0;
+    unsigned long failed = 0;
+    unsigned long rejected = 0;
+    unsigned long busyUs = 0;
+    unsigned long busyMs = 0;
+    unsigned long started = 0;
+    unsigned long waitSumMs = 0;
+    unsigned long waitMaxMs = 0;
+    uint8_t maxDepth = 0;
+
+  public:
+    I2CBusManager(String name) : SensorMupplet(name, i2cTopicInfix) {
+        /*! Instantiate an I2C bus manager
+        @param name Name used for pub/sub messages
+        */
+        memset(queue, 0, sizeof(queue));
+    }
+
+#if !defined(__UNIXOID__)
+    void begin(Scheduler *_pSched, TwoWire *pWire) {
+        /*! Start processing transactions
+        @param _pSched Pointer to the muwerk scheduler
+        @param pWire TwoWire instance of the bus, must already be initialized
+        */
+        bus.begin(pWire);
+        begin(_pSched);
+    }
+#endif
+
+    void begin(Scheduler *_pSched) {
+        /*! Start processing transactions on `bus`, which must already be set up (on hosts:
+        simulated devices attached)
+        @param _pSched Pointer to the muwerk scheduler
+        */
+        statsStart = millis();
+        startTask(_pSched, 2000);  // 2ms
+    }
+
+    bool setDevicePriority(uint8_t address, Priority priority) {
+        /*! Set the priority of the transactions to a device
+        @param address I2C address of the device
+        @param priority Priority, devices without an individual priority use PRIORITY_NORMAL
+        @return false if `I2C_PRIORITY_DEVICES` devices already have an individual priority
+        */
+        for (uint8_t i = 0; i < priorityCount; i++) {
+            if (priorityAddress[i] == address) {
+                priorityValue[i] = priority;
+                return true;
+            }
+        }
+        if (priorityCount >= I2C_PRIORITY_DEVICES) {
+            return false;
+        }
+        priorityAddress[priorityCount] = address;
+        priorityValue[priorityCount++] = priority;
+        return true;
+    }
+
+    bool submit(uint8_t address, const uint8_t *writeData, uint8_t writeLen, uint8_t readLen,
+                uint8_t readDelayMs, I2CTransaction::Callback callback, void *context) {
+        /*! Queue a transaction
+        @param address I2C address of the device
+        @param writeData Bytes to write, copied into the transaction
+        @param writeLen Number of bytes to write, at most 4
+        @param readLen Number of bytes to read after the write, at most 8
+        @param readDelayMs Time between write and read [ms]
+        @param callback Called on completion
+        @param context Passed to the callback
+        @return false if the queue is full or the lengths are invalid, the callback is not
+        called in that case
+        */
+        if (writeLen > sizeof(queue[0].writeData) || readLen > sizeof(queue[0].readData)) {
+            return false;
+        }
+        for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+            I2CTransaction &t = queue[i];
+            if (t.state != FREE) {
+                continue;
+            }
+            t.address = address;
+            memcpy(t.writeData, writeData, writeLen);
+            t.writeLen = writeLen;
+            t.readLen = readLen;
+            t.readDelayMs = readDelayMs;
+            t.priority = devicePriority(address);
+            t.callback = callback;
+            t.context = context;
+            t.queued = millis();
+            t.busUs = 0;
+            t.state = QUEUED;
+            sequence[i] = nextSequence++;
+            if (++depth > maxDepth) {
+                maxDepth = depth;
+            }
+            return true;
+        }
+        ++rejected;
+        return false;
+    }
+
+    unsigned long transferUs(uint8_t len) const {
+        /*! Compute the bus time of a transfer, see I2CBus::transferUs() */
+        return bus.transferUs(len);
+    }
+
+    void resetStatistics() {
+        /*! Reset the statistics */
+        statsStart = millis();
+        transactions = 0;
+        failed = 0;
+        rejected = 0;
+        busyUs = 0;
+        busyMs = 0;
+        started = 0;
+        waitSumMs = 0;
+        waitMaxMs = 0;
+        maxDepth = depth;
+    }
+
+    double utilization() {
+        /*! @return Bus busy time since the last statistics reset / elapsed time [0.0-1.0] */
+        unsigned long elapsed = millis() - statsStart;
+        if (!elapsed) {
+            return 0.0;
+        }
+        return (busyMs + busyUs / 1000.0) / elapsed;
+    }
+
+  private:
+    uint8_t devicePriority(uint8_t address) {
+        for (uint8_t i = 0; i < priorityCount; i++) {
+            if (priorityAddress[i] == address) {
+                return priorityValue[i];
+            }
+        }
+        return PRIORITY_NORMAL;
+    }
+
+    bool deviceWaiting(uint8_t address) {
+        for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+            if (queue[i].state == WAITING && queue[i].address == address) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int nextTransaction(unsigned long now) {
+        // highest effective priority, oldest first
+        int best = -1;
+        long bestPriority = 0;
+        for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+            const I2CTransaction &t = queue[i];
+            if (t.state != QUEUED || deviceWaiting(t.address)) {
+                continue;
+            }
+            long priority = (long)t.priority - (long)((now - t.queued) / I2C_AGING_MS);
+            if (best < 0 || priority < bestPriority ||
+                (priority == bestPriority && sequence[i] - sequence[best] > 0x80000000UL)) {
+                best = i;
+                bestPriority = priority;
+            }
+        }
+        return best;
+    }
+
+    unsigned long transfer(uint8_t index, bool write, bool &ok) {
+        I2CTransaction &t = queue[index];
+        unsigned long start = micros();
+        if (write) {
+            ok = bus.write(t.address, t.writeData, t.writeLen);
+        } else {
+            ok = bus.read(t.address, t.readData, t.readLen) == t.readLen;
+        }
+        unsigned long us = micros() - start;
+        t.busUs += us;
+        busyUs += us;
+        if (busyUs >= 1000000UL) {
+            busyMs += busyUs / 1000;
+            busyUs %= 1000;
+        }
+        return us;
+    }
+
+    void complete(uint8_t index, bool ok) {
+        I2CTransaction &t = queue[index];
+        ++transactions;
+        if (!ok) {
+            ++failed;
+        }
+        // free the slot before the callback, which may submit the next transaction
+        t.state = FREE;
+        --depth;
+        if (t.callback) {
+            t.callback(t.context, t, ok);
+        }
+    }
+
+    void loop() {
+        unsigned long now = millis();
+        unsigned long used = 0;
+        bool ok;
+        // reads of devices that had time to prepare their response
+        for (uint8_t i = 0; i < I2C_QUEUE_SIZE && used < I2C_SLICE_US; i++) {
+            I2CTransaction &t = queue[i];
+            if (t.state == WAITING && now - t.written >= t.readDelayMs) {
+                used += transfer(i, false, ok);
+                complete(i, ok);
+            }
+        }
+        // queued transactions by priority
+        while (used < I2C_SLICE_US) {
+            // callbacks may have queued transactions while the bus was busy
+            now = millis();
+            int i = nextTransaction(now);
+            if (i < 0) {
+                break;
+            }
+            I2CTransaction &t = queue[i];
+            unsigned long wait = now - t.queued;
+            ++started;
+            waitSumMs += wait;
+            if (wait > waitMaxMs) {
+                waitMaxMs = wait;
+            }
+            ok = true;
+            if (t.writeLen) {
+                used += transfer(i, true, ok);
+            }
+            if (ok && t.readLen) {
+                if (t.readDelayMs) {
+                    t.written = now;
+                    t.state = WAITING;
+                    continue;
+                }
+                used += transfer(i, false, ok);
+            }
+            complete(i, ok);
+        }
+    }
+
+    void publishStats() {
+        char buf[192];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"transactions\":%lu,\"failed\":%lu,\"rejected\":%lu,"
+                        "\"utilization\":%.3f,\"busy\":%lu,\"wait\":%.2f,\"maxwait\":%lu,"
+                        "\"maxdepth\":%u}"),
+                   transactions, failed, rejected, utilization() * 100.0, busyMs + busyUs / 1000,
+                   started ? (double)waitSumMs / started : 0.0, waitMaxMs, maxDepth);
+        publish(PSTR("stats"), buf);
+    }
+
+    void onCommand(const char *command, const String &) {
+        // stats/get is answered by the base with publishStats()
+        if (!strcmp_P(command, PSTR("stats/reset/set"))) {
+            resetStatistics();
+        }
+    }
+};  // I2CBusManager
+
+}  // namespace ustd
@@ -0,0 +1,125 @@
+// noise_estimator.h - online estimation of sensor noise
+#pragma once
+
+namespace ustd {
+
+/*! \brief Online estimate of the white noise of a sensor signal
+
+Estimates the noise standard deviation from the high-pass residuals of consecutive samples,
+r = (x[n] - x[n-1]) / sqrt(2), whose variance equals the noise variance for white noise on a
+slowly changing signal. The variance is tracked with an exponentially weighted variant of
+Welford's algorithm, so the estimate follows slow changes of the noise level. Residuals
+larger than `clip` standard deviations (real changes of the signal) are clipped, so that
+steps do not inflate the estimate.
+
+The estimate starts from the median and the median absolute deviation of the first `WARMUP`
+residuals, so a step during the warm-up does not inflate it either. The clip limit never
+falls below `minLimit`: set it to the quantization step of the signal, otherwise a signal that
+starts constant (e.g. a dark LDR) has a zero estimate that no residual can ever leave. With
+`minLimit` 0, residuals are not clipped while the estimate is zero.
+*/
+class NoiseEstimator {
+  public:
+    double weight;  //!< Weight of a new residual, about 1 / number of samples remembered
+    double clip;    //!< Residuals are clipped to this many standard deviations
+    double minLimit = 0.0;  //!< Minimum clip limit, e.g. the quantization step of the signal
+    static const uint8_t WARMUP = 10;  //!< Number of residuals of the robust initial estimate
+
+  private:
+    double last;
+    double mean;
+    double variance;
+    unsigned long count;
+    float warmup[WARMUP];
+
+  public:
+    NoiseEstimator(double weight = 0.01, double clip = 4.0) : weight(weight), clip(clip) {
+        /*! Instantiate a noise estimator
+        @param weight Weight of a new residual, e.g. 0.01 to average about 100 samples
+        @param clip Residuals are clipped to this many standard deviations
+        */
+        reset();
+    }
+
+    void reset() {
+        /*! Discard the estimate */
+        last = 0.0;
+        mean = 0.0;
+        variance = 0.0;
+        count = 0;
+    }
+
+    void add(double x) {
+        /*! Add a sample of the signal */
+        if (count++ == 0) {
+            last = x;
+            return;
+        }
+        double r = (x - last) * M_SQRT1_2;
+        last = x;
+        if (count <= WARMUP) {
+            warmup[count - 2] = r;
+            return;
+        }
+        if (count == WARMUP + 1) {
+            warmup[WARMUP - 1] = r;
+            initialEstimate();
+            return;
+        }
+        // plain running average until the estimate has settled
+        double w = count < 1.0 / weight ? 1.0 / (count - 1) : weight;
+        double limit = clip * sqrt(variance);
+        if (limit < minLimit) {
+            limit = minLimit;
+        }
+        if (limit > 0.0) {
+            if (r - mean > limit) {
+                r = mean + limit;
+            } else if (mean - r > limit) {
+                r = mean - limit;
+            }
+        }
+        double delta = r - mean;
+        mean += w * delta;
+        variance = (1.0 - w) * (variance + w * delta * delta);
+    }
+
+    bool valid() const {
+        /*! @return true as soon as enough samples have been added for a usable estimate */
+        return count > WARMUP;
+    }
+
+    double sigma() const {
+        /*! @return Estimated noise standard deviation */
+        return sqrt(variance);
+    }
+
+  private:
+    void initialEstimate() {
+        // median and scaled MAD of the warm-up residuals, robust against a step
+        float sorted[WARMUP];
+        memcpy(sorted, warmup, sizeof(sorted));
+        sortValues(sorted);
+        mean = (sorted[WARMUP / 2 - 1] + sorted[WARMUP / 2]) / 2.0;
+        for (uint8_t i = 0; i < WARMUP; i++) {
+            sorted[i] = fabs(warmup[i] - mean);
+        }
+        sortValues(sorted);
+        double sigma = 1.4826 * (sorted[WARMUP / 2 - 1] + sorted[WARMUP / 2]) / 2.0;
+        variance = sigma * sigma;
+    }
+
+    static void sortValues(float *v) {
+        // insertion sort, WARMUP values
+        for (uint8_t i = 1; i < WARMUP; i++) {
+            float x = v[i];
+            uint8_t j = i;
+            for (; j > 0 && v[j - 1] > x; j--) {
+                v[j] = v[j - 1];
+            }
+            v[j] = x;
+        }
+    }
+};
+
+}  // namespace ustd
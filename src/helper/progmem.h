@@ -0,0 +1,17 @@
+// progmem.h - flash string functions on hosts
+#pragma once
+
+#if defined(__UNIXOID__) && !defined(PROGMEM)
+// hosts have no separate flash address space, constant strings stay where they are
+#define PROGMEM
+#define PSTR(s) (s)
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strncasecmp_P strncasecmp
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strlen_P strlen
+#define snprintf_P snprintf
+#define memcpy_P memcpy
+#endif
@@ -0,0 +1,139 @@
+// rollup.h - incrementally maintained multi-resolution aggregates
+#pragma once
+
+namespace ustd {
+
+/*! \brief Aggregate (min/max/mean) of all samples within a time bucket */
+struct RollupBucket {
+    uint32_t start;  //!< Start of the bucket [s]
+    uint32_t count;  //!< Number of samples
+    float minVal;    //!< Minimum
+    float maxVal;    //!< Maximum
+    float meanVal;   //!< Mean
+
+    void reset(uint32_t t) {
+        start = t;
+        count = 0;
+        minVal = 0.0;
+        maxVal = 0.0;
+        meanVal = 0.0;
+    }
+
+    void add(float value, uint32_t n, float minV, float maxV) {
+        if (count == 0 || minV < minVal) {
+            minVal = minV;
+        }
+        if (count == 0 || maxV > maxVal) {
+            maxVal = maxV;
+        }
+        count += n;
+        // incremental mean, stays accurate in single precision
+        meanVal += (value - meanVal) * n / count;
+    }
+};
+
+/*! \brief One resolution tier of aggregates
+
+Collects samples into buckets of a fixed length and keeps the last N completed buckets in a
+ring buffer.
+
+@tparam N Number of completed buckets to keep
+*/
+template <unsigned int N> class RollupTier {
+  public:
+    uint32_t period;  //!< Bucket length [s]
+    RollupBucket current;
+
+  private:
+    RollupBucket buckets[N];
+    unsigned int head = 0;
+    unsigned int count = 0;
+
+  public:
+    RollupTier(uint32_t period) : period(period) {
+        current.reset(0);
+    }
+
+    bool add(uint32_t time, float mean, uint32_t n, float minV, float maxV, RollupBucket *closed) {
+        /*! Add a sample or an aggregate of a finer tier
+        @param time Timestamp [s]
+        @param mean Sample value or mean of aggregate
+        @param n Number of samples (1 for a single sample)
+        @param minV Minimum (sample value for a single sample)
+        @param maxV Maximum (sample value for a single sample)
+        @param closed Receives the bucket completed by this call
+        @return true if a bucket has been completed
+        */
+        uint32_t start = time - time % period;
+        bool done = false;
+        if (current.count && start != current.start) {
+            buckets[(head + count) % N] = current;
+            if (count < N) {
+                ++count;
+            } else {
+                head = (head + 1) % N;
+            }
+            *closed = current;
+            done = true;
+        }
+        if (!current.count || start != current.start) {
+            current.reset(start);
+        }
+        current.add(mean, n, minV, maxV);
+        return done;
+    }
+
+    unsigned int length() const {
+        /*! @return Number of completed buckets */
+        return count;
+    }
+
+    const RollupBucket &operator[](unsigned int i) const {
+        /*! Access a completed bucket, 0 is the oldest one */
+        return buckets[(head + i) % N];
+    }
+};
+
+/*! \brief Per-second, per-minute and per-hour aggregates of a sample stream
+
+Every sample updates the current one-second bucket. Completed buckets cascade into the next
+coarser tier, so each sample costs O(1) and raw samples are never re-scanned.
+
+@tparam SECONDS Number of completed one-second buckets to keep
+@tparam MINUTES Number of completed one-minute buckets to keep
+@tparam HOURS Number of completed one-hour buckets to keep
+*/
+template <unsigned int SECONDS = 60, unsigned int MINUTES = 60, unsigned int HOURS = 24>
+class Rollups {
+  public:
+    RollupTier<SECONDS> seconds = RollupTier<SECONDS>(1);
+    RollupTier<MINUTES> minutes = RollupTier<MINUTES>(60);
+    RollupTier<HOURS> hours = RollupTier<HOURS>(3600);
+
+    enum Completed { SECOND = 1, MINUTE = 2, HOUR = 4 };
+
+    int add(uint32_t time, float value) {
+        /*! Add a sample
+        @param time Timestamp [s]
+        @param value Sample value
+        @return Bit mask of the tiers (Completed) in which a bucket has been completed, the
+        completed bucket is the newest one of the tier
+        */
+        RollupBucket closed;
+        int completed = 0;
+        if (seconds.add(time, value, 1, value, value, &closed)) {
+            completed |= SECOND;
+            if (minutes.add(closed.start, closed.meanVal, closed.count, closed.minVal,
+                            closed.maxVal, &closed)) {
+                completed |= MINUTE;
+                if (hours.add(closed.start, closed.meanVal, closed.count, closed.minVal,
+                              closed.maxVal, &closed)) {
+                    completed |= HOUR;
+                }
+            }
+        }
+        return completed;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,118 @@
+// rtc_store.h - checksummed storage in RTC memory that survives resets and deep sleep
+#pragma once
+
+#include "checksum.h"
+
+#if defined(__ESP32__)
+#include <esp_attr.h>
+#endif
+
+#ifndef RTC_STORE_SIZE
+#define RTC_STORE_SIZE 256  //!< Size of the simulated RTC region (ESP32 and hosts) in bytes
+#endif
+
+namespace ustd {
+
+/*! \brief Checksummed data blocks in RTC memory
+
+RTC memory keeps its content across software resets and deep sleep, but not across power
+loss. Every block is stored with a CRC-32, so that uninitialized memory after a power-on
+is reliably detected.
+
+* ESP8266: RTC user memory (`ESP.rtcUserMemoryRead/Write`), 128 words of 4 bytes. The first
+  32 words are used by the OTA bootloader, so offsets should start at 32.
+* ESP32: a `RTC_NOINIT_ATTR` buffer of `RTC_STORE_SIZE` bytes.
+* Other platforms (including hosts for tests): a plain RAM buffer of `RTC_STORE_SIZE` bytes
+  that simulates the RTC region, i.e. it survives everything except a restart of the process.
+
+Offsets are given in units of 4-byte words on all platforms.
+*/
+class RtcStore {
+  public:
+    static bool save(uint8_t offset, const void *data, uint16_t len) {
+        /*! Store a data block
+        @param offset Start of the block in 4-byte words
+        @param data Data to store
+        @param len Length of data in bytes, at most 128
+        @return true on success
+        */
+        uint32_t crc = crc32(data, len);
+        return writeWords(offset, &crc, 4) && writeWords(offset + 1, data, len);
+    }
+
+    static bool load(uint8_t offset, void *data, uint16_t len) {
+        /*! Restore a data block
+        @param offset Start of the block in 4-byte words
+        @param data Receives the data
+        @param len Length of data in bytes
+        @return true if a valid block has been restored
+        */
+        uint32_t crc;
+        return readWords(offset, &crc, 4) && readWords(offset + 1, data, len) &&
+               crc == crc32(data, len);
+    }
+
+    static void invalidate(uint8_t offset) {
+        /*! Invalidate a data block
+        @param offset Start of the block in 4-byte words
+        */
+        uint32_t crc = 0;
+        uint32_t data = 0xffffffff;  // crc32 of a single 0xffffffff word is not 0
+        writeWords(offset, &crc, 4);
+        writeWords(offset + 1, &data, 4);
+    }
+
+  private:
+    static uint16_t words(uint16_t len) {
+        return (len + 3) / 4;
+    }
+
+#if defined(__ESP__) && !defined(__ESP32__)
+    static bool writeWords(uint8_t offset, const void *data, uint16_t len) {
+        // rtcUserMemoryWrite needs word aligned data
+        uint32_t buf[32];
+        if (len > sizeof(buf)) {
+            return false;
+        }
+        buf[words(len) - 1] = 0;
+        memcpy(buf, data, len);
+        return ESP.rtcUserMemoryWrite(offset, buf, words(len) * 4);
+    }
+
+    static bool readWords(uint8_t offset, void *data, uint16_t len) {
+        uint32_t buf[32];
+        if (len > sizeof(buf) || !ESP.rtcUserMemoryRead(offset, buf, words(len) * 4)) {
+            return false;
+        }
+        memcpy(data, buf, len);
+        return true;
+    }
+#else
+    static uint8_t *region() {
+#if defined(__ESP32__)
+        static RTC_NOINIT_ATTR uint32_t rtcRegion[RTC_STORE_SIZE / 4];
+#else
+        static uint32_t rtcRegion[RTC_STORE_SIZE / 4];
+#endif
+        return (uint8_t *)rtcRegion;
+    }
+
+    static bool writeWords(uint8_t offset, const void *data, uint16_t len) {
+        if ((unsigned int)offset * 4 + words(len) * 4 > RTC_STORE_SIZE) {
+            return false;
+        }
+        memcpy(region() + offset * 4, data, len);
+        return true;
+    }
+
+    static bool readWords(uint8_t offset, void *data, uint16_t len) {
+        if ((unsigned int)offset * 4 + words(len) * 4 > RTC_STORE_SIZE) {
+            return false;
+        }
+        memcpy(data, region() + offset * 4, len);
+        return true;
+    }
+#endif
+};
+
+}  // namespace ustd
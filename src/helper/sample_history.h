@@ -0,0 +1,84 @@
+// sample_history.h - fixed-size in-RAM ring buffer of timestamped samples
+#pragma once
+
+namespace ustd {
+
+/*! \brief Fixed-size ring buffer of timestamped sensor samples
+
+Keeps the last N samples in a statically sized buffer. When the buffer is full, the oldest
+sample is overwritten. Samples must be added with non-decreasing timestamps, which allows
+range lookups by binary search.
+
+@tparam N Number of samples to keep
+*/
+template <unsigned int N> class SampleHistory {
+  public:
+    struct Sample {
+        uint32_t time;  //!< Timestamp [s]
+        float value;    //!< Sample value
+    };
+
+  private:
+    Sample samples[N];
+    unsigned int head = 0;  // index of the oldest sample
+    unsigned int count = 0;
+
+  public:
+    void clear() {
+        /*! Discard all samples */
+        head = 0;
+        count = 0;
+    }
+
+    void add(uint32_t time, float value) {
+        /*! Add a sample, overwriting the oldest one if the buffer is full
+        @param time Timestamp of the sample, must not be older than the last sample
+        @param value Sample value
+        */
+        unsigned int i = (head + count) % N;
+        samples[i].time = time;
+        samples[i].value = value;
+        if (count < N) {
+            ++count;
+        } else {
+            head = (head + 1) % N;
+        }
+    }
+
+    unsigned int length() const {
+        /*! @return Number of samples currently stored */
+        return count;
+    }
+
+    unsigned int capacity() const {
+        /*! @return Maximum number of samples */
+        return N;
+    }
+
+    const Sample &operator[](unsigned int i) const {
+        /*! Access a sample, 0 is the oldest sample
+        @param i Index, must be less than length()
+        */
+        return samples[(head + i) % N];
+    }
+
+    unsigned int lowerBound(uint32_t time) const {
+        /*! Find the first sample not older than a given time
+        @param time Timestamp to look for
+        @return Index of the first sample with a timestamp >= time, length() if there is none
+        */
+        unsigned int lo = 0;
+        unsigned int hi = count;
+        while (lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            if ((*this)[mid].time < time) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,286 @@
+// sample_log.h - append-only, block buffered sample log on flash
+#pragma once
+
+#include "progmem.h"
+#include "flash_file.h"
+#include "checksum.h"
+
+namespace ustd {
+
+/*! \brief Append-only log of binary records on flash
+
+The log consists of a fixed number of segment files `<prefix>.<n>.log` that are written
+round-robin: when the current segment is full, the oldest one is overwritten. This spreads
+writes evenly over the whole log area (on top of the file system's own wear leveling) and
+bounds the flash space used.
+
+Records are collected in a RAM block of BLOCK_SIZE bytes (ideally a multiple of the flash
+page size) and written to flash only when the block is full or sync() is called, which keeps
+the write amplification of small records low. Records that are still in the RAM block are
+lost on power failure.
+
+Each record is framed with a marker byte, its length and a CRC-8. On begin() the newest segment
+is verified; a torn write at its end is detected and writing continues with a fresh segment,
+so that readers always stop at the last intact record.
+
+@tparam BLOCK_SIZE Size of the RAM write buffer in bytes
+*/
+template <unsigned int BLOCK_SIZE = 256> class SampleLog {
+  public:
+    /*! \brief Cursor for reading the log from the oldest to the newest record */
+    struct Cursor {
+        uint32_t seq;  //!< Sequence number of the segment
+        uint32_t pos;  //!< Position in the segment file
+    };
+
+    /*! \brief Write statistics */
+    struct Stats {
+        unsigned long records;       //!< Records appended
+        unsigned long payloadBytes;  //!< Payload bytes appended
+        unsigned long bytesWritten;  //!< Bytes written to flash, including framing and headers
+        unsigned long blockWrites;   //!< Number of write operations
+        unsigned long pagesWritten;  //!< Flash pages touched by all write operations
+        unsigned long tornBytes;     //!< Bytes discarded by recovery after a torn write
+    };
+
+    Stats stats;
+    uint16_t pageSize = 256;  //!< Flash page size used for the write amplification estimate
+
+  private:
+    static const uint32_t SEGMENT_MAGIC = 0x314c4753;  // "SGL1"
+    static const uint8_t RECORD_MARKER = 0xa5;
+    static const uint8_t HEADER_SIZE = 8;
+
+    char prefix[32];
+    uint8_t segments = 0;
+    uint32_t segmentSize;
+    uint8_t curSegment;
+    uint32_t curSeq;
+    uint32_t curSize;
+    uint8_t block[BLOCK_SIZE];
+    unsigned int blockFill = 0;
+    FlashFile writer;
+    FlashFile reader;
+    uint32_t readerSeq = 0;
+
+  public:
+    SampleLog() {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    bool begin(const char *filePrefix, uint8_t segmentCount = 4, uint32_t maxSegmentSize = 16384) {
+        /*! Open the log and recover its state
+        @param filePrefix Path prefix of the segment files, e.g. `/ldr`
+        @param segmentCount Number of segment files
+        @param maxSegmentSize Maximum size of a segment file in bytes
+        @return true on success
+        */
+        strncpy(prefix, filePrefix, sizeof(prefix) - 1);
+        prefix[sizeof(prefix) - 1] = 0;
+        segments = segmentCount < 2 ? 2 : segmentCount;
+        segmentSize = maxSegmentSize < HEADER_SIZE + BLOCK_SIZE ? HEADER_SIZE + BLOCK_SIZE
+                                                               : maxSegmentSize;
+        blockFill = 0;
+        curSeq = 0;
+        for (uint8_t i = 0; i < segments; i++) {
+            uint32_t seq = readSegmentSeq(i);
+            if (seq > curSeq) {
+                curSeq = seq;
+                curSegment = i;
+            }
+        }
+        if (curSeq == 0) {
+            curSegment = segments - 1;
+            return startSegment();
+        }
+        // verify the newest segment, a torn record ends the segment
+        char path[48];
+        segmentPath(curSegment, path);
+        if (!reader.open(path, "r")) {
+            return startSegment();
+        }
+        uint32_t fileSize = reader.size();
+        uint32_t pos = HEADER_SIZE;
+        uint8_t buf[255];
+        uint8_t len;
+        while (readRecord(reader, &pos, buf, &len)) {
+        }
+        reader.close();
+        readerSeq = 0;
+        if (pos < fileSize) {
+            stats.tornBytes += fileSize - pos;
+            return startSegment();
+        }
+        curSize = pos;
+        return writer.open(path, "a");
+    }
+
+    bool append(const void *payload, uint8_t len) {
+        /*! Append a record
+        @param payload Record data
+        @param len Length of record data, at most BLOCK_SIZE - 3 bytes
+        @return true on success
+        */
+        unsigned int recLen = len + 3;
+        if (!segments || recLen > BLOCK_SIZE) {
+            return false;
+        }
+        if (blockFill + recLen > BLOCK_SIZE && !flushBlock()) {
+            return false;
+        }
+        if (curSize + blockFill + recLen > segmentSize) {
+            if (!flushBlock() || !startSegment()) {
+                return false;
+            }
+        }
+        block[blockFill] = RECORD_MARKER;
+        block[blockFill + 1] = len;
+        memcpy(block + blockFill + 2, payload, len);
+        block[blockFill + 2 + len] = crc8(block + blockFill + 1, len + 1);
+        blockFill += recLen;
+        ++stats.records;
+        stats.payloadBytes += len;
+        return true;
+    }
+
+    bool sync() {
+        /*! Write the RAM block to flash, even if it is not full
+        @return true on success
+        */
+        if (!flushBlock()) {
+            return false;
+        }
+        writer.flush();
+        return true;
+    }
+
+    double writeAmplification() const {
+        /*! Estimated write amplification: flash bytes programmed per payload byte
+        @return Ratio of flash pages touched (times page size) to payload bytes
+        */
+        return stats.payloadBytes ? (double)stats.pagesWritten * pageSize / stats.payloadBytes
+                                  : 0.0;
+    }
+
+    void rewind(Cursor *cursor) const {
+        /*! Position a cursor at the oldest record */
+        cursor->seq = curSeq >= segments ? curSeq - segments + 1 : 1;
+        cursor->pos = HEADER_SIZE;
+    }
+
+    bool read(Cursor *cursor, void *payload, uint8_t *len) {
+        /*! Read the next record; records still held in the RAM block are not visible
+        @param cursor Read position, advanced past the record
+        @param payload Receives the record data, must hold 255 bytes
+        @param len Receives the length of the record data
+        @return false if there are no more records
+        */
+        while (cursor->seq <= curSeq) {
+            if (readerSeq != cursor->seq) {
+                readerSeq = 0;
+                char path[48];
+                segmentPath(segmentOf(cursor->seq), path);
+                if (reader.open(path, "r") && readHeader(reader) == cursor->seq) {
+                    readerSeq = cursor->seq;
+                }
+            }
+            if (readerSeq && readRecord(reader, &cursor->pos, (uint8_t *)payload, len)) {
+                return true;
+            }
+            ++cursor->seq;
+            cursor->pos = HEADER_SIZE;
+        }
+        reader.close();
+        readerSeq = 0;
+        return false;
+    }
+
+  private:
+    void segmentPath(uint8_t segment, char *path) const {
+        snprintf_P(path, 48, PSTR("%s.%u.log"), prefix, (unsigned int)segment);
+    }
+
+    uint8_t segmentOf(uint32_t seq) const {
+        return (curSegment + segments - (curSeq - seq) % segments) % segments;
+    }
+
+    static uint32_t readHeader(FlashFile &f) {
+        uint32_t header[2];
+        if (!f.seek(0) || f.read(header, sizeof(header)) != sizeof(header) ||
+            header[0] != SEGMENT_MAGIC) {
+            return 0;
+        }
+        return header[1];
+    }
+
+    uint32_t readSegmentSeq(uint8_t segment) {
+        char path[48];
+        segmentPath(segment, path);
+        if (!FlashFile::exists(path) || !reader.open(path, "r")) {
+            return 0;
+        }
+        uint32_t seq = readHeader(reader);
+        reader.close();
+        return seq;
+    }
+
+    static bool readRecord(FlashFile &f, uint32_t *pos, uint8_t *payload, uint8_t *len) {
+        uint8_t head[2];
+        uint8_t crc;
+        if (!f.seek(*pos) || f.read(head, 2) != 2 || head[0] != RECORD_MARKER) {
+            return false;
+        }
+        if (f.read(payload, head[1]) != head[1] || f.read(&crc, 1) != 1) {
+            return false;
+        }
+        if (crc8(payload, head[1], crc8(head + 1, 1)) != crc) {
+            return false;
+        }
+        *len = head[1];
+        *pos += head[1] + 3;
+        return true;
+    }
+
+    bool startSegment() {
+        writer.close();
+        if (readerSeq) {
+            reader.close();
+            readerSeq = 0;
+        }
+        curSegment = (curSegment + 1) % segments;
+        ++curSeq;
+        char path[48];
+        segmentPath(curSegment, path);
+        uint32_t header[2] = {SEGMENT_MAGIC, curSeq};
+        curSize = 0;
+        if (!writer.open(path, "w")) {
+            return false;
+        }
+        return writeBytes(header, sizeof(header));
+    }
+
+    bool flushBlock() {
+        if (!blockFill) {
+            return true;
+        }
+        bool ok = writeBytes(block, blockFill);
+        blockFill = 0;
+        return ok;
+    }
+
+    bool writeBytes(const void *data, unsigned int len) {
+        size_t n = writer.write(data, len);
+        ++stats.blockWrites;
+        if (!n) {
+            // nothing reached the flash, e.g. a failed header write of a new segment
+            return n == len;
+        }
+        stats.bytesWritten += n;
+        // pages touched by the bytes [curSize, curSize + n)
+        stats.pagesWritten += (curSize + n - 1) / pageSize - curSize / pageSize + 1;
+        curSize += n;
+        return n == len;
+    }
+};
+
+}  // namespace ustd
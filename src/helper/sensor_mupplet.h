@@ -0,0 +1,408 @@
+// sensor_mupplet.h - common base of the sensor mupplets
+#pragma once
+
+#include "scheduler.h"
+#include "sensors.h"
+#include "progmem.h"
+#include "flash_file.h"
+#include "checksum.h"
+
+#ifndef SENSOR_TOPIC_SIZE
+#define SENSOR_TOPIC_SIZE 80  //!< Buffer size for topics, including the terminating zero
+#endif
+#ifndef SENSOR_CONST_SIZE
+#define SENSOR_CONST_SIZE 24  //!< Buffer size for constant messages read from flash
+#endif
+
+namespace ustd {
+
+// names of SensorMupplet::FilterMode, shared by all sensor mupplets
+static const char sensorFilterModeNames[][9] PROGMEM = {"FAST", "MEDIUM", "LONGTERM"};
+// topic infix of the sensor mupplets, <name>/sensor/<command>
+static const char sensorTopicInfix[] PROGMEM = "/sensor/";
+
+/*! \brief Parameters of the sensorprocessor of one SensorMupplet::FilterMode
+
+A sensor keeps one entry per filter mode (`FAST`, `MEDIUM`, `LONGTERM`) in a `PROGMEM` table
+and passes it to `SensorMupplet::setFilter()`.
+*/
+struct SensorFilterParameters {
+    unsigned int smoothInterval;  //!< Number of values in the running average
+    unsigned int pollTimeSec;     //!< Maximum time without publish [s]
+    double eps;                   //!< Minimum change of the filtered value that is published
+};
+
+// clang-format off
+/*! \brief Common base of the sensor mupplets
+
+SensorMupplet implements the infrastructure every sensor mupplet needs: the scheduler task,
+the subscription of `<name>/sensor/#`, building topics, dispatching received commands,
+filter modes, runtime statistics and persisted configuration records. It is a CRTP base:
+the calls into the sensor are resolved at compile time, there are no virtual functions and no
+vtable, and the base allocates nothing on the heap. Topics are built in a stack buffer, received
+topics are dispatched by comparing the suffix behind `<name>/sensor/` in place, instead of
+concatenating a `String` for every candidate topic.
+
+Constant strings (topics, commands, formats and names) are kept in flash with `PSTR()` and
+`PROGMEM`: on ESP8266 string literals would otherwise occupy DRAM for the lifetime of the
+program. `publish()` expects its topic, `publish_P()` additionally its message in flash,
+topics built at runtime in RAM go to `publishTopic()`. `filterModeName()` returns a flash
+string. Flash strings are copied into stack buffers, never into heap `String`s. On ESP32 and
+hosts `PROGMEM` has no effect. A message whose topic does not fit into `SENSOR_TOPIC_SIZE` (or constant message into `SENSOR_CONST_SIZE`) is not
+sent truncated, it is dropped and counted in the statistics.
+
+A sensor that smoothes its values with a `sensorprocessor` registers it together with a table
+of its parameters per filter mode with `setFilter()`. `setFilterMode()` then applies the
+parameters, calls the optional `onFilterMode()` of the sensor for additional settings and
+publishes the mode, and the base handles `mode/get` and `mode/set`.
+
+Mupplets whose topics have no `sensor` part, like the I2CBusManager, pass another infix, e.g.
+`"/"` for `<name>/<command>`. They can also replace the statistics message by implementing
+`publishStats()`.
+
+A sensor derives from `SensorMupplet<Sensor>` and implements `loop()` and `onCommand()`:
+
+```cpp
+class MySensor : public SensorMupplet<MySensor> {
+    friend class SensorMupplet<MySensor>;
+
+  public:
+    ustd::sensorprocessor valueSensor = ustd::sensorprocessor(4, 600, 0.1);
+
+    MySensor(String name) : SensorMupplet(name) {
+        setFilter(&valueSensor, mySensorFilterParameters);  // PROGMEM table, FAST..LONGTERM
+        setFilterMode(MEDIUM, true);
+    }
+    void begin(Scheduler *_pSched) {
+        startTask(_pSched, 100000);  // 100ms
+    }
+
+  private:
+    void loop() {
+        // sample, publish(PSTR("value"), buf) on change
+    }
+    void onCommand(const char *command, const String &msg) {
+        // command is the topic behind <name>/sensor/, e.g. "threshold/set"
+        if (!strcmp_P(command, PSTR("threshold/set"))) {
+            // ...
+        }
+    }
+};
+```
+
+#### Messages handled by the base:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<mupplet-name>/sensor/stats/get` | - | Returns the runtime statistics
+| `<mupplet-name>/sensor/stats` | JSON object | `ticks` task calls, `maxtick` longest task call [µs], `publishes` messages sent, `received` messages received (including own messages), `dropped` messages not sent because the topic or constant message was too long
+| `<mupplet-name>/sensor/mode/get` | - | Returns the filter mode: `FAST`, `MEDIUM`, or `LONGTERM` (sensors with a filter only)
+| `<mupplet-name>/sensor/mode/set` | `FAST`, `MEDIUM`, or `LONGTERM` | Sets the filter mode (sensors with a filter only)
+*/
+// clang-format on
+template <class Sensor> class SensorMupplet {
+  public:
+    enum FilterMode { FAST, MEDIUM, LONGTERM };
+
+    struct Statistics {
+        unsigned long ticks;      //!< Number of task calls
+        unsigned long maxTickUs;  //!< Longest task call [µs]
+        unsigned long publishes;  //!< Number of messages sent
+        unsigned long received;   //!< Number of messages received
+        unsigned long dropped;    //!< Number of messages not sent because they did not fit
+    };
+
+    FilterMode filterMode = MEDIUM;  //!< Current filter mode, see setFilterMode()
+
+    void setFilterMode(FilterMode mode, bool silent = false) {
+        /*! Set the filtering of sensor values from the parameter table of the sensor
+        @param mode FAST, MEDIUM or LONGTERM
+        @param silent If true, the new mode is not published
+        */
+        filterMode = mode <= LONGTERM ? mode : LONGTERM;
+        if (pFilter && filterParameters) {
+            SensorFilterParameters p;
+            memcpy_P(&p, &filterParameters[filterMode], sizeof(p));
+            pFilter->smoothInterval = p.smoothInterval;
+            pFilter->pollTimeSec = p.pollTimeSec;
+            pFilter->eps = p.eps;
+            pFilter->reset();
+        }
+        static_cast<Sensor *>(this)->onFilterMode();
+        if (!silent)
+            publishFilterMode();
+    }
+
+  protected:
+    Scheduler *pSched = nullptr;
+    int tID = -1;
+    unsigned long taskIntervalUs = 0;  // interval of loop() calls [µs], set by startTask()
+    String name;
+    const char *infix;  // in flash, between name and command
+    bool bActive = false;
+    Statistics stats;
+    sensorprocessor *pFilter = nullptr;
+    const SensorFilterParameters *filterParameters = nullptr;  // in flash, one per FilterMode
+
+    SensorMupplet(String name, const char *infix = sensorTopicInfix) : name(name), infix(infix) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    void startTask(Scheduler *_pSched, unsigned long intervalUs) {
+        /*! Register the task of the sensor and subscribe to its commands
+        @param _pSched Pointer to the muwerk scheduler
+        @param intervalUs Interval of `loop()` calls [µs]
+        */
+        pSched = _pSched;
+        taskIntervalUs = intervalUs;
+        auto ft = [=]() { this->tick(); };
+        tID = pSched->add(ft, name, intervalUs);
+
+        auto fnall = [=](String topic, String msg, String) {
+            this->dispatch(topic, msg);
+        };
+        char topic[SENSOR_TOPIC_SIZE];
+        if (buildTopic(topic, sizeof(topic), PSTR("#"))) {
+            pSched->subscribe(tID, topic, fnall);
+        }
+        bActive = true;
+    }
+
+    bool buildTopic(char *buf, unsigned int len, const char *topic, bool topicInFlash = true) {
+        /*! Build the topic `<name>/sensor/<topic>`
+        @param buf Receives the topic
+        @param len Size of buf
+        @param topic Topic suffix
+        @param topicInFlash true if topic is in flash, false if it is in RAM
+        @return false if the topic does not fit into buf
+        */
+        int pos = snprintf_P(buf, len, PSTR("%s"), name.c_str());
+        unsigned int infixLen = strlen_P(infix);
+        unsigned int topicLen = topicInFlash ? strlen_P(topic) : strlen(topic);
+        if (pos < 0 || pos + infixLen + topicLen >= len) {
+            return false;
+        }
+        strncpy_P(buf + pos, infix, len - pos);
+        if (topicInFlash) {
+            strncpy_P(buf + pos + infixLen, topic, len - pos - infixLen);
+        } else {
+            memcpy(buf + pos + infixLen, topic, topicLen);
+        }
+        buf[pos + infixLen + topicLen] = 0;
+        return true;
+    }
+
+    bool publish(const char *topic, const char *msg) {
+        /*! Publish a message to `<name>/sensor/<topic>`
+        @param topic Topic suffix in flash (`PSTR()`)
+        @param msg Message
+        @return false if the topic exceeds `SENSOR_TOPIC_SIZE`, nothing is sent in that case
+        */
+        char buf[SENSOR_TOPIC_SIZE];
+        if (!buildTopic(buf, sizeof(buf), topic)) {
+            ++stats.dropped;
+            return false;
+        }
+        ++stats.publishes;
+        pSched->publish(buf, msg);
+        return true;
+    }
+
+    bool publish(const char *topic, const String &msg) {
+        /*! Publish a message to `<name>/sensor/<topic>`, topic in flash */
+        return publish(topic, msg.c_str());
+    }
+
+    bool publishTopic(const char *topic, const char *msg) {
+        /*! Publish a message to `<name>/sensor/<topic>`, topic in RAM
+        @param topic Topic suffix in RAM, e.g. built at runtime
+        @param msg Message
+        @return false if the topic exceeds `SENSOR_TOPIC_SIZE`, nothing is sent in that case
+        */
+        char buf[SENSOR_TOPIC_SIZE];
+        if (!buildTopic(buf, sizeof(buf), topic, false)) {
+            ++stats.dropped;
+            return false;
+        }
+        ++stats.publishes;
+        pSched->publish(buf, msg);
+        return true;
+    }
+
+    bool publish_P(const char *topic, const char *msg) {
+        /*! Publish a constant message to `<name>/sensor/<topic>`, topic and message in flash
+        @return false if the message exceeds `SENSOR_CONST_SIZE` or the topic
+        `SENSOR_TOPIC_SIZE`, nothing is sent in that case
+        */
+        char buf[SENSOR_CONST_SIZE];
+        if (strlen_P(msg) >= sizeof(buf)) {
+            ++stats.dropped;
+            return false;
+        }
+        strcpy_P(buf, msg);
+        return publish(topic, buf);
+    }
+
+    template <class P> void publishPipeline(const P &pipeline) {
+        /*! Publish the stage sequence of a DynamicPipeline to `<name>/sensor/pipeline` */
+        char buf[64];
+        pipeline.describe(buf, sizeof(buf));
+        publish(PSTR("pipeline"), buf);
+    }
+
+    template <class P> void publishPipelineStage(const P &pipeline, uint8_t stage) {
+        /*! Publish the parameter of a stage of a DynamicPipeline to
+        `<name>/sensor/pipeline/<stage>`, nothing if the stage is invalid */
+        char buf[32];
+        char topic[24];
+        if (pipeline.formatParameter(stage, buf, sizeof(buf)) < 0) {
+            return;
+        }
+        // stage names are at most 10 characters, the name is in flash and cannot go to "%s"
+        strcpy_P(topic, PSTR("pipeline/"));
+        strncpy_P(topic + 9, pipeline.name(stage), sizeof(topic) - 9);
+        topic[sizeof(topic) - 1] = 0;
+        publishTopic(topic, buf);
+    }
+
+    void setFilter(sensorprocessor *filter, const SensorFilterParameters *parameters) {
+        /*! Register the sensorprocessor that is configured by the filter mode
+        @param filter Filter of the sensor values
+        @param parameters `PROGMEM` table with the parameters of FAST, MEDIUM and LONGTERM
+        */
+        pFilter = filter;
+        filterParameters = parameters;
+    }
+
+    void onFilterMode() {
+        /*! Called by setFilterMode() after the filter parameters are applied, a sensor can
+        hide this to adjust further settings */
+    }
+
+    void publishFilterMode() {
+        /*! Publish the filter mode to `<name>/sensor/mode` */
+        publish_P(PSTR("mode"), filterModeName(filterMode));
+    }
+
+    static const char *filterModeName(FilterMode mode) {
+        /*! @return `FAST`, `MEDIUM` or `LONGTERM`, in flash */
+        return sensorFilterModeNames[mode <= LONGTERM ? mode : LONGTERM];
+    }
+
+    static FilterMode parseFilterMode(const String &msg) {
+        /*! @return The filter mode named by msg (case insensitive), LONGTERM if unknown */
+        for (uint8_t mode = FAST; mode < LONGTERM; mode++) {
+            if (!strcasecmp_P(msg.c_str(), sensorFilterModeNames[mode])) {
+                return (FilterMode)mode;
+            }
+        }
+        return LONGTERM;
+    }
+
+    static bool splitAction(const char *topic, const char *action, char *head, unsigned int len) {
+        /*! Split a command `<head><action>`, e.g. `pipeline/ema/set` behind `pipeline/`
+        @param topic Command
+        @param action Expected end of the command in flash, e.g. `/set`
+        @param head Receives the part before action
+        @param len Size of head
+        @return false if the command does not end with action or head is too small
+        */
+        unsigned int actionLen = strlen_P(action);
+        unsigned int topicLen = strlen(topic);
+        if (topicLen < actionLen || topicLen - actionLen >= len ||
+            strcmp_P(topic + topicLen - actionLen, action)) {
+            return false;
+        }
+        memcpy(head, topic, topicLen - actionLen);
+        head[topicLen - actionLen] = 0;
+        return true;
+    }
+
+    void recordPath(char *path, unsigned int len, const char *ext) {
+        /*! Path of the file `/<name>.<ext>`, ext in flash */
+        int pos = snprintf_P(path, len, PSTR("/%s."), name.c_str());
+        if (pos < (int)len) {
+            strncpy_P(path + pos, ext, len - pos);
+        }
+        path[len - 1] = 0;
+    }
+
+    template <class Record>
+    bool readRecord(const char *ext, Record *rec, uint32_t magic, uint8_t version) {
+        /*! Read a record from the file `/<name>.<ext>`, ext in flash
+
+        The record must start with the members `uint32_t magic` and `uint8_t version` and end
+        with `uint32_t crc`.
+        @return false if the file is missing, or the record is invalid or of another version
+        */
+        char path[48];
+        recordPath(path, sizeof(path), ext);
+        FlashFile f;
+        if (!f.open(path, "r") || f.read(rec, sizeof(Record)) != sizeof(Record)) {
+            return false;
+        }
+        return rec->magic == magic && rec->version == version &&
+               rec->crc == crc32(rec, sizeof(Record) - sizeof(rec->crc));
+    }
+
+    template <class Record> bool writeRecord(const char *ext, Record *rec) {
+        /*! Write a record to the file `/<name>.<ext>` (ext in flash), magic and version must be set
+        @return false if the file could not be written
+        */
+        rec->crc = crc32(rec, sizeof(Record) - sizeof(rec->crc));
+        char path[48];
+        recordPath(path, sizeof(path), ext);
+        FlashFile f;
+        return f.open(path, "w") && f.write(rec, sizeof(Record)) == sizeof(Record);
+    }
+
+  private:
+    void tick() {
+        unsigned long start = micros();
+        static_cast<Sensor *>(this)->loop();
+        unsigned long dt = micros() - start;
+        ++stats.ticks;
+        if (dt > stats.maxTickUs) {
+            stats.maxTickUs = dt;
+        }
+    }
+
+    void dispatch(const String &topic, const String &msg) {
+        // topic is <name>/sensor/<command>
+        const char *t = topic.c_str();
+        unsigned int len = name.length();
+        unsigned int infixLen = strlen_P(infix);
+        if (strncmp(t, name.c_str(), len) || strncmp_P(t + len, infix, infixLen)) {
+            return;
+        }
+        const char *command = t + len + infixLen;
+        ++stats.received;
+        if (!strcmp_P(command, PSTR("stats/get"))) {
+            static_cast<Sensor *>(this)->publishStats();
+            return;
+        }
+        if (pFilter && !strcmp_P(command, PSTR("mode/get"))) {
+            publishFilterMode();
+            return;
+        }
+        if (pFilter && !strcmp_P(command, PSTR("mode/set"))) {
+            setFilterMode(parseFilterMode(msg));
+            return;
+        }
+        static_cast<Sensor *>(this)->onCommand(command, msg);
+    }
+
+  protected:
+    void publishStats() {
+        /*! Publish the runtime statistics to `<name>/sensor/stats`, a sensor can hide this to
+        publish its own statistics */
+        char buf[128];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"ticks\":%lu,\"maxtick\":%lu,\"publishes\":%lu,\"received\":%lu,"
+                        "\"dropped\":%lu}"),
+                   stats.ticks, stats.maxTickUs, stats.publishes, stats.received, stats.dropped);
+        publish(PSTR("stats"), buf);
+    }
+};
+
+}  // namespace ustd
@@ -0,0 +1,162 @@
+// sliding_median.h - sliding window median and Hampel outlier filter
+#pragma once
+
+namespace ustd {
+
+/*! \brief Median and median absolute deviation of a sliding window
+
+Keeps the last N samples both in arrival order (to know which sample leaves the window) and
+in sorted order. Sorted positions are found by binary search, so an update costs O(log N)
+comparisons plus one move of at most N values, instead of re-sorting the window for every
+sample. The median is available in O(1), the median absolute deviation (MAD) in O(log N) by
+a k-th element search over the two sorted halves around the median.
+
+For an even number of samples the lower median is used.
+
+@tparam N Window size
+*/
+template <unsigned int N> class SlidingMedian {
+  private:
+    double ring[N];
+    double sorted[N];
+    unsigned int head = 0;
+    unsigned int count = 0;
+
+  public:
+    void reset() {
+        /*! Discard all samples */
+        head = 0;
+        count = 0;
+    }
+
+    void add(double x) {
+        /*! Add a sample, removing the oldest one if the window is full */
+        if (count == N) {
+            unsigned int i = position(ring[head]);
+            memmove(sorted + i, sorted + i + 1, (count - i - 1) * sizeof(double));
+            --count;
+        }
+        unsigned int i = position(x);
+        memmove(sorted + i + 1, sorted + i, (count - i) * sizeof(double));
+        sorted[i] = x;
+        ++count;
+        ring[head] = x;
+        head = (head + 1) % N;
+    }
+
+    unsigned int length() const {
+        /*! @return Number of samples in the window */
+        return count;
+    }
+
+    double median() const {
+        /*! @return Median of the window, 0.0 if empty */
+        return count ? sorted[(count - 1) / 2] : 0.0;
+    }
+
+    double mad() const {
+        /*! @return Median absolute deviation from the median, 0.0 if empty */
+        if (!count) {
+            return 0.0;
+        }
+        // deviations left of the median (ascending): med - sorted[m - i], i = 0..m
+        // deviations right of the median (ascending): sorted[m + 1 + j] - med
+        int m = (count - 1) / 2;
+        int a = m + 1;
+        int b = count - a;
+        int k = (count - 1) / 2;
+        int lo = k + 1 - b > 0 ? k + 1 - b : 0;
+        int hi = k + 1 < a ? k + 1 : a;
+        while (lo <= hi) {
+            int i = (lo + hi) / 2;  // deviations taken from the left side
+            int j = k + 1 - i;      // deviations taken from the right side
+            if (i < a && j > 0 && right(m, j - 1) > left(m, i)) {
+                lo = i + 1;
+            } else if (i > 0 && j < b && left(m, i - 1) > right(m, j)) {
+                hi = i - 1;
+            } else {
+                if (i == 0) {
+                    return right(m, j - 1);
+                }
+                if (j == 0) {
+                    return left(m, i - 1);
+                }
+                double l = left(m, i - 1);
+                double r = right(m, j - 1);
+                return l > r ? l : r;
+            }
+        }
+        return 0.0;
+    }
+
+  private:
+    unsigned int position(double x) const {
+        // first index with sorted[i] >= x
+        unsigned int lo = 0;
+        unsigned int hi = count;
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            if (sorted[mid] < x) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    double left(int m, int i) const {
+        return sorted[m] - sorted[m - i];
+    }
+
+    double right(int m, int j) const {
+        return sorted[m + 1 + j] - sorted[m];
+    }
+};
+
+/*! \brief Hampel outlier filter
+
+Replaces a sample by the median of the sliding window (including the sample) if it deviates
+from the median by more than threshold times the robust standard deviation estimate
+1.4826 * MAD. A minimum deviation avoids rejecting every change of a quantized signal whose
+MAD is zero.
+
+@tparam N Window size, an odd size of 5 to 11 is typical
+*/
+template <unsigned int N> class HampelFilter {
+  public:
+    SlidingMedian<N> window;
+    double threshold;     //!< Rejection threshold in robust standard deviations
+    double minDeviation;  //!< Deviations up to this value are never rejected
+    bool medianOnly;      //!< If true, always output the median (plain median filter)
+    unsigned long rejected = 0;  //!< Number of rejected samples
+
+    HampelFilter(double threshold = 3.0, double minDeviation = 0.0, bool medianOnly = false)
+        : threshold(threshold), minDeviation(minDeviation), medianOnly(medianOnly) {
+    }
+
+    void reset() {
+        /*! Discard the window */
+        window.reset();
+    }
+
+    double filter(double x) {
+        /*! Filter a sample
+        @param x Sample value
+        @return Filtered value
+        */
+        window.add(x);
+        double med = window.median();
+        if (medianOnly) {
+            return med;
+        }
+        double dev = x > med ? x - med : med - x;
+        if (dev > minDeviation && dev > threshold * 1.4826 * window.mad()) {
+            ++rejected;
+            return med;
+        }
+        return x;
+    }
+};
+
+}  // namespace ustd
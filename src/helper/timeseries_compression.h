@@ -0,0 +1,323 @@
+// timeseries_compression.h - streaming compression of timestamped samples
+#pragma once
+
+namespace ustd {
+
+/*! \brief Bit-granular writer into a fixed byte buffer (MSB first) */
+class BitWriter {
+  public:
+    uint8_t *buf;
+    unsigned int size;  //!< Capacity in bytes
+    unsigned long pos;  //!< Number of bits written
+
+    BitWriter(uint8_t *buf = nullptr, unsigned int size = 0) : buf(buf), size(size), pos(0) {
+    }
+
+    bool write(uint32_t value, uint8_t bits) {
+        /*! Append the lowest bits of a value
+        @param value Value to write
+        @param bits Number of bits to write [0-32]
+        @return false if the buffer is full, the write position is undefined in that case
+        */
+        if (pos + bits > (unsigned long)size * 8) {
+            return false;
+        }
+        while (bits) {
+            unsigned int byte = pos >> 3;
+            uint8_t free = 8 - (pos & 7);
+            if (free == 8) {
+                buf[byte] = 0;
+            }
+            uint8_t n = bits < free ? bits : free;
+            uint8_t chunk = (value >> (bits - n)) & ((1 << n) - 1);
+            buf[byte] |= chunk << (free - n);
+            pos += n;
+            bits -= n;
+        }
+        return true;
+    }
+};
+
+/*! \brief Bit-granular reader from a byte buffer (MSB first) */
+class BitReader {
+  public:
+    const uint8_t *buf;
+    unsigned long pos;  //!< Number of bits read
+
+    BitReader(const uint8_t *buf = nullptr) : buf(buf), pos(0) {
+    }
+
+    uint32_t read(uint8_t bits) {
+        /*! Read the next bits
+        @param bits Number of bits to read [0-32]
+        @return The bits read, right aligned
+        */
+        uint32_t value = 0;
+        while (bits) {
+            uint8_t avail = 8 - (pos & 7);
+            uint8_t n = bits < avail ? bits : avail;
+            uint8_t chunk = (buf[pos >> 3] >> (avail - n)) & ((1 << n) - 1);
+            value = (n == 32 ? 0 : value << n) | chunk;
+            pos += n;
+            bits -= n;
+        }
+        return value;
+    }
+};
+
+/*! \brief Gorilla-style encoder state for one block of samples
+
+Timestamps are stored as delta-of-delta with variable-length buckets, values as XOR against
+the previous value (IEEE 754 single precision) storing only the meaningful bits, as described
+in "Gorilla: A Fast, Scalable, In-Memory Time Series Database" (Pelkonen et al., 2015).
+Regularly sampled timestamps and repeated values cost one bit each.
+
+The first sample of a block is stored uncompressed (64 bits).
+*/
+class TimeSeriesEncoder {
+  public:
+    BitWriter writer;
+    unsigned int count = 0;  //!< Number of samples in the block
+
+  private:
+    uint32_t prevTime;
+    int32_t prevDelta;
+    uint32_t prevBits;
+    uint8_t prevLeading;
+    uint8_t prevTrailing;
+
+  public:
+    void begin(uint8_t *buf, unsigned int size) {
+        /*! Start a new block
+        @param buf Storage for the compressed block
+        @param size Size of storage in bytes
+        */
+        writer = BitWriter(buf, size);
+        count = 0;
+    }
+
+    bool add(uint32_t time, float value) {
+        /*! Append a sample to the block
+        @param time Timestamp, must not be older than the previous sample
+        @param value Sample value
+        @return false if the block is full, the sample has not been added in that case
+        */
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        unsigned long startPos = writer.pos;
+        if (count == 0) {
+            if (!writer.write(time, 32) || !writer.write(bits, 32)) {
+                writer.pos = startPos;
+                return false;
+            }
+            prevTime = time;
+            prevDelta = 0;
+            prevBits = bits;
+            prevLeading = 0xff;
+            prevTrailing = 0;
+            ++count;
+            return true;
+        }
+        int32_t delta = (int32_t)(time - prevTime);
+        int32_t dod = delta - prevDelta;
+        bool ok;
+        if (dod == 0) {
+            ok = writer.write(0, 1);
+        } else if (dod >= -64 && dod <= 63) {
+            ok = writer.write(0x2, 2) && writer.write(dod, 7);
+        } else if (dod >= -256 && dod <= 255) {
+            ok = writer.write(0x6, 3) && writer.write(dod, 9);
+        } else if (dod >= -2048 && dod <= 2047) {
+            ok = writer.write(0xe, 4) && writer.write(dod, 12);
+        } else {
+            ok = writer.write(0xf, 4) && writer.write(dod, 32);
+        }
+        uint32_t x = bits ^ prevBits;
+        uint8_t leading = 0;
+        uint8_t trailing = 0;
+        if (ok) {
+            if (x == 0) {
+                ok = writer.write(0, 1);
+            } else {
+                while (leading < 31 && !(x & (0x80000000UL >> leading))) {
+                    ++leading;
+                }
+                while (!(x & (1UL << trailing))) {
+                    ++trailing;
+                }
+                if (prevLeading != 0xff && leading >= prevLeading && trailing >= prevTrailing) {
+                    // meaningful bits fit into the previous window
+                    ok = writer.write(0x2, 2) &&
+                         writer.write(x >> prevTrailing, 32 - prevLeading - prevTrailing);
+                    leading = prevLeading;
+                    trailing = prevTrailing;
+                } else {
+                    uint8_t len = 32 - leading - trailing;
+                    ok = writer.write(0x3, 2) && writer.write(leading, 5) &&
+                         writer.write(len - 1, 5) && writer.write(x >> trailing, len);
+                }
+            }
+        }
+        if (!ok) {
+            writer.pos = startPos;
+            return false;
+        }
+        if (x != 0) {
+            prevLeading = leading;
+            prevTrailing = trailing;
+        }
+        prevTime = time;
+        prevDelta = delta;
+        prevBits = bits;
+        ++count;
+        return true;
+    }
+
+    unsigned int bytes() const {
+        /*! @return Number of bytes used by the block */
+        return (writer.pos + 7) / 8;
+    }
+};
+
+/*! \brief Streaming decoder for a block written by TimeSeriesEncoder */
+class TimeSeriesDecoder {
+  private:
+    BitReader reader;
+    unsigned int remaining;
+    uint32_t prevTime;
+    int32_t prevDelta;
+    uint32_t prevBits;
+    uint8_t prevLeading;
+    uint8_t prevTrailing;
+    bool first;
+
+  public:
+    void begin(const uint8_t *buf, unsigned int count) {
+        /*! Start decoding a block
+        @param buf Compressed block
+        @param count Number of samples in the block
+        */
+        reader = BitReader(buf);
+        remaining = count;
+        first = true;
+    }
+
+    bool next(uint32_t *time, float *value) {
+        /*! Decode the next sample
+        @param time Receives the timestamp
+        @param value Receives the value
+        @return false if all samples have been decoded
+        */
+        if (!remaining) {
+            return false;
+        }
+        --remaining;
+        if (first) {
+            first = false;
+            prevTime = reader.read(32);
+            prevBits = reader.read(32);
+            prevDelta = 0;
+        } else {
+            int32_t dod;
+            if (!reader.read(1)) {
+                dod = 0;
+            } else if (!reader.read(1)) {
+                dod = signExtend(reader.read(7), 7);
+            } else if (!reader.read(1)) {
+                dod = signExtend(reader.read(9), 9);
+            } else if (!reader.read(1)) {
+                dod = signExtend(reader.read(12), 12);
+            } else {
+                dod = (int32_t)reader.read(32);
+            }
+            prevDelta += dod;
+            prevTime += prevDelta;
+            if (reader.read(1)) {
+                if (reader.read(1)) {
+                    prevLeading = reader.read(5);
+                    uint8_t len = reader.read(5) + 1;
+                    prevTrailing = 32 - prevLeading - len;
+                }
+                uint8_t len = 32 - prevLeading - prevTrailing;
+                prevBits ^= reader.read(len) << prevTrailing;
+            }
+        }
+        *time = prevTime;
+        memcpy(value, &prevBits, sizeof(prevBits));
+        return true;
+    }
+
+  private:
+    static int32_t signExtend(uint32_t v, uint8_t bits) {
+        return (v & (1UL << (bits - 1))) ? (int32_t)(v | (0xffffffffUL << bits)) : (int32_t)v;
+    }
+};
+
+/*! \brief Compressed storage for a history of timestamped samples
+
+Stores samples in a ring of BLOCKS statically allocated blocks of BLOCK_SIZE bytes each,
+compressed with TimeSeriesEncoder. When all blocks are full, the oldest block is discarded.
+
+@tparam BLOCK_SIZE Size of one block in bytes
+@tparam BLOCKS Number of blocks, at least 2
+*/
+template <unsigned int BLOCK_SIZE, unsigned int BLOCKS = 2> class CompressedSeries {
+  public:
+    uint8_t blocks[BLOCKS][BLOCK_SIZE];
+    unsigned int counts[BLOCKS];
+    unsigned long generation = 0;  //!< Incremented every time a block is discarded
+    unsigned int first = 0;        //!< Index of the oldest block
+    unsigned int used = 0;         //!< Number of blocks in use
+    TimeSeriesEncoder encoder;
+
+    void clear() {
+        /*! Discard all samples */
+        first = 0;
+        used = 0;
+        ++generation;
+    }
+
+    void add(uint32_t time, float value) {
+        /*! Append a sample, discarding the oldest block if necessary
+        @param time Timestamp, must not be older than the previous sample
+        @param value Sample value
+        */
+        if (used && encoder.add(time, value)) {
+            counts[current()] = encoder.count;
+            return;
+        }
+        if (used == BLOCKS) {
+            first = (first + 1) % BLOCKS;
+            --used;
+            ++generation;
+        }
+        ++used;
+        encoder.begin(blocks[current()], BLOCK_SIZE);
+        encoder.add(time, value);
+        counts[current()] = encoder.count;
+    }
+
+    unsigned long length() const {
+        /*! @return Number of samples stored */
+        unsigned long n = 0;
+        for (unsigned int i = 0; i < used; i++) {
+            n += counts[(first + i) % BLOCKS];
+        }
+        return n;
+    }
+
+    unsigned long bytes() const {
+        /*! @return Number of bytes occupied by compressed data */
+        if (!used) {
+            return 0;
+        }
+        return (unsigned long)(used - 1) * BLOCK_SIZE + encoder.bytes();
+    }
+
+  private:
+    unsigned int current() const {
+        return (first + used - 1) % BLOCKS;
+    }
+};
+
+}  // namespace ustd
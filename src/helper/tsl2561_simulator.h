@@ -0,0 +1,123 @@
+// tsl2561_simulator.h - simulated TSL2561 light sensor for host tests
+#pragma once
+
+#include "i2c_bus.h"
+
+#if defined(__UNIXOID__)
+
+namespace ustd {
+
+/*! \brief Simulated TSL2561 light-to-digital converter (hosts only)
+
+Implements the register interface of the TSL2561: a command byte (bit 7 set) selects a
+register, a following byte is written to it, reads return the selected register (two bytes
+with the WORD bit). The channel counts follow the light set in `broadband` and `infrared`
+(counts at 402 ms integration and 16x gain), scaled to the programmed integration time and
+gain and clipped like the real device. `integrate()` completes an integration period and
+evaluates the interrupt thresholds and persistence; `interrupt` reflects the INT line. Attach an instance to an I2CBus and pass the bus to
+IlluminanceTSL2561 to run the mupplet on a host.
+*/
+class Tsl2561Simulator : public I2CSimDevice {
+  public:
+    double broadband = 0.0;   //!< Channel 0 counts at 402 ms and 16x gain
+    double infrared = 0.0;    //!< Channel 1 counts at 402 ms and 16x gain
+    uint8_t id = 0x50;        //!< Content of the ID register (0x50: TSL2561T/FN/CL)
+    bool responding = true;   //!< false: the device does not acknowledge
+    bool interrupt = false;   //!< INT line asserted
+    uint8_t regs[16];         //!< Register file
+    unsigned long writes = 0;  //!< Number of write transfers received
+    unsigned long reads = 0;   //!< Number of read transfers received
+
+  private:
+    uint8_t pointer = 0;
+    bool word = false;
+    uint8_t outOfBand = 0;
+
+  public:
+    Tsl2561Simulator(uint8_t address = 0x39) : I2CSimDevice(address) {
+        memset(regs, 0, sizeof(regs));
+        regs[0x01] = 0x02;  // power-on default: 402 ms, 1x
+    }
+
+    bool powered() const {
+        /*! @return true if the device is powered up */
+        return (regs[0x00] & 0x03) == 0x03;
+    }
+
+    uint16_t channel(int n) const {
+        /*! @return Current count of channel 0 (broadband) or 1 (infrared) */
+        if (!powered()) {
+            return 0;
+        }
+        static const double scale[] = {13.7 / 402.0, 101.0 / 402.0, 1.0, 1.0};
+        static const uint16_t clip[] = {5047, 37177, 65535, 65535};
+        uint8_t timing = regs[0x01] & 0x03;
+        double counts = (n ? infrared : broadband) * scale[timing];
+        if (!(regs[0x01] & 0x10)) {
+            counts /= 16.0;
+        }
+        return counts >= clip[timing] ? clip[timing] : (uint16_t)counts;
+    }
+
+    void integrate() {
+        /*! Complete an integration period: evaluate interrupt thresholds and persistence */
+        if (!powered() || (regs[0x06] & 0x30) != 0x10) {
+            return;
+        }
+        uint16_t ch0 = channel(0);
+        uint16_t low = regs[0x02] | (regs[0x03] << 8);
+        uint16_t high = regs[0x04] | (regs[0x05] << 8);
+        uint8_t persist = regs[0x06] & 0x0F;
+        if (ch0 < low || ch0 > high) {
+            if (outOfBand < 15) {
+                ++outOfBand;
+            }
+        } else {
+            outOfBand = 0;
+        }
+        if (persist == 0 || (outOfBand && outOfBand >= persist)) {
+            interrupt = true;
+        }
+    }
+
+    virtual bool onWrite(const uint8_t *data, uint8_t len) override {
+        if (!responding || !len || !(data[0] & 0x80)) {
+            return false;
+        }
+        ++writes;
+        pointer = data[0] & 0x0F;
+        word = (data[0] & 0x20) != 0;
+        if (data[0] & 0x40) {
+            interrupt = false;
+            outOfBand = 0;
+        }
+        for (uint8_t i = 1; i < len; i++) {
+            regs[(pointer + i - 1) & 0x0F] = data[i];
+        }
+        return true;
+    }
+
+    virtual uint8_t onRead(uint8_t *data, uint8_t len) override {
+        if (!responding) {
+            return 0;
+        }
+        ++reads;
+        uint16_t ch0 = channel(0);
+        uint16_t ch1 = channel(1);
+        regs[0x0A] = id;
+        regs[0x0C] = ch0 & 0xFF;
+        regs[0x0D] = ch0 >> 8;
+        regs[0x0E] = ch1 & 0xFF;
+        regs[0x0F] = ch1 >> 8;
+        uint8_t n = word ? 2 : 1;
+        n = n < len ? n : len;
+        for (uint8_t i = 0; i < n; i++) {
+            data[i] = regs[(pointer + i) & 0x0F];
+        }
+        return n;
+    }
+};
+
+}  // namespace ustd
+
+#endif  // __UNIXOID__
@@ -0,0 +1,197 @@
+// window_statistics.h - incremental statistics over a sample window
+#pragma once
+
+#include "progmem.h"
+
+namespace ustd {
+
+/*! \brief Streaming quantile estimator (P² algorithm)
+
+Estimates a single quantile of a sample stream without storing the samples,
+using the P² algorithm by R. Jain and I. Chlamtac. Every sample costs O(1)
+time, the state consists of five markers.
+*/
+class P2Quantile {
+  private:
+    double p;
+    double q[5];
+    double np[5];
+    double dn[5];
+    long n[5];
+    unsigned long count;
+
+  public:
+    P2Quantile(double p = 0.5) : p(p) {
+        /*! Instantiate a quantile estimator
+        @param p Quantile to estimate, [0.0-1.0], e.g. 0.95 for the 95th percentile
+        */
+        reset();
+    }
+
+    void reset() {
+        /*! Discard all samples */
+        count = 0;
+        for (int i = 0; i < 5; i++) {
+            n[i] = i;
+        }
+        np[0] = 0.0;
+        np[1] = 2.0 * p;
+        np[2] = 4.0 * p;
+        np[3] = 2.0 + 2.0 * p;
+        np[4] = 4.0;
+        dn[0] = 0.0;
+        dn[1] = p / 2.0;
+        dn[2] = p;
+        dn[3] = (1.0 + p) / 2.0;
+        dn[4] = 1.0;
+    }
+
+    void add(double x) {
+        /*! Add a sample to the estimation
+        @param x Sample value
+        */
+        if (count < 5) {
+            // insertion sort of the first five samples
+            int i = count;
+            while (i > 0 && q[i - 1] > x) {
+                q[i] = q[i - 1];
+                --i;
+            }
+            q[i] = x;
+            ++count;
+            return;
+        }
+        ++count;
+        int k;
+        if (x < q[0]) {
+            q[0] = x;
+            k = 0;
+        } else if (x >= q[4]) {
+            q[4] = x;
+            k = 3;
+        } else {
+            k = 0;
+            while (k < 3 && x >= q[k + 1]) {
+                ++k;
+            }
+        }
+        for (int i = k + 1; i < 5; i++) {
+            ++n[i];
+        }
+        for (int i = 0; i < 5; i++) {
+            np[i] += dn[i];
+        }
+        for (int i = 1; i < 4; i++) {
+            double d = np[i] - n[i];
+            if ((d >= 1.0 && n[i + 1] - n[i] > 1) || (d <= -1.0 && n[i - 1] - n[i] < -1)) {
+                int ds = d > 0.0 ? 1 : -1;
+                double qp = parabolic(i, ds);
+                if (q[i - 1] < qp && qp < q[i + 1]) {
+                    q[i] = qp;
+                } else {
+                    q[i] = q[i] + ds * (q[i + ds] - q[i]) / (n[i + ds] - n[i]);
+                }
+                n[i] += ds;
+            }
+        }
+    }
+
+    double value() const {
+        /*! Get the current estimate
+        @return Estimated quantile, 0.0 if no samples have been added
+        */
+        if (count == 0) {
+            return 0.0;
+        }
+        if (count <= 5) {
+            // exact for the first samples, q[] is sorted
+            int i = (int)(p * (count - 1) + 0.5);
+            return q[i];
+        }
+        return q[2];
+    }
+
+  private:
+    double parabolic(int i, int d) const {
+        return q[i] + (double)d / (n[i + 1] - n[i - 1]) *
+                          ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                           (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+    }
+};
+
+/*! \brief Incremental statistics of a sample window
+
+Maintains count, minimum, maximum, mean, standard deviation (Welford's
+algorithm) and approximate median and 95th percentile of all samples added
+since the last reset. Each sample costs O(1) time and no memory is allocated.
+*/
+class WindowStatistics {
+  public:
+    unsigned long count;
+    double minVal;
+    double maxVal;
+    double mean;
+    double m2;
+    P2Quantile p50 = P2Quantile(0.5);
+    P2Quantile p95 = P2Quantile(0.95);
+
+    WindowStatistics() {
+        reset();
+    }
+
+    void reset() {
+        /*! Start a new window */
+        count = 0;
+        minVal = 0.0;
+        maxVal = 0.0;
+        mean = 0.0;
+        m2 = 0.0;
+        p50.reset();
+        p95.reset();
+    }
+
+    void add(double x) {
+        /*! Add a sample to the current window
+        @param x Sample value
+        */
+        if (count == 0 || x < minVal) {
+            minVal = x;
+        }
+        if (count == 0 || x > maxVal) {
+            maxVal = x;
+        }
+        ++count;
+        double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+        p50.add(x);
+        p95.add(x);
+    }
+
+    double stddev() const {
+        /*! Get the sample standard deviation of the current window
+        @return Standard deviation, 0.0 for less than two samples
+        */
+        if (count < 2) {
+            return 0.0;
+        }
+        return sqrt(m2 / (count - 1));
+    }
+
+    int toJson(char *buf, unsigned int len, int precision = 3) const {
+        /*! Format the window statistics as JSON object
+        @param buf Destination buffer
+        @param len Size of destination buffer
+        @param precision Number of decimals
+        @return Length of the formatted string (as snprintf)
+        */
+        return snprintf_P(
+            buf, len,
+            PSTR("{\"count\":%lu,\"min\":%.*f,\"max\":%.*f,\"mean\":%.*f,\"stddev\":%.*f,"
+                 "\"p50\":%.*f,\"p95\":%.*f}"),
+            count, precision, minVal, precision, maxVal, precision, mean, precision, stddev(),
+            precision, p50.value(), precision, p95.value());
+    }
+};
+
+}  // namespace ustd
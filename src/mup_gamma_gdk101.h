@@ -1,3 +1,1010 @@
+// mup_gamma_gdk101.h - muwerk GDK101 gamma radiation sensor mupplet
 // http://allsmartlab.com/eng/294-2/
 // http://allsmartlab.com/wp-content/uploads/2017/download/GDK101datasheet_v1.5.pdf
 // http://allsmartlab.com/wp-content/uploads/2017/download/GDK101_Application_Note.zip
+#pragma once
+
+#include "scheduler.h"
+#include "helper/i2c_bus.h"
+#include "helper/i2c_bus_manager.h"
+#include "helper/filter_pipeline.h"
+#include "helper/sensor_mupplet.h"
+
+#ifndef GDK101_READ_DELAY_MS
+#define GDK101_READ_DELAY_MS 10  //!< Minimum time between command and reading the response
+#endif
+#ifndef GDK101_MAX_RETRIES
+#define GDK101_MAX_RETRIES 3  //!< Failed transfers in a row until the sensor is considered offline
+#endif
+#ifndef GDK101_BACKOFF_MAX_SEC
+#define GDK101_BACKOFF_MAX_SEC 60  //!< Maximum time between attempts to reach an offline sensor
+#endif
+#ifndef GDK101_UPDATE_MS
+#define GDK101_UPDATE_MS 10000  //!< Update interval of the 1-minute average, minimum poll interval
+#endif
+#ifndef GDK101_SLOW_UPDATE_MS
+#define GDK101_SLOW_UPDATE_MS 60000  //!< Read interval of 10-minute average and measuring time
+#endif
+#ifndef GDK101_MAX_DEVICES
+#define GDK101_MAX_DEVICES 4  //!< Maximum number of sensors serviced by one mupplet
+#endif
+#ifndef GDK101_DOSE_SAVE_SEC
+#define GDK101_DOSE_SAVE_SEC 3600  //!< Minimum interval between flash writes of the dose [s]
+#endif
+#ifndef GDK101_DOSE_SAVE_MIN
+#define GDK101_DOSE_SAVE_MIN 0.01  //!< Minimum dose increase [µSv] that is written to flash
+#endif
+#ifndef GDK101_DOSE_PUBLISH_MIN
+#define GDK101_DOSE_PUBLISH_MIN 0.001  //!< Minimum dose increase [µSv] that is published
+#endif
+#ifndef GDK101_DOSE_RATE_DEADBAND
+#define GDK101_DOSE_RATE_DEADBAND 0.0  //!< Minimum change of a fused dose rate that is published
+#endif
+
+namespace ustd {
+
+static const char GDK101_VERSION[] PROGMEM = "0.1.0";
+// names of GammaGDK101::Status
+static const char gdk101StatusNames[][8] PROGMEM = {"READY", "WAITING", "NORMAL", "OFFLINE"};
+
+// clang - format off
+/*! \brief mupplet-sensor GDK101 gamma radiation sensor
+
+The gamma_gdk101 mupplet reads the dose rate of one or more FTLAB GDK101 gamma radiation sensor
+modules via I2C. The 10-minute and 1-minute averages of the dose rate, the status, the
+vibration indicator and the measuring time are read periodically.
+
+Up to `GDK101_MAX_DEVICES` sensors (addresses 0x18-0x1B, selected by the jumpers A0 and A1)
+are serviced by a single scheduler task, e.g. for redundancy. Each sensor has its own
+transaction state machine and the transfers of all sensors are interleaved: while one sensor
+prepares its response, the others use the bus. Besides the values of each sensor, the
+mupplet publishes fused values: the median of the dose rates of all sensors that answer, so
+a single defective sensor does not corrupt the result.
+
+All registers needed by a poll are fetched in one burst of pipelined transfers: each
+scheduler tick reads the response to the previous command and immediately writes the next
+command, the time the sensor needs between command and response is spent in the scheduler.
+A burst never holds the bus longer than one read and one write per tick and sensor.
+
+The sensors are polled at their own update cadence, not faster: status, vibration and the
+1-minute average every `GDK101_UPDATE_MS`, the 10-minute average and the measuring time, which
+change more slowly, only every `GDK101_SLOW_UPDATE_MS`. The bus time of every burst is
+computed in advance from the number of bytes and the I2C clock (`I2CBus::clockHz`) and
+compared with the measured time of the transfers, see `sensor/bus`.
+
+Instead of an own I2CBus, the mupplet can use a shared I2CBusManager, which queues the
+transactions of all mupplets on the bus. The manager performs the command write and, after
+`GDK101_READ_DELAY_MS`, the response read, the mupplet continues in the completion callback.
+
+A sensor that does not answer is retried `GDK101_MAX_RETRIES` times, then it is considered
+offline and probed again with an exponentially increasing interval of up to
+`GDK101_BACKOFF_MAX_SEC` seconds, so a missing or stuck sensor never blocks other tasks or the
+other sensors.
+
+The cumulative dose is integrated from the fused 1-minute dose rate over the actually elapsed
+time after every poll. Periods without any answering sensor are not counted. If `begin()` is
+called with `persistent = true`, the dose and the alarm thresholds are stored in a small file
+`/<name>.dose` on the flash file system. To keep flash wear low, the dose is written at most
+every `GDK101_DOSE_SAVE_SEC` seconds and only if it increased by at least
+`GDK101_DOSE_SAVE_MIN`, so after a power loss at most the dose of one save interval is lost.
+
+The dose rate alarm compares the fused 1-minute dose rate with two thresholds: the alarm is
+raised when the dose rate reaches the high threshold and cleared only when it falls to the low
+threshold. Transitions are published immediately on `sensor/alarm`.
+
+#### Messages sent by gamma_gdk101 mupplet:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<mupplet-name>/sensor/doserate10min` | dose rate [µSv/h] | Fused 10-minute average, sent when it changes by more than `GDK101_DOSE_RATE_DEADBAND` (`DeadbandStage` of the filter pipeline): median of all sensors with status `NORMAL` (of all sensors that answer if none is `NORMAL`)
+| `<mupplet-name>/sensor/doserate1min` | dose rate [µSv/h] | Fused 1-minute average, sent when it changes by more than `GDK101_DOSE_RATE_DEADBAND` (`DeadbandStage` of the filter pipeline): median of all sensors that answer
+| `<mupplet-name>/sensor/status` | `READY`, `WAITING`, `NORMAL` or `OFFLINE` | Fused status, sent on change: most advanced status of all sensors that answer, `OFFLINE` if no sensor answers. `WAITING`: the first 10 minutes after reset
+| `<mupplet-name>/sensor/vibration` | `0` or `1` | Fused vibration indicator, sent on change, `1` if any sensor detected vibration
+| `<mupplet-name>/sensor/measuringtime` | seconds | Measuring time of the first sensor since its last reset
+| `<mupplet-name>/sensor/firmware` | `<major>.<minor>` | Firmware version of the first sensor
+| `<mupplet-name>/sensor/devices` | JSON object | Sent when a sensor goes offline or comes back: `count` (sensors configured), `online` (sensors that answer) and `failed` (indices of the offline sensors)
+| `<mupplet-name>/sensor/device/<n>/<value>` | see above | Value of the sensor with index `<n>` (0: the sensor given to the constructor, 1...: sensors added with `addDevice()`): `doserate10min`, `doserate1min`, `status` and `vibration` sent on change, `measuringtime` and `firmware`
+| `<mupplet-name>/sensor/dose` | dose [µSv] | Cumulative dose, sent when it increased by `GDK101_DOSE_PUBLISH_MIN`
+| `<mupplet-name>/sensor/dose/time` | seconds | Time over which the dose was integrated
+| `<mupplet-name>/sensor/alarm` | `on` or `off` | Dose rate alarm, sent on every transition
+| `<mupplet-name>/sensor/alarm/threshold` | `<high>,<low>` or `off` | Alarm thresholds [µSv/h]
+| `<mupplet-name>/sensor/bus` | JSON object | Bus usage of the polls: `interval` (poll interval [ms]), `polls`, `registers` (registers read by the last poll), `budget` (computed bus time of the last poll [µs]), `measured` (measured bus time of the last poll [µs]), `overruns` (polls that took longer than twice the budget) and `errors`
+
+#### Messages received by gamma_gdk101 mupplet:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<mupplet-name>/sensor/doserate10min/get` | - | Returns the fused 10-minute average
+| `<mupplet-name>/sensor/doserate1min/get` | - | Returns the fused 1-minute average
+| `<mupplet-name>/sensor/status/get` | - | Returns the fused status
+| `<mupplet-name>/sensor/vibration/get` | - | Returns the fused vibration indicator
+| `<mupplet-name>/sensor/measuringtime/get` | - | Returns the measuring time of the first sensor
+| `<mupplet-name>/sensor/firmware/get` | - | Returns the firmware version of the first sensor
+| `<mupplet-name>/sensor/devices/get` | - | Returns the number of configured and online sensors
+| `<mupplet-name>/sensor/device/<n>/<value>/get` | - | Returns a value of the sensor with index `<n>`, see above
+| `<mupplet-name>/sensor/dose/get` | - | Returns the cumulative dose and the integration time
+| `<mupplet-name>/sensor/dose/reset/set` | - | Sets the cumulative dose to 0
+| `<mupplet-name>/sensor/alarm/get` | - | Returns the alarm state
+| `<mupplet-name>/sensor/alarm/threshold/get` | - | Returns the alarm thresholds
+| `<mupplet-name>/sensor/alarm/threshold/set` | `<high>[,<low>]` or `off` | Sets the alarm thresholds, the alarm is cleared at the low threshold (default 80% of high)
+| `<mupplet-name>/sensor/bus/get` | - | Returns the bus usage
+| `<mupplet-name>/sensor/reset/set` | - | Resets all sensors, which restarts the measurement
+| `<mupplet-name>/sensor/device/<n>/reset/set` | - | Resets the sensor with index `<n>`
+
+Sample code:
+```cpp
+#include "scheduler.h"
+#include "mup_gamma_gdk101.h"
+
+ustd::Scheduler sched(10, 16, 32);
+ustd::GammaGDK101 gamma("gamma", 0x18);
+
+void setup() {
+    Wire.begin();
+    gamma.addDevice(0x19);  // optional redundant sensors
+    gamma.begin(&sched);
+}
+```
+
+On hosts (`__UNIXOID__`), the mupplet is connected to an I2CBus with attached
+Gdk101Simulator instances (see `helper/gdk101_simulator.h`).
+*/
+// clang-format on
+class GammaGDK101 : public SensorMupplet<GammaGDK101> {
+    friend class SensorMupplet<GammaGDK101>;
+
+  public:
+    enum Command : uint8_t {
+        CMD_RESET = 0xA0,
+        CMD_STATUS = 0xB0,
+        CMD_MEASURING_TIME = 0xB1,
+        CMD_DOSERATE_10MIN = 0xB2,
+        CMD_DOSERATE_1MIN = 0xB3,
+        CMD_FIRMWARE = 0xB4
+    };
+    enum Status { READY = 0, WAITING = 1, NORMAL = 2, OFFLINE = 3 };
+    // bus transaction state
+    enum BusState { BUS_IDLE, BUS_SEND, BUS_WAIT, BUS_BACKOFF };
+
+    // transaction state and values of one sensor
+    struct Device {
+        uint8_t address;
+        bool bInitialized;
+        bool bResetPending;
+        bool bPollSequence;
+        bool bSlowPollDue;
+        bool bValid;  // all values read since the sensor came online
+        BusState busState;
+        uint8_t sequence[6];
+        uint8_t sequenceLen;
+        uint8_t sequencePos;
+        uint8_t retries;
+        unsigned long stateStart;
+        unsigned long lastPoll;
+        unsigned long lastSlowPoll;
+        unsigned long backoffMs;
+        unsigned long burstBudgetUs;
+        unsigned long burstUs;
+        unsigned long errors;
+        double doseRate10;
+        double doseRate1;
+        Status status;
+        bool vibration;
+        unsigned long measuringTime;
+        uint8_t fwMajor;
+        uint8_t fwMinor;
+    };
+
+  private:
+    I2CBus *pBus = nullptr;
+    I2CBusManager *pManager = nullptr;
+#if !defined(__UNIXOID__)
+    I2CBus ownBus;
+#endif
+    Device devices[GDK101_MAX_DEVICES];
+    uint8_t deviceCount = 0;
+    uint8_t onlineCount = 0;
+    unsigned long pollIntervalMs;
+    uint8_t lastPollRegisters = 0;
+    unsigned long lastPollBudgetUs = 0;
+    unsigned long lastPollMeasuredUs = 0;
+    // fused values
+    double doseRate10 = 0.0;
+    double doseRate1 = 0.0;
+    Status status = OFFLINE;
+    bool vibration = false;
+    // cumulative dose
+    bool bPersistent = false;
+    bool bIntegrating = false;
+    double dose = 0.0;
+    double publishedDose = 0.0;
+    double savedDose = 0.0;
+    unsigned long doseSeconds = 0;
+    unsigned long doseRemainderMs = 0;
+    unsigned long lastIntegration = 0;
+    unsigned long lastSave = 0;
+    // dose rate alarm, disabled if alarmHigh <= 0
+    double alarmHigh = 0.0;
+    double alarmLow = 0.0;
+    bool bAlarm = false;
+
+    // flash record of the cumulative dose
+    static const uint32_t DOSE_MAGIC = 0x45534f44;
+    static const uint8_t DOSE_VERSION = 1;
+    struct DoseRecord {
+        uint32_t magic;
+        uint8_t version;
+        uint8_t reserved[3];
+        double dose;
+        uint32_t seconds;
+        float alarmHigh;
+        float alarmLow;
+        uint32_t crc;
+    };
+
+  public:
+    unsigned long errors = 0;    //!< Number of failed transfers
+    unsigned long polls = 0;     //!< Number of completed polls
+    unsigned long overruns = 0;  //!< Polls whose bus time exceeded twice the computed budget
+    // publish filters of the fused dose rates, deadband GDK101_DOSE_RATE_DEADBAND
+    Pipeline<DeadbandStage> doseRate10Filter;  //!< Filter of the published 10-minute average
+    Pipeline<DeadbandStage> doseRate1Filter;   //!< Filter of the published 1-minute average
+
+    GammaGDK101(String name, uint8_t address = 0x18,
+                unsigned long pollIntervalMs = GDK101_UPDATE_MS)
+        : SensorMupplet(name) {
+        /*! Instantiate a GDK101 sensor mupplet
+        @param name Name used for pub/sub messages
+        @param address I2C address of the (first) sensor, 0x18-0x1B depending on the jumpers A0
+        and A1
+        @param pollIntervalMs Interval between reads of the sensor values [ms], at least
+        `GDK101_UPDATE_MS` since the sensor does not update its values more often
+        */
+        addDevice(address);
+        setPollInterval(pollIntervalMs);
+        doseRate10Filter.first.eps = GDK101_DOSE_RATE_DEADBAND;
+        doseRate1Filter.first.eps = GDK101_DOSE_RATE_DEADBAND;
+    }
+
+    ~GammaGDK101() {
+    }
+
+    bool addDevice(uint8_t address) {
+        /*! Add a further sensor, must be called before begin()
+        @param address I2C address of the sensor, 0x18-0x1B
+        @return false if `GDK101_MAX_DEVICES` sensors are already configured or the address is
+        already in use
+        */
+        if (deviceCount >= GDK101_MAX_DEVICES || findDevice(address) >= 0) {
+            return false;
+        }
+        Device &d = devices[deviceCount++];
+        memset(&d, 0, sizeof(d));
+        d.address = address;
+        d.bSlowPollDue = true;
+        d.busState = BUS_IDLE;
+        d.status = OFFLINE;
+        return true;
+    }
+
+#if !defined(__UNIXOID__)
+    void begin(Scheduler *_pSched, TwoWire *pWire = &Wire, bool reset = false,
+               bool persistent = false) {
+        /*! Start reading the sensors
+        @param _pSched Pointer to the muwerk scheduler
+        @param pWire TwoWire instance the sensors are connected to, must already be initialized
+        @param reset If true, the sensors are reset, which restarts the measurement
+        @param persistent If true, the cumulative dose and the alarm thresholds are restored
+        from and saved to the flash file system, which must already be mounted
+        */
+        ownBus.begin(pWire);
+        begin(_pSched, &ownBus, reset, persistent);
+    }
+#endif
+
+    void begin(Scheduler *_pSched, I2CBusManager *_pManager, bool reset = false,
+               bool persistent = false) {
+        /*! Start reading the sensors via a shared I2C bus manager
+        @param _pSched Pointer to the muwerk scheduler
+        @param _pManager I2C bus manager of the bus the sensors are connected to
+        @param reset If true, the sensors are reset, which restarts the measurement
+        @param persistent If true, the cumulative dose and the alarm thresholds are restored
+        from and saved to the flash file system, which must already be mounted
+        */
+        pManager = _pManager;
+        begin(_pSched, &pManager->bus, reset, persistent);
+    }
+
+    void begin(Scheduler *_pSched, I2CBus *_pBus, bool reset = false, bool persistent = false) {
+        /*! Start reading the sensors
+        @param _pSched Pointer to the muwerk scheduler
+        @param _pBus I2C bus the sensors are connected to
+        @param reset If true, the sensors are reset, which restarts the measurement
+        @param persistent If true, the cumulative dose and the alarm thresholds are restored
+        from and saved to the flash file system, which must already be mounted
+        */
+        pBus = _pBus;
+        unsigned long now = millis();
+        if (persistent) {
+            restoreDose();
+            bPersistent = true;
+        }
+        lastSave = now;
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            devices[i].bResetPending = reset;
+            devices[i].lastPoll = now - pollIntervalMs;
+        }
+
+        startTask(_pSched, 20000);  // 20ms
+    }
+
+    void setPollInterval(unsigned long ms) {
+        /*! Set the interval between reads of the sensor values
+        @param ms Poll interval [ms], values below `GDK101_UPDATE_MS` are raised to it
+        */
+        pollIntervalMs = ms < GDK101_UPDATE_MS ? GDK101_UPDATE_MS : ms;
+    }
+
+    void reset(int index = -1) {
+        /*! Reset sensors, which restarts the measurement
+        @param index Index of the sensor, -1 resets all sensors
+        */
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (index >= 0 && index != i) {
+                continue;
+            }
+            Device &d = devices[i];
+            d.bResetPending = true;
+            d.bInitialized = false;
+            if (d.busState == BUS_IDLE || d.busState == BUS_BACKOFF) {
+                d.lastPoll = millis() - pollIntervalMs;
+                d.busState = BUS_IDLE;
+            }
+        }
+    }
+
+    void setAlarmThreshold(double high, double low = -1.0, bool silent = false) {
+        /*! Set the thresholds of the dose rate alarm
+        @param high The alarm is raised when the fused 1-minute dose rate reaches this value
+        [µSv/h], 0 disables the alarm
+        @param low The alarm is cleared when the dose rate falls to this value, a negative value
+        or a value above high selects 80% of high
+        @param silent If true, the new thresholds are not published
+        */
+        alarmHigh = high > 0.0 ? high : 0.0;
+        alarmLow = (low < 0.0 || low > alarmHigh) ? alarmHigh * 0.8 : low;
+        if (!alarmHigh && bAlarm) {
+            bAlarm = false;
+            publishAlarm();
+        }
+        saveDose(true);
+        if (!silent)
+            publishAlarmThreshold();
+    }
+
+    void resetDose() {
+        /*! Set the cumulative dose to 0 */
+        dose = 0.0;
+        publishedDose = 0.0;
+        doseSeconds = 0;
+        doseRemainderMs = 0;
+        lastIntegration = millis();
+        saveDose(true);
+        publishDose();
+    }
+
+    double getDose() {
+        /*! @return Cumulative dose [µSv] */
+        return dose;
+    }
+
+    bool isAlarm() {
+        /*! @return true while the dose rate alarm is raised */
+        return bAlarm;
+    }
+
+    double getDoseRate10Min() {
+        /*! @return Fused 10-minute average of the dose rate [µSv/h] */
+        return doseRate10;
+    }
+
+    double getDoseRate1Min() {
+        /*! @return Fused 1-minute average of the dose rate [µSv/h] */
+        return doseRate1;
+    }
+
+    Status getStatus() {
+        /*! @return Fused status, OFFLINE if no sensor answers */
+        return status;
+    }
+
+    uint8_t getDeviceCount() {
+        /*! @return Number of configured sensors */
+        return deviceCount;
+    }
+
+    uint8_t getOnlineCount() {
+        /*! @return Number of sensors that answer */
+        return onlineCount;
+    }
+
+    const Device *getDevice(uint8_t index) {
+        /*! @return State and values of the sensor with the given index, nullptr if invalid */
+        return index < deviceCount ? &devices[index] : nullptr;
+    }
+
+    bool isBusy() {
+        /*! @return true while a poll of any sensor is in progress */
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (devices[i].busState == BUS_SEND || devices[i].busState == BUS_WAIT) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    int findDevice(uint8_t address) {
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (devices[i].address == address) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void loop() {
+        unsigned long now = millis();
+        // interleaved: each sensor advances its own transaction by at most one step
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            step(i, now);
+        }
+    }
+
+    void step(uint8_t index, unsigned long now) {
+        Device &d = devices[index];
+        switch (d.busState) {
+        case BUS_IDLE:
+            if (now - d.lastPoll < pollIntervalMs) {
+                return;
+            }
+            d.lastPoll = now;
+            planSequence(d, now);
+            sendCommand(index, now);
+            break;
+        case BUS_SEND:
+            sendCommand(index, now);
+            break;
+        case BUS_WAIT:
+            // with a bus manager, the completion callback continues
+            if (!pManager && now - d.stateStart >= GDK101_READ_DELAY_MS) {
+                readResponse(index, now);
+            }
+            break;
+        case BUS_BACKOFF:
+            if (now - d.stateStart >= d.backoffMs) {
+                // probe the sensor again
+                d.lastPoll = now - pollIntervalMs;
+                d.busState = BUS_IDLE;
+            }
+            break;
+        }
+    }
+
+    void planSequence(Device &d, unsigned long now) {
+        // only the registers that can have changed since the last poll
+        d.sequenceLen = 0;
+        d.sequencePos = 0;
+        d.bPollSequence = d.bInitialized && !d.bResetPending;
+        if (!d.bPollSequence) {
+            if (d.bResetPending) {
+                d.sequence[d.sequenceLen++] = CMD_RESET;
+            }
+            d.sequence[d.sequenceLen++] = CMD_FIRMWARE;
+        } else {
+            d.sequence[d.sequenceLen++] = CMD_STATUS;
+            d.sequence[d.sequenceLen++] = CMD_DOSERATE_1MIN;
+            if (d.bSlowPollDue || now - d.lastSlowPoll >= GDK101_SLOW_UPDATE_MS) {
+                d.bSlowPollDue = false;
+                d.lastSlowPoll = now;
+                d.sequence[d.sequenceLen++] = CMD_DOSERATE_10MIN;
+                d.sequence[d.sequenceLen++] = CMD_MEASURING_TIME;
+            }
+        }
+        // each register: one byte command write, two byte response read
+        d.burstBudgetUs = d.sequenceLen * (pBus->transferUs(1) + pBus->transferUs(2));
+        d.burstUs = 0;
+    }
+
+    void sendCommand(uint8_t index, unsigned long now) {
+        Device &d = devices[index];
+        uint8_t cmd = d.sequence[d.sequencePos];
+        if (pManager) {
+            // queue full: try again on the next tick
+            if (pManager->submit(d.address, &cmd, 1, 2, GDK101_READ_DELAY_MS, onTransaction,
+                                 this)) {
+                d.stateStart = now;
+                d.busState = BUS_WAIT;
+            } else {
+                d.busState = BUS_SEND;
+            }
+            return;
+        }
+        unsigned long start = micros();
+        bool ok = pBus->write(d.address, &cmd, 1);
+        d.burstUs += micros() - start;
+        if (!ok) {
+            transferFailed(index, now);
+            return;
+        }
+        d.stateStart = now;
+        d.busState = BUS_WAIT;
+    }
+
+    void readResponse(uint8_t index, unsigned long now) {
+        Device &d = devices[index];
+        uint8_t data[2];
+        unsigned long start = micros();
+        bool ok = pBus->read(d.address, data, 2) == 2;
+        d.burstUs += micros() - start;
+        if (!ok) {
+            transferFailed(index, now);
+            return;
+        }
+        responseReceived(index, data, now);
+    }
+
+    static void onTransaction(void *context, const I2CTransaction &t, bool ok) {
+        GammaGDK101 *self = (GammaGDK101 *)context;
+        int index = self->findDevice(t.address);
+        if (index < 0) {
+            return;
+        }
+        unsigned long now = millis();
+        self->devices[index].burstUs += t.busUs;
+        if (ok) {
+            self->responseReceived(index, t.readData, now);
+        } else {
+            self->transferFailed(index, now);
+        }
+    }
+
+    void responseReceived(uint8_t index, const uint8_t *data, unsigned long now) {
+        Device &d = devices[index];
+        d.retries = 0;
+        d.backoffMs = 0;
+        processResponse(index, d.sequence[d.sequencePos], data);
+        if (++d.sequencePos < d.sequenceLen) {
+            // pipelined: write the next command in the same tick
+            sendCommand(index, now);
+            return;
+        }
+        d.busState = BUS_IDLE;
+        if (!d.bPollSequence) {
+            d.bInitialized = true;
+            d.bResetPending = false;
+            d.bSlowPollDue = true;
+            publishFirmware(index);
+            if (index == 0) {
+                publishFirmware(-1);
+            }
+            // continue with a poll on the next tick
+            d.lastPoll = now - pollIntervalMs;
+            return;
+        }
+        ++polls;
+        if (!d.bValid && d.sequenceLen == 4) {
+            d.bValid = true;
+        }
+        updateFused();
+        lastPollRegisters = d.sequenceLen;
+        lastPollBudgetUs = d.burstBudgetUs;
+        lastPollMeasuredUs = d.burstUs;
+        if (d.burstUs > 2 * d.burstBudgetUs) {
+            ++overruns;
+        }
+    }
+
+    void processResponse(uint8_t index, uint8_t cmd, const uint8_t *data) {
+        Device &d = devices[index];
+        switch (cmd) {
+        case CMD_STATUS:
+            if (data[0] <= NORMAL && (Status)data[0] != d.status) {
+                setDeviceStatus(index, (Status)data[0]);
+            }
+            if ((data[1] != 0) != d.vibration) {
+                d.vibration = data[1] != 0;
+                publishVibration(index);
+            }
+            break;
+        case CMD_MEASURING_TIME:
+            d.measuringTime = data[0] * 60UL + data[1];
+            break;
+        case CMD_DOSERATE_10MIN:
+            updateDoseRate(index, d.doseRate10, data, PSTR("doserate10min"));
+            break;
+        case CMD_DOSERATE_1MIN:
+            updateDoseRate(index, d.doseRate1, data, PSTR("doserate1min"));
+            break;
+        case CMD_FIRMWARE:
+            d.fwMajor = data[0];
+            d.fwMinor = data[1];
+            break;
+        default:
+            break;
+        }
+    }
+
+    void updateDoseRate(uint8_t index, double &doseRate, const uint8_t *data, const char *topic) {
+        double value = data[0] + data[1] / 100.0;
+        if (value != doseRate) {
+            doseRate = value;
+            publishDoseRate(index, topic, value);
+        }
+    }
+
+    void setDeviceStatus(uint8_t index, Status newStatus) {
+        Device &d = devices[index];
+        bool wasOnline = d.status != OFFLINE;
+        d.status = newStatus;
+        publishStatus(index);
+        if (wasOnline != (newStatus != OFFLINE)) {
+            onlineCount += wasOnline ? -1 : 1;
+            publishDevices();
+        }
+        updateFused();
+    }
+
+    void transferFailed(uint8_t index, unsigned long now) {
+        Device &d = devices[index];
+        ++errors;
+        ++d.errors;
+        if (++d.retries < GDK101_MAX_RETRIES) {
+            // retry the same transfer on the next tick
+            d.busState = BUS_SEND;
+            return;
+        }
+        d.retries = 0;
+        d.bInitialized = false;
+        d.bValid = false;
+        if (d.status != OFFLINE) {
+            setDeviceStatus(index, OFFLINE);
+        }
+        d.backoffMs = d.backoffMs ? d.backoffMs * 2 : 1000;
+        if (d.backoffMs > GDK101_BACKOFF_MAX_SEC * 1000UL) {
+            d.backoffMs = GDK101_BACKOFF_MAX_SEC * 1000UL;
+        }
+        d.stateStart = now;
+        d.busState = BUS_BACKOFF;
+    }
+
+    static double median(double *values, uint8_t count) {
+        // insertion sort, at most GDK101_MAX_DEVICES values
+        for (uint8_t i = 1; i < count; i++) {
+            double v = values[i];
+            uint8_t j = i;
+            while (j > 0 && values[j - 1] > v) {
+                values[j] = values[j - 1];
+                --j;
+            }
+            values[j] = v;
+        }
+        if (count & 1) {
+            return values[count / 2];
+        }
+        return (values[count / 2 - 1] + values[count / 2]) / 2.0;
+    }
+
+    void updateFused() {
+        double rates1[GDK101_MAX_DEVICES];
+        double rates10[GDK101_MAX_DEVICES];
+        double ratesNormal10[GDK101_MAX_DEVICES];
+        uint8_t online = 0, normal = 0;
+        Status newStatus = OFFLINE;
+        bool newVibration = false;
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            const Device &d = devices[i];
+            if (d.status == OFFLINE) {
+                continue;
+            }
+            if (newStatus == OFFLINE || d.status > newStatus) {
+                newStatus = d.status;
+            }
+            newVibration = newVibration || d.vibration;
+            if (!d.bValid) {
+                continue;
+            }
+            rates10[online] = d.doseRate10;
+            rates1[online++] = d.doseRate1;
+            if (d.status == NORMAL) {
+                ratesNormal10[normal++] = d.doseRate10;
+            }
+        }
+        if (newStatus != status) {
+            status = newStatus;
+            publishStatus();
+        }
+        if (newVibration != vibration) {
+            vibration = newVibration;
+            publishVibration();
+        }
+        // the dose up to now accumulates with the previous dose rate
+        integrateDose(online > 0);
+        if (!online) {
+            // keep the last values while no sensor delivers values
+            return;
+        }
+        // dose and alarm follow every value, the filters only decide about publishing
+        unsigned long now = millis();
+        doseRate1 = median(rates1, online);
+        double value = doseRate1;
+        if (doseRate1Filter.process(value, now)) {
+            publishDoseRate(-1, PSTR("doserate1min"), doseRate1);
+        }
+        doseRate10 = normal ? median(ratesNormal10, normal) : median(rates10, online);
+        value = doseRate10;
+        if (doseRate10Filter.process(value, now)) {
+            publishDoseRate(-1, PSTR("doserate10min"), doseRate10);
+        }
+        checkAlarm();
+    }
+
+    void integrateDose(bool valid) {
+        unsigned long now = millis();
+        if (bIntegrating) {
+            unsigned long dt = now - lastIntegration;
+            dose += doseRate1 * dt / 3600000.0;
+            doseRemainderMs += dt;
+            doseSeconds += doseRemainderMs / 1000;
+            doseRemainderMs %= 1000;
+            if (dose - publishedDose >= GDK101_DOSE_PUBLISH_MIN) {
+                publishDose();
+            }
+            saveDose(false);
+        }
+        lastIntegration = now;
+        bIntegrating = valid;
+    }
+
+    void checkAlarm() {
+        if (alarmHigh <= 0.0) {
+            return;
+        }
+        if (!bAlarm && doseRate1 >= alarmHigh) {
+            bAlarm = true;
+            publishAlarm();
+        } else if (bAlarm && doseRate1 <= alarmLow) {
+            bAlarm = false;
+            publishAlarm();
+        }
+    }
+
+    void restoreDose() {
+        DoseRecord record;
+        if (!readRecord(PSTR("dose"), &record, DOSE_MAGIC, DOSE_VERSION)) {
+            return;
+        }
+        dose = record.dose;
+        publishedDose = dose;
+        savedDose = dose;
+        doseSeconds = record.seconds;
+        alarmHigh = record.alarmHigh;
+        alarmLow = record.alarmLow;
+    }
+
+    void saveDose(bool force) {
+        if (!bPersistent) {
+            return;
+        }
+        unsigned long now = millis();
+        if (!force && (now - lastSave < GDK101_DOSE_SAVE_SEC * 1000UL ||
+                       dose - savedDose < GDK101_DOSE_SAVE_MIN)) {
+            return;
+        }
+        DoseRecord record;
+        memset(&record, 0, sizeof(record));
+        record.magic = DOSE_MAGIC;
+        record.version = DOSE_VERSION;
+        record.dose = dose;
+        record.seconds = doseSeconds;
+        record.alarmHigh = alarmHigh;
+        record.alarmLow = alarmLow;
+        writeRecord(PSTR("dose"), &record);
+        savedDose = dose;
+        lastSave = now;
+    }
+
+    void publishDevice(int index, const char *topic, const char *msg) {
+        // fused value if index < 0, else value of sensor index, topic in flash
+        if (index < 0) {
+            publish(topic, msg);
+            return;
+        }
+        char buf[40];
+        int len = snprintf_P(buf, sizeof(buf), PSTR("device/%d/"), index);
+        strncpy_P(buf + len, topic, sizeof(buf) - len);
+        buf[sizeof(buf) - 1] = 0;
+        publishTopic(buf, msg);
+    }
+
+    void publishDevice_P(int index, const char *topic, const char *msg) {
+        // as publishDevice, message in flash
+        char buf[SENSOR_CONST_SIZE];
+        strncpy_P(buf, msg, sizeof(buf));
+        buf[sizeof(buf) - 1] = 0;
+        publishDevice(index, topic, buf);
+    }
+
+    void publishDoseRate(int index, const char *topic, double value) {
+        char buf[16];
+        snprintf_P(buf, sizeof(buf), PSTR("%.2f"), value);
+        publishDevice(index, topic, buf);
+    }
+
+    void publishStatus() {
+        publish_P(PSTR("status"), gdk101StatusNames[status]);
+    }
+
+    void publishStatus(uint8_t index) {
+        publishDevice_P(index, PSTR("status"), gdk101StatusNames[devices[index].status]);
+    }
+
+    void publishVibration() {
+        publish_P(PSTR("vibration"), vibration ? PSTR("1") : PSTR("0"));
+    }
+
+    void publishVibration(uint8_t index) {
+        publishDevice_P(index, PSTR("vibration"), devices[index].vibration ? PSTR("1") : PSTR("0"));
+    }
+
+    void publishMeasuringTime(int index) {
+        // the fused measuring time is the one of the first sensor
+        char buf[16];
+        snprintf_P(buf, sizeof(buf), PSTR("%lu"), devices[index < 0 ? 0 : index].measuringTime);
+        publishDevice(index, PSTR("measuringtime"), buf);
+    }
+
+    void publishFirmware(int index) {
+        // the fused firmware version is the one of the first sensor
+        const Device &d = devices[index < 0 ? 0 : index];
+        char buf[8];
+        snprintf_P(buf, sizeof(buf), PSTR("%u.%u"), d.fwMajor, d.fwMinor);
+        publishDevice(index, PSTR("firmware"), buf);
+    }
+
+    void publishDevices() {
+        char buf[64];
+        int len = snprintf_P(buf, sizeof(buf), PSTR("{\"count\":%u,\"online\":%u,\"failed\":["),
+                             deviceCount, onlineCount);
+        bool first = true;
+        for (uint8_t i = 0; i < deviceCount; i++) {
+            if (devices[i].status == OFFLINE) {
+                len += snprintf_P(buf + len, sizeof(buf) - len, first ? PSTR("%u") : PSTR(",%u"),
+                                  i);
+                first = false;
+            }
+        }
+        snprintf_P(buf + len, sizeof(buf) - len, PSTR("]}"));
+        publish(PSTR("devices"), buf);
+    }
+
+    void publishDose() {
+        publishedDose = dose;
+        char buf[24];
+        snprintf_P(buf, sizeof(buf), PSTR("%.4f"), dose);
+        publish(PSTR("dose"), buf);
+    }
+
+    void publishDoseTime() {
+        char buf[16];
+        snprintf_P(buf, sizeof(buf), PSTR("%lu"), doseSeconds);
+        publish(PSTR("dose/time"), buf);
+    }
+
+    void publishAlarm() {
+        publish_P(PSTR("alarm"), bAlarm ? PSTR("on") : PSTR("off"));
+    }
+
+    void publishAlarmThreshold() {
+        if (alarmHigh <= 0.0) {
+            publish_P(PSTR("alarm/threshold"), PSTR("off"));
+        } else {
+            char buf[32];
+            snprintf_P(buf, sizeof(buf), PSTR("%.3f,%.3f"), alarmHigh, alarmLow);
+            publish(PSTR("alarm/threshold"), buf);
+        }
+    }
+
+    void publishBus() {
+        char buf[128];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"interval\":%lu,\"polls\":%lu,\"registers\":%u,\"budget\":%lu,"
+                        "\"measured\":%lu,\"overruns\":%lu,\"errors\":%lu}"),
+                   pollIntervalMs, polls, lastPollRegisters, lastPollBudgetUs,
+                   lastPollMeasuredUs, overruns, errors);
+        publish(PSTR("bus"), buf);
+    }
+
+    void deviceCommand(int index, const char *command) {
+        // index < 0: fused values
+        if (!strcmp_P(command, PSTR("doserate10min/get"))) {
+            publishDoseRate(index, PSTR("doserate10min"),
+                            index < 0 ? doseRate10 : devices[index].doseRate10);
+        }
+        if (!strcmp_P(command, PSTR("doserate1min/get"))) {
+            publishDoseRate(index, PSTR("doserate1min"),
+                            index < 0 ? doseRate1 : devices[index].doseRate1);
+        }
+        if (!strcmp_P(command, PSTR("status/get"))) {
+            if (index < 0) {
+                publishStatus();
+            } else {
+                publishStatus(index);
+            }
+        }
+        if (!strcmp_P(command, PSTR("vibration/get"))) {
+            if (index < 0) {
+                publishVibration();
+            } else {
+                publishVibration(index);
+            }
+        }
+        if (!strcmp_P(command, PSTR("measuringtime/get"))) {
+            publishMeasuringTime(index);
+        }
+        if (!strcmp_P(command, PSTR("firmware/get"))) {
+            publishFirmware(index);
+        }
+        if (!strcmp_P(command, PSTR("reset/set"))) {
+            if (index < 0) {
+                reset();
+            } else {
+                reset(index);
+            }
+        }
+    }
+
+    void onCommand(const char *command, const String &msg) {
+        if (!strncmp_P(command, PSTR("device/"), 7)) {
+            // device/<index>/<command>
+            char *end;
+            long index = strtol(command + 7, &end, 10);
+            if (end != command + 7 && *end == '/' && index >= 0 && index < deviceCount) {
+                deviceCommand(index, end + 1);
+            }
+            return;
+        }
+        deviceCommand(-1, command);
+        if (!strcmp_P(command, PSTR("devices/get"))) {
+            publishDevices();
+        }
+        if (!strcmp_P(command, PSTR("bus/get"))) {
+            publishBus();
+        }
+        if (!strcmp_P(command, PSTR("dose/get"))) {
+            publishDose();
+            publishDoseTime();
+        }
+        if (!strcmp_P(command, PSTR("dose/reset/set"))) {
+            resetDose();
+        }
+        if (!strcmp_P(command, PSTR("alarm/get"))) {
+            publishAlarm();
+        }
+        if (!strcmp_P(command, PSTR("alarm/threshold/get"))) {
+            publishAlarmThreshold();
+        }
+        if (!strcmp_P(command, PSTR("alarm/threshold/set"))) {
+            if (!strcmp_P(msg.c_str(), PSTR("off"))) {
+                setAlarmThreshold(0.0);
+            } else {
+                int sep = msg.indexOf(',');
+                double high = sep >= 0 ? msg.substring(0, sep).toFloat() : msg.toFloat();
+                double low = sep >= 0 ? msg.substring(sep + 1).toFloat() : -1.0;
+                setAlarmThreshold(high, low);
+            }
+        }
+    };
+};  // GammaGDK101
+
+}  // namespace ustd
@@ -3,9 +3,78 @@
 
 #include "scheduler.h"
 #include "sensors.h"
+#include "helper/window_statistics.h"
+#include "helper/sample_history.h"
+#include "helper/timeseries_compression.h"
+#include "helper/rollup.h"
+#include "helper/sample_log.h"
+#include "helper/flash_file.h"
+#include "helper/checksum.h"
+#include "helper/rtc_store.h"
+#include "helper/duty_cycle.h"
+#include "helper/filter_pipeline.h"
+#include "helper/burst_sampler.h"
+#include "helper/goertzel.h"
+#include "helper/noise_estimator.h"
+#include "helper/sensor_mupplet.h"
+
+#if defined(__ESP32__)
+#include <esp_sleep.h>
+#endif
+
+#ifndef LDR_HISTORY_SIZE
+#define LDR_HISTORY_SIZE 0  //!< Number of filtered values kept in the history ring buffer, 0 disables it
+#endif
+#ifndef LDR_HISTORY_CHUNK
+#define LDR_HISTORY_CHUNK 16  //!< Number of values sent per history message
+#endif
+#ifndef LDR_ARCHIVE_BLOCK_SIZE
+#define LDR_ARCHIVE_BLOCK_SIZE 0  //!< Block size of the compressed archive (e.g. 1024), 0 disables it
+#endif
+#ifndef LDR_ARCHIVE_BLOCKS
+#define LDR_ARCHIVE_BLOCKS 2  //!< Number of blocks of the compressed archive
+#endif
+#ifndef LDR_ROLLUPS
+#define LDR_ROLLUPS 0  //!< 1 enables the per-second/minute/hour rollups, 20 bytes of RAM per bucket
+#endif
+#ifndef LDR_ROLLUP_SECONDS
+#define LDR_ROLLUP_SECONDS 60  //!< Number of one-second aggregates kept
+#endif
+#ifndef LDR_ROLLUP_MINUTES
+#define LDR_ROLLUP_MINUTES 60  //!< Number of one-minute aggregates kept
+#endif
+#ifndef LDR_ROLLUP_HOURS
+#define LDR_ROLLUP_HOURS 24  //!< Number of one-hour aggregates kept
+#endif
+#ifndef LDR_OUTLIER_WINDOW
+#define LDR_OUTLIER_WINDOW 7  //!< Window size of the median / Hampel outlier filter
+#endif
+#ifndef LDR_SAMPLE_LOG_BLOCK_SIZE
+#define LDR_SAMPLE_LOG_BLOCK_SIZE 0  //!< RAM write buffer of the flash sample log (e.g. 256), 0 disables it
+#endif
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0 && !LDR_ROLLUPS
+#error "The LDR sample log (LDR_SAMPLE_LOG_BLOCK_SIZE) logs one-minute rollups, define LDR_ROLLUPS 1"
+#endif
+#ifndef LDR_DUTY_CYCLE_LINGER_MS
+#define LDR_DUTY_CYCLE_LINGER_MS 500  //!< Time to stay awake after the duty-cycle publish [ms]
+#endif
+#ifndef LDR_FLICKER_SLICES
+#define LDR_FLICKER_SLICES 2  //!< Sampling ticks a flicker measurement is spread over, 50 ms of readings each
+#endif
+#ifndef LDR_AUTO_DEADBAND_SIGMAS
+#define LDR_AUTO_DEADBAND_SIGMAS 4.0  //!< Automatic deadband in standard deviations of the filtered value
+#endif
 
 namespace ustd {
 
+static const char LDR_VERSION[] PROGMEM = "0.1.0";
+// sensorprocessor parameters of FAST, MEDIUM and LONGTERM
+static const SensorFilterParameters ldrFilterParameters[] PROGMEM = {
+    {1, 15, 0.001}, {4, 300, 0.005}, {50, 600, 0.01}};
+// names of IlluminanceLdr::SampleMode and the rollup tiers, OutlierMode uses filterOutlierModeNames
+static const char ldrSampleModeNames[][7] PROGMEM = {"SINGLE", "50HZ", "60HZ"};
+static const char ldrRollupTierNames[][7] PROGMEM = {"second", "minute", "hour"};
+
 // clang - format off
 /*! \brief mupplet-sensor analog LDR illumance sensor
 
@@ -17,14 +86,58 @@ The illuminance_ldr mupplet measures illuminance using a simple analog LDR
 | topic | message body | comment
 | ----- | ------------ | -------
 | `<mupplet-name>/sensor/unitilluminance` | normalized illuminance [0.0-1.0] | Float value encoded as string | `<mupplet-name>/sensor/mode` | `FAST`, `MEDIUM`, or `LONGTERM` | Integration time for illuminance values
+| `<mupplet-name>/sensor/unitilluminance/statistics` | JSON object | Only in windowed mode: `count`, `min`, `max`, `mean`, `stddev`, `p50` and `p95` of the samples of the last window, calibrated and outlier-rejected by the pipeline but not smoothed
+| `<mupplet-name>/sensor/statistics/window` | window length [s] | `0`: windowed mode disabled
+| `<mupplet-name>/sensor/sampling` | `SINGLE`, `50HZ` or `60HZ`, followed by `,<count>` | A/D sampling mode
+| `<mupplet-name>/sensor/flicker` | JSON object | Result of a flicker measurement: `percent` (percent flicker), `index` (flicker index), `hz` (dominant ripple frequency), `a100`/`a120` (ripple amplitudes) and `mean` (unit illuminance)
+| `<mupplet-name>/sensor/pipeline` | list of stages | Processing stages applied to raw values, e.g. `calibrate,outlier`
+| `<mupplet-name>/sensor/pipeline/<stage>` | parameter | Parameter of a pipeline stage, see `DynamicPipeline`
+| `<mupplet-name>/sensor/error` | `<command>: <reason>` | Sent if a command is rejected, e.g. `outlier/set` without `outlier` stage in the pipeline
+| `<mupplet-name>/sensor/outlier` | `OFF`, `MEDIAN` or `HAMPEL` | Outlier rejection applied to raw values before any further processing
+| `<mupplet-name>/sensor/timeconstant` | time constant [s] | `0`: smoothing by sample count of the filter mode
+| `<mupplet-name>/sensor/deadband` | deadband, `default` or `auto,<deadband>` | Minimum change of the filtered value that causes a publish
+| `<mupplet-name>/sensor/noise` | JSON object | Estimated noise of the processed samples: `sigma` (standard deviation), `valid` and `deadband` (current deadband)
+| `<mupplet-name>/sensor/calibration` | `<gain>,<offset>` | Calibration applied to the raw unit illuminance: `gain * raw + offset`
+| `<mupplet-name>/sensor/threshold` | `<low>,<high>` or `off` | Thresholds for the `sensor/threshold/state` message
+| `<mupplet-name>/sensor/threshold/state` | `low` or `high` | Sent when the filtered value falls below `<low>` or rises above `<high>`
+| `<mupplet-name>/sensor/history` | JSON object | One chunk of a history query: `{"seq":n,"last":bool,"samples":[[time,value],...]}`
+| `<mupplet-name>/sensor/rollup/<tier>` | JSON object | One chunk of a rollup query, `<tier>` is `second`, `minute` or `hour`: `{"seq":n,"last":bool,"buckets":[[start,count,min,max,mean],...]}`
+| `<mupplet-name>/sensor/log` | JSON object | One chunk of the flash sample log, same format as `sensor/rollup/<tier>`
+| `<mupplet-name>/sensor/log/stats` | JSON object | Sample log write statistics: `records`, `payload`, `written`, `writes`, `torn` (bytes dropped by recovery) and `wa` (estimated write amplification)
+| `<mupplet-name>/sensor/history/export` | JSON object | One chunk of the compressed archive, same format as `sensor/history`. `"truncated":true` if the archive rotated during the export
 
 #### Messages received by illuminance_ldr mupplet:
 
 | topic | message body | comment
 | ----- | ------------ | -------
-| `<mupplet-name>/sensor/unitilluminance/get` | - | Causes current value to be sent with.
+| `<mupplet-name>/sensor/unitilluminance/get` | - | Causes current value to be sent. Requests arriving within one sampling interval (200ms) are answered with a single message.
 | `<mupplet-name>/sensor/mode/get` | - | Returns filterMode: `FAST`, `MEDIUM`, or `LONGTERM`
 | `<mupplet-name>/sensor/mode/set` | `FAST`, `MEDIUM`, or `LONGTERM` | Set integration time for illuminance values
+| `<mupplet-name>/sensor/sampling/get` | - | Returns the sampling mode
+| `<mupplet-name>/sensor/sampling/set` | `SINGLE`, `50HZ` or `60HZ`, optionally followed by `,<count>` | `SINGLE`: one A/D reading per sample. `50HZ`/`60HZ`: mean of `<count>` (default 8) readings spread evenly over one mains period, which cancels the 100/120 Hz ripple of lamps. Blocks for one mains period (20 or 16.7 ms) per sample
+| `<mupplet-name>/sensor/flicker/get` | - | Measures lamp flicker: captures 50 ms at 2 kHz (blocking) on each of the next `LDR_FLICKER_SLICES` (2) sampling ticks and publishes the result on `sensor/flicker`
+| `<mupplet-name>/sensor/pipeline/get` | - | Returns the list of processing stages
+| `<mupplet-name>/sensor/pipeline/set` | list of stages | Sets the processing stages applied to raw values before statistics, rollups and the filter mode smoothing, any sequence of `oversample`, `calibrate`, `outlier`, `ema` and `deadband`. Default: `calibrate,outlier`
+| `<mupplet-name>/sensor/pipeline/<stage>/get` | - | Returns the parameter of a pipeline stage
+| `<mupplet-name>/sensor/pipeline/<stage>/set` | parameter | Sets the oversample factor (samples averaged per value), the calibration `<gain>,<offset>`, the outlier mode, the EMA alpha (0.0-1.0] or the deadband eps of the pipeline stage. For `ema`, a value followed by `s` (e.g. `5s`) sets a time constant in seconds instead of alpha
+| `<mupplet-name>/sensor/outlier/get` | - | Returns the outlier rejection mode
+| `<mupplet-name>/sensor/outlier/set` | `OFF`, `MEDIAN` or `HAMPEL` | `MEDIAN`: sliding median of `LDR_OUTLIER_WINDOW` raw values, `HAMPEL`: replace raw values deviating more than 3 robust standard deviations from the sliding median. Rejected with `sensor/error` if the pipeline has no `outlier` stage
+| `<mupplet-name>/sensor/timeconstant/get` | - | Returns the smoothing time constant
+| `<mupplet-name>/sensor/timeconstant/set` | time constant [s] | Replaces the smoothing over a number of samples of the filter mode by an exponential filter with the given time constant, which is independent of the sampling interval. `0` restores the filter mode smoothing
+| `<mupplet-name>/sensor/deadband/get` | - | Returns the deadband
+| `<mupplet-name>/sensor/deadband/set` | deadband, `default` or `auto` | Overrides the deadband of the filter mode, `default` restores it. `auto` derives the deadband from the measured noise: `LDR_AUTO_DEADBAND_SIGMAS` standard deviations of the filtered value
+| `<mupplet-name>/sensor/noise/get` | - | Returns the noise estimate
+| `<mupplet-name>/sensor/calibration/get` | - | Returns the calibration
+| `<mupplet-name>/sensor/calibration/set` | `<gain>,<offset>` | Sets the calibration. Rejected with `sensor/error` if the pipeline has no `calibrate` stage
+| `<mupplet-name>/sensor/threshold/get` | - | Returns the thresholds
+| `<mupplet-name>/sensor/threshold/set` | `<low>,<high>` or `off` | Sets the thresholds (hysteresis between `<low>` and `<high>`)
+| `<mupplet-name>/sensor/statistics/window/get` | - | Returns the statistics window length in seconds
+| `<mupplet-name>/sensor/statistics/window/set` | window length [s] | Enables windowed mode (one statistics message per window instead of individual values), `0` disables it
+| `<mupplet-name>/sensor/history/get` | `<from>,<to>` or empty | Returns the recorded values with timestamps (`time(nullptr)`, seconds) in the given range in chunks of `LDR_HISTORY_CHUNK` samples, one chunk per sampling interval. Only if `LDR_HISTORY_SIZE` > 0
+| `<mupplet-name>/sensor/rollup/<tier>/get` | number of buckets or empty | Returns the last completed aggregates of the calibrated, outlier-rejected (not smoothed) values of tier `second`, `minute` or `hour` in chunks of `LDR_HISTORY_CHUNK` buckets. Only if `LDR_ROLLUPS` is 1
+| `<mupplet-name>/sensor/log/get` | - | Writes pending log records to flash and returns the complete sample log in chunks of `LDR_HISTORY_CHUNK` records. Only if `LDR_SAMPLE_LOG_BLOCK_SIZE` > 0
+| `<mupplet-name>/sensor/log/stats/get` | - | Returns the sample log write statistics
+| `<mupplet-name>/sensor/history/export/get` | - | Exports the complete compressed archive in chunks of `LDR_HISTORY_CHUNK` samples. Only if `LDR_ARCHIVE_BLOCK_SIZE` > 0
 
 <img src="https://github.com/muwerk/mupplet-sensor/blob/master/extras/ldr.png" width="30%"
 height="30%"> Hardware: LDR, 10kΩ resistor
@@ -50,19 +163,159 @@ void setup() {
 }
 ```
 
+If `LDR_HISTORY_SIZE` is defined (e.g. as 128), the last `LDR_HISTORY_SIZE` filtered values
+are kept in a RAM ring buffer of 8 bytes per value, so that a backend can request the values it
+missed during a network outage. For longer
+periods, the filtered values can additionally be kept in a compressed archive (delta-of-delta
+timestamps and XOR coded values, see `TimeSeriesEncoder`) by defining `LDR_ARCHIVE_BLOCK_SIZE`.
+The archive needs `LDR_ARCHIVE_BLOCKS` * `LDR_ARCHIVE_BLOCK_SIZE` + about 130 bytes of RAM. With
+a block size of 1024 (2 KB), a typical day of `MEDIUM` values fits into the archive.
+
+For dashboards, if `LDR_ROLLUPS` is defined as 1, per-second, per-minute and per-hour
+aggregates (min, max, mean) of the pipeline output (calibrated and outlier-rejected, not
+smoothed) are maintained incrementally, see `Rollups`. The rollups need 20 bytes of RAM per bucket, about 2.9 KB with the default
+`LDR_ROLLUP_SECONDS`, `LDR_ROLLUP_MINUTES` and `LDR_ROLLUP_HOURS`. If additionally
+`LDR_SAMPLE_LOG_BLOCK_SIZE` is defined (e.g. as 256) and `enableSampleLog()` is called, every
+completed one-minute aggregate is appended to a log on the flash file system (see `SampleLog`)
+that survives reboots and power loss. The log needs `LDR_SAMPLE_LOG_BLOCK_SIZE` + about 130
+bytes of RAM.
+
+Raw values pass through a runtime configurable pipeline of processing stages (see
+`DynamicPipeline`) before they are aggregated and smoothed according to the filter mode.
+
+If `begin()` is called with `persistent = true`, filter mode, time constant, sampling mode,
+pipeline, outlier mode, deadband, calibration, thresholds and statistics window are stored in a small binary file `/<name>.cfg` on the flash
+file system whenever they change, and restored by `begin()`. The file system must be mounted
+before `begin()` is called.
+
+After `enableWarmStart()`, the state of the filter is kept in RTC memory (see `RtcStore`),
+which survives software resets and deep sleep. After such a reset, the smoothing does not have
+to refill its window and the first published value is immediately accurate. Only the window of
+the `outlier` pipeline stage is not kept.
+
+#### Duty-cycle mode for battery powered nodes
+
+```cpp
+void setup() {
+    // before starting the network:
+    ldr.dutyCycle(60);  // returns only if the value has to be published
+    // start network, scheduler, ...
+    ldr.begin(&sched);
+}
+```
+
+`dutyCycle()` takes an oversampled reading and compares it with the last published value
+stored in RTC memory. If the change is within the deadband, the node immediately goes back to
+deep sleep without starting the radio. Otherwise the value is published after `begin()` as soon
+as MQTT is connected (`mqtt/state`), and the node goes to deep sleep shortly after the publish
+or after the given awake time. `DutyCycleController::estimate()` estimates the energy per hour
+of a configuration, and can be used on hosts together with `DutyCycleController::decide()` to
+simulate a configuration on recorded values, see `test/sim_duty_cycle.cpp`.
+On ESP8266, GPIO16 has to be connected to RST for waking up from deep sleep.
+
 Note: For ESP32 make sure to use a port connected to ADC #1, since ADC #2 conflicts with Wifi
 and ports connected to ADC #2 cannot be used concurrently with Wifi!
 */
 // clang-format on
-class IlluminanceLdr {
+class IlluminanceLdr : public SensorMupplet<IlluminanceLdr> {
+    friend class SensorMupplet<IlluminanceLdr>;
+
   private:
-    String LDR_VERSION = "0.1.0";
-    Scheduler *pSched;
-    int tID;
-    String name;
     uint8_t port;
     double ldrvalue;
-    bool bActive=false;
+    char illuminanceMsg[16];
+    bool bIlluminanceMsgValid = false;
+    bool bIlluminanceGetPending = false;
+    unsigned long statisticsWindowMs = 0;
+    unsigned long statisticsWindowStart = 0;
+    WindowStatistics statistics;
+#if LDR_HISTORY_SIZE > 0
+    SampleHistory<LDR_HISTORY_SIZE> history;
+    bool bHistoryQuery = false;
+    uint32_t historyFrom;
+    uint32_t historyTo;
+    unsigned int historySkip;
+    unsigned int historySeq;
+#endif
+#if LDR_ARCHIVE_BLOCK_SIZE > 0
+    CompressedSeries<LDR_ARCHIVE_BLOCK_SIZE, LDR_ARCHIVE_BLOCKS> archive;
+    TimeSeriesDecoder archiveDecoder;
+    bool bArchiveExport = false;
+    unsigned int archiveExportBlock;
+    unsigned long archiveExportGeneration;
+    unsigned int archiveExportSeq;
+#endif
+#if LDR_ROLLUPS
+    Rollups<LDR_ROLLUP_SECONDS, LDR_ROLLUP_MINUTES, LDR_ROLLUP_HOURS> rollups;
+    int rollupQueryTier = -1;
+    uint32_t rollupQueryFrom;
+    unsigned int rollupQuerySeq;
+#endif
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+    SampleLog<LDR_SAMPLE_LOG_BLOCK_SIZE> sampleLog;
+    SampleLog<LDR_SAMPLE_LOG_BLOCK_SIZE>::Cursor sampleLogCursor;
+    bool bSampleLog = false;
+    bool bSampleLogQuery = false;
+    unsigned int sampleLogSeq;
+#endif
+    double deadband = -1.0;  // -1: default of the filter mode, -2: automatic
+    NoiseEstimator noise;
+    double thresholdLow = 0.0;
+    double thresholdHigh = 0.0;  // thresholds disabled if thresholdHigh <= thresholdLow
+    int thresholdState = -1;
+    bool bPersistent = false;
+    int rtcOffset = -1;  // < 0: warm start disabled
+    bool bDutyCycle = false;
+    bool bDutyCycleConnected = false;
+    bool bDutyCyclePublished = false;
+    unsigned long dutyCycleSleepSec;
+    unsigned long dutyCycleAwakeMs;
+    unsigned long dutyCycleStart;
+    unsigned long dutyCyclePublishTime;
+    uint8_t dutyCycleOffset;
+    DutyCycleController::State dutyCycleState;  // saved to RTC memory once the value is sent
+
+    // filter state kept in RTC memory for warm starts, 12 words plus checksum
+    struct WarmState {
+        uint8_t filterMode;
+        uint8_t flags;  // WARM_SMOOTHING, WARM_PIPELINE_EMA: the average is valid
+        uint8_t version;
+        uint8_t reserved;
+        uint32_t noVals;
+        double meanVal;
+        double lastVal;
+        double ldrvalue;
+        double smoothing;
+        double pipelineEma;
+    };
+    enum WarmStateFlags { WARM_SMOOTHING = 1, WARM_PIPELINE_EMA = 2 };
+    static const uint8_t WARM_STATE_VERSION = 1;  // a state of another layout is not restored
+
+    // binary layout of the configuration file, restored without any parsing
+    struct Config {
+        uint32_t magic;
+        uint8_t version;
+        uint8_t filterMode;
+        uint8_t outlierMode;
+        uint8_t sampleMode;
+        float deadband;
+        float calibrationGain;
+        float calibrationOffset;
+        float thresholdLow;
+        float thresholdHigh;
+        uint32_t statisticsWindow;
+        uint8_t pipeline[DynamicPipeline<>::MAX_STAGES];
+        uint8_t sampleCount;
+        uint8_t reserved2[2];
+        uint32_t oversampleFactor;
+        float emaAlpha;
+        float emaTimeConstant;
+        float pipelineDeadband;
+        float timeConstant;
+        uint32_t crc;
+    };
+    static const uint32_t CONFIG_MAGIC = 0x4352444c;  // "LDRC"
+    static const uint8_t CONFIG_VERSION = 3;
 #ifdef __ESP32__
     double adRange = 4096.0;  // 12 bit default
 #else
@@ -70,18 +323,40 @@ class IlluminanceLdr {
 #endif
 
   public:
-    enum FilterMode { FAST, MEDIUM, LONGTERM };
-    FilterMode filterMode;
+    enum OutlierMode { OUTLIER_OFF, OUTLIER_MEDIAN, OUTLIER_HAMPEL };
+    enum SampleMode { SAMPLE_SINGLE, SAMPLE_MAINS_50HZ, SAMPLE_MAINS_60HZ };
+
+  private:
+    OutlierMode outlierMode = OUTLIER_OFF;
+    SampleMode sampleMode = SAMPLE_SINGLE;
+    uint8_t sampleCount = 8;
+    bool bFlickerPending = false;
+    uint8_t flickerSlice = 0;      // number of flicker slices captured, 0: no measurement running
+    double flickerSum = 0.0;       // sum of the readings of all slices
+    double flickerPower100 = 0.0;  // sum of the squared 100 Hz amplitudes of all slices
+    double flickerPower120 = 0.0;  // sum of the squared 120 Hz amplitudes of all slices
+
+  public:
+    DynamicPipeline<LDR_OUTLIER_WINDOW> pipeline;
+    EmaStage smoothing;  // time constant based smoothing, replaces smoothInterval if active
     ustd::sensorprocessor illuminanceSensor = ustd::sensorprocessor(4, 600, 0.005);
 
     IlluminanceLdr(String name, uint8_t port, FilterMode filterMode = FilterMode::MEDIUM)
-        : name(name), port(port), filterMode(filterMode) {
+        : SensorMupplet(name), port(port) {
         /*! Instantiate an LDR sensor mupplet
         @param name Name used for pub/sub messages
         @param port GPIO port with A/D converter capabilities.
         @param filterMode FAST, MEDIUM or LONGTERM filtering of sensor values
         */
-       setFilterMode(filterMode, true);
+        char spec[24];
+        strncpy_P(spec, PSTR("calibrate,outlier"), sizeof(spec));
+        pipeline.configure(spec);
+        pipeline.calibrate.clamp = true;
+        // never reject changes of one A/D step
+        pipeline.outlier.hampel.minDeviation = 1.0 / (adRange - 1.0);
+        noise.minLimit = 1.0 / (adRange - 1.0);
+        setFilter(&illuminanceSensor, ldrFilterParameters);
+        setFilterMode(filterMode, true);
     }
 
     ~IlluminanceLdr() {
@@ -94,98 +369,1043 @@ class IlluminanceLdr {
         return ldrvalue;
     }
 
-    void begin(Scheduler *_pSched) {
-        /*! Start processing of A/D input from LDR */
-        pSched = _pSched;
+    OutlierMode getOutlierMode() {
+        /*! @return Outlier rejection of raw values, see setOutlierMode() */
+        return outlierMode;
+    }
 
-        auto ft = [=]() { this->loop(); };
-        tID = pSched->add(ft, name, 200000);  // 200ms
+    SampleMode getSampleMode() {
+        /*! @return A/D sampling mode, see setSampleMode() */
+        return sampleMode;
+    }
+
+    uint8_t getSampleCount() {
+        /*! @return Number of readings per mains period of the mains sampling modes */
+        return sampleCount;
+    }
 
-        auto fnall = [=](String topic, String msg, String originator) {
-            this->subsMsg(topic, msg, originator);
-        };
-        pSched->subscribe(tID, name + "/sensor/#", fnall);
-        bActive = true;
+    bool isFlickerPending() {
+        /*! @return true while a flicker measurement is requested or running */
+        return bFlickerPending || flickerSlice;
     }
 
-    void setFilterMode(FilterMode mode, bool silent = false) {
+    void begin(Scheduler *_pSched, bool persistent = false) {
+        /*! Start processing of A/D input from LDR
+        @param _pSched Pointer to the muwerk scheduler
+        @param persistent If true, the configuration is restored from and saved to the flash
+        file system, which must already be mounted
+        */
+        if (persistent && !bPersistent) {
+            restoreConfig();
+            bPersistent = true;
+        }
+        if (rtcOffset >= 0) {
+            // restoreConfig() resets the filter, restore again with the persisted filter mode
+            restoreWarmState();
+        }
+        startTask(_pSched, 200000);  // 200ms
+        if (bDutyCycle) {
+            // the value of a duty-cycle wake is published once MQTT is connected
+            char topic[16];
+            strncpy_P(topic, PSTR("mqtt/state"), sizeof(topic));
+            pSched->subscribe(tID, topic, [this](String, String msg, String) {
+                bDutyCycleConnected = !strcmp_P(msg.c_str(), PSTR("connected"));
+            });
+            strncpy_P(topic, PSTR("mqtt/state/get"), sizeof(topic));
+            pSched->publish(topic);
+        }
+    }
+
+  private:
+    void onFilterMode() {
+        // called by setFilterMode() with the parameters of the filter mode applied
+        if (deadband >= 0.0) {
+            illuminanceSensor.eps = deadband;
+        }
+        if (smoothing.timeConstant > 0.0) {
+            // smoothInterval 0 makes the sensorprocessor a pure deadband / publish filter
+            illuminanceSensor.smoothInterval = 0;
+        }
+        updateAutoDeadband();
+        smoothing.reset();
+        saveConfig();
+    }
+
+  public:
+
+    void setOutlierMode(OutlierMode mode, bool silent = false) {
+        /*! Set outlier rejection for raw values
+        @param mode OUTLIER_OFF, OUTLIER_MEDIAN (sliding median) or OUTLIER_HAMPEL (replace
+        outliers by the sliding median)
+        @param silent If true, the new mode is not published
+        */
+        outlierMode = mode;
         switch (mode) {
-        case FAST:
-            filterMode = FAST;
-            illuminanceSensor.smoothInterval = 1;
-            illuminanceSensor.pollTimeSec = 15;
-            illuminanceSensor.eps = 0.001;
-            illuminanceSensor.reset();
+        case OUTLIER_MEDIAN:
+            pipeline.outlier.setMode(OutlierStage<LDR_OUTLIER_WINDOW>::MEDIAN);
             break;
-        case MEDIUM:
-            filterMode = MEDIUM;
-            illuminanceSensor.smoothInterval = 4;
-            illuminanceSensor.pollTimeSec = 300;
-            illuminanceSensor.eps = 0.005;
-            illuminanceSensor.reset();
+        case OUTLIER_HAMPEL:
+            pipeline.outlier.setMode(OutlierStage<LDR_OUTLIER_WINDOW>::HAMPEL);
             break;
-        case LONGTERM:
         default:
-            filterMode = LONGTERM;
-            illuminanceSensor.smoothInterval = 50;
-            illuminanceSensor.pollTimeSec = 600;
-            illuminanceSensor.eps = 0.01;
-            illuminanceSensor.reset();
+            pipeline.outlier.setMode(OutlierStage<LDR_OUTLIER_WINDOW>::OFF);
             break;
         }
+        saveConfig();
+        if (!silent)
+            publishOutlierMode();
+    }
+
+    void setSampleMode(SampleMode mode, unsigned int count = 8, bool silent = false) {
+        /*! Set the A/D sampling mode
+        @param mode SAMPLE_SINGLE: one reading per sample, SAMPLE_MAINS_50HZ or
+        SAMPLE_MAINS_60HZ: mean of count readings spread evenly over one mains period, which
+        cancels the ripple of lamps powered by AC mains
+        @param count Number of readings per mains period, [4-64]
+        @param silent If true, the new sampling mode is not published
+        */
+        sampleMode = mode;
+        sampleCount = count < 4 ? 4 : (count > 64 ? 64 : count);
+        saveConfig();
+        if (!silent)
+            publishSampleMode();
+    }
+
+    bool setPipeline(const char *spec, bool silent = false) {
+        /*! Configure the processing stages applied to raw values
+        @param spec Comma separated list of stages: `oversample`, `calibrate`, `outlier`, `ema`
+        and `deadband`
+        @param silent If true, the new pipeline is not published
+        @return false if the list is invalid, the pipeline is unchanged in that case
+        */
+        bool ok = pipeline.configure(spec);
+        if (ok) {
+            saveConfig();
+        }
         if (!silent)
-            publishFilterMode();
+            publishPipeline(pipeline);
+        return ok;
+    }
+
+    void setTimeConstant(double seconds, bool silent = false) {
+        /*! Smooth with an exponential filter of a given time constant
+
+        The filter uses the actual time elapsed between samples, so the smoothing does not
+        change with the sampling interval. It replaces the smoothing over a number of samples
+        of the filter mode; deadband and maximum publish interval of the filter mode remain
+        active.
+
+        @param seconds Time constant [s], 0 restores the smoothing of the filter mode
+        @param silent If true, the new time constant is not published
+        */
+        smoothing.timeConstant = seconds > 0.0 ? seconds : 0.0;
+        setFilterMode(filterMode, true);
+        if (!silent)
+            publishTimeConstant();
+    }
+
+    void setDeadband(double value, bool silent = false) {
+        /*! Override the deadband of the filter mode
+        @param value Minimum change of the filtered value that causes a publish, -1 restores the
+        default of the filter mode, -2 derives the deadband from the measured noise of the
+        samples (the default of the filter mode is used until the estimate has settled)
+        @param silent If true, the new deadband is not published
+        */
+        if (value < 0.0) {
+            deadband = value < -1.5 ? -2.0 : -1.0;
+        } else {
+            deadband = value;
+        }
+        setFilterMode(filterMode, true);
+        if (!silent)
+            publishDeadband();
+    }
+
+    void setCalibration(double gain, double offset, bool silent = false) {
+        /*! Set the calibration applied to the raw unit illuminance
+        @param gain Factor applied to the raw value
+        @param offset Offset added after applying the gain
+        @param silent If true, the new calibration is not published
+        */
+        pipeline.calibrate.gain = gain;
+        pipeline.calibrate.offset = offset;
+        saveConfig();
+        if (!silent)
+            publishCalibration();
+    }
+
+    void setThresholds(double low, double high, bool silent = false) {
+        /*! Set thresholds for `low`/`high` state messages
+        @param low The state changes to `low` when the filtered value falls below this value
+        @param high The state changes to `high` when the filtered value rises above this value,
+        thresholds are disabled if high <= low
+        @param silent If true, the new thresholds are not published
+        */
+        thresholdLow = low;
+        thresholdHigh = high;
+        thresholdState = -1;
+        saveConfig();
+        if (!silent)
+            publishThresholds();
+    }
+
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+    bool enableSampleLog(const char *prefix = nullptr, uint8_t segments = 4,
+                         uint32_t segmentSize = 16384) {
+        /*! Log completed one-minute aggregates to the flash file system
+
+        Only available if `LDR_SAMPLE_LOG_BLOCK_SIZE` is defined > 0. The file system must
+        already be mounted. The log occupies at most segments * segmentSize bytes; with the
+        defaults about two days of aggregates are kept.
+
+        @param prefix Path prefix of the log files, default is `/<name>`
+        @param segments Number of log segment files
+        @param segmentSize Maximum size of a log segment file in bytes
+        @return true if the log could be opened
+        */
+        char defPrefix[40];
+        snprintf_P(defPrefix, sizeof(defPrefix), PSTR("/%s"), name.c_str());
+        bSampleLog = sampleLog.begin(prefix ? prefix : defPrefix, segments, segmentSize);
+        return bSampleLog;
+    }
+#endif
+
+    bool enableWarmStart(uint8_t offset = 32) {
+        /*! Keep the filter state in RTC memory and restore it now if it is valid
+
+        Can be called before or after `begin()`; if called before, `begin()` restores the
+        state again after restoring the configuration. The state is only restored if it has
+        been saved with the current filter mode and the same version of its layout. It covers the filter mode smoothing, the time
+        constant smoothing and the `ema` pipeline stage, but not the window of the `outlier`
+        stage, which refills within `LDR_OUTLIER_WINDOW` samples. Changing the filter mode or
+        the time constant later discards the restored state. It occupies 13 words of RTC
+        memory.
+
+        @param offset Start of the state in RTC memory in 4-byte words, must be different for
+        every LDR instance
+        @return true if a valid state has been restored
+        */
+        rtcOffset = offset;
+        return restoreWarmState();
+    }
+
+    bool dutyCycle(unsigned long sleepSec, uint8_t oversample = 16, unsigned long awakeMs = 3000,
+                   uint8_t offset = 48, bool persistent = false) {
+        /*! Run one wake cycle of duty-cycle mode, to be called early in setup()
+
+        Takes an oversampled reading and decides against the last published value (kept in RTC
+        memory) and the deadband of the filter mode whether it has to be published. A publish
+        is forced at least every pollTimeSec of the filter mode.
+
+        The value is published as soon as MQTT reports `mqtt/state` `connected` after `begin()`,
+        and becomes the last published value only then. The node goes to deep sleep
+        `LDR_DUTY_CYCLE_LINGER_MS` after the publish, or after awakeMs without a connection; the
+        next wake then tries again.
+
+        @param sleepSec Deep sleep time between two wakes [s]
+        @param oversample Number of A/D readings averaged
+        @param awakeMs Maximum time to stay awake for connecting and publishing [ms]
+        @param offset Start of the duty cycle state in RTC memory in 4-byte words (needs 7 words)
+        @param persistent If true, the configuration (deadband, calibration, ...) is restored
+        from the flash file system before deciding, as `begin()` does. The file system must
+        already be mounted.
+        @return true if the value has to be published. If it does not, the node goes to deep
+        sleep and the function only returns on platforms without deep sleep
+        */
+        if (persistent && !bPersistent) {
+            restoreConfig();
+            bPersistent = true;
+        }
+        double val = 0.0;
+        for (uint8_t i = 0; i < oversample; i++) {
+            val += readUnitIlluminance();
+        }
+        val /= oversample ? oversample : 1;
+        pipeline.calibrate.process(val, millis());
+        DutyCycleController controller(illuminanceSensor.eps,
+                                       sleepSec ? illuminanceSensor.pollTimeSec / sleepSec : 0);
+        if (!RtcStore::load(offset, &controller.state, sizeof(controller.state))) {
+            memset(&controller.state, 0, sizeof(controller.state));
+        }
+        DutyCycleController::State previous = controller.state;
+        bool publish = controller.decide(val);
+        dutyCycleSleepSec = sleepSec;
+        if (!publish) {
+            RtcStore::save(offset, &controller.state, sizeof(controller.state));
+            deepSleep();
+            return false;
+        }
+        // until the value has been sent, only count the wake
+        dutyCycleState = controller.state;
+        dutyCycleOffset = offset;
+        ++previous.wakes;
+        RtcStore::save(offset, &previous, sizeof(previous));
+        ldrvalue = val;
+        bIlluminanceMsgValid = false;
+        bIlluminanceGetPending = true;
+        bDutyCycle = true;
+        dutyCycleAwakeMs = awakeMs;
+        dutyCycleStart = millis();
+        return true;
+    }
+
+    void setStatisticsWindow(unsigned long seconds, bool silent = false) {
+        /*! Enable or disable windowed statistics mode
+
+        In windowed mode individual illuminance values are no longer published. Instead
+        one summary of all samples is published per window on
+        `<name>/sensor/unitilluminance/statistics`. The samples are those of the processing
+        pipeline (calibrated and outlier-rejected by default), before the smoothing.
+
+        @param seconds Window length in seconds, 0 disables windowed mode
+        @param silent If true, the new window length is not published
+        */
+        statisticsWindowMs = seconds * 1000UL;
+        statisticsWindowStart = millis();
+        statistics.reset();
+        saveConfig();
+        if (!silent)
+            publishStatisticsWindow();
     }
 
   private:
+    void restoreConfig() {
+        Config config;
+        if (!readRecord(PSTR("cfg"), &config, CONFIG_MAGIC, CONFIG_VERSION)) {
+            return;
+        }
+        // a record with values out of range keeps the defaults, the casts below must be valid
+        if (config.filterMode > LONGTERM || config.outlierMode > OUTLIER_HAMPEL ||
+            config.sampleMode > SAMPLE_MAINS_60HZ || config.oversampleFactor < 1) {
+            return;
+        }
+        deadband = config.deadband;
+        pipeline.calibrate.gain = config.calibrationGain;
+        pipeline.calibrate.offset = config.calibrationOffset;
+        pipeline.oversample.factor = config.oversampleFactor;
+        pipeline.ema.alpha = config.emaAlpha;
+        pipeline.ema.timeConstant = config.emaTimeConstant;
+        pipeline.deadband.eps = config.pipelineDeadband;
+        // a damaged order keeps the default pipeline
+        pipeline.setOrder(config.pipeline);
+        smoothing.timeConstant = config.timeConstant;
+        thresholdLow = config.thresholdLow;
+        thresholdHigh = config.thresholdHigh;
+        statisticsWindowMs = config.statisticsWindow * 1000UL;
+        statisticsWindowStart = millis();
+        setFilterMode((FilterMode)config.filterMode, true);
+        setOutlierMode((OutlierMode)config.outlierMode, true);
+        sampleMode = (SampleMode)config.sampleMode;
+        sampleCount = config.sampleCount ? config.sampleCount : 8;
+    }
+
+    void saveConfig() {
+        if (!bPersistent) {
+            return;
+        }
+        Config config;
+        memset(&config, 0, sizeof(config));
+        config.magic = CONFIG_MAGIC;
+        config.version = CONFIG_VERSION;
+        config.filterMode = filterMode;
+        config.outlierMode = outlierMode;
+        config.sampleMode = sampleMode;
+        config.sampleCount = sampleCount;
+        config.deadband = deadband;
+        config.calibrationGain = pipeline.calibrate.gain;
+        config.calibrationOffset = pipeline.calibrate.offset;
+        memcpy(config.pipeline, pipeline.order, sizeof(config.pipeline));
+        config.oversampleFactor = pipeline.oversample.factor;
+        config.emaAlpha = pipeline.ema.alpha;
+        config.emaTimeConstant = pipeline.ema.timeConstant;
+        config.pipelineDeadband = pipeline.deadband.eps;
+        config.timeConstant = smoothing.timeConstant;
+        config.thresholdLow = thresholdLow;
+        config.thresholdHigh = thresholdHigh;
+        config.statisticsWindow = statisticsWindowMs / 1000UL;
+        writeRecord(PSTR("cfg"), &config);
+    }
+
+    void saveWarmState() {
+        WarmState state;
+        memset(&state, 0, sizeof(state));
+        state.filterMode = filterMode;
+        state.version = WARM_STATE_VERSION;
+        state.noVals = illuminanceSensor.noVals;
+        state.meanVal = illuminanceSensor.meanVal;
+        state.lastVal = illuminanceSensor.lastVal;
+        state.ldrvalue = ldrvalue;
+        if (smoothing.valid()) {
+            state.flags |= WARM_SMOOTHING;
+            state.smoothing = smoothing.value();
+        }
+        if (pipeline.ema.valid()) {
+            state.flags |= WARM_PIPELINE_EMA;
+            state.pipelineEma = pipeline.ema.value();
+        }
+        RtcStore::save(rtcOffset, &state, sizeof(state));
+    }
+
+    bool restoreWarmState() {
+        WarmState state;
+        if (!RtcStore::load(rtcOffset, &state, sizeof(state)) ||
+            state.version != WARM_STATE_VERSION || state.filterMode != filterMode) {
+            return false;
+        }
+        // the sensorprocessor never reduces noVals, it must not exceed the current window
+        illuminanceSensor.noVals = state.noVals < illuminanceSensor.smoothInterval
+                                       ? state.noVals
+                                       : illuminanceSensor.smoothInterval;
+        illuminanceSensor.meanVal = state.meanVal;
+        illuminanceSensor.lastVal = state.lastVal;
+        // keep 'first' set, so that the restored value is published immediately
+        if ((state.flags & WARM_SMOOTHING) && smoothing.timeConstant > 0.0) {
+            smoothing.restore(state.smoothing, millis());
+        }
+        if (state.flags & WARM_PIPELINE_EMA) {
+            pipeline.ema.restore(state.pipelineEma, millis());
+        }
+        ldrvalue = state.ldrvalue;
+        bIlluminanceMsgValid = false;
+        return true;
+    }
+
+    double readUnitIlluminance() {
+        if (sampleMode == SAMPLE_SINGLE) {
+            return analogRead(port) / (adRange - 1.0);
+        }
+        unsigned long periodUs = sampleMode == SAMPLE_MAINS_60HZ ? 16667 : 20000;
+        double mean = BurstSampler::spreadMean([this]() { return (double)analogRead(port); },
+                                               sampleCount, periodUs);
+        return mean / (adRange - 1.0);
+    }
+
+    void deepSleep() {
+#if defined(__ESP32__)
+        esp_sleep_enable_timer_wakeup((uint64_t)dutyCycleSleepSec * 1000000ULL);
+        esp_deep_sleep_start();
+#elif defined(__ESP__)
+        ESP.deepSleep((uint64_t)dutyCycleSleepSec * 1000000ULL);
+#endif
+    }
+
     void publishIlluminance() {
+        // the formatted payload is cached until the value changes
+        if (!bIlluminanceMsgValid) {
+            snprintf_P(illuminanceMsg, sizeof(illuminanceMsg), PSTR("%5.3f"), ldrvalue);
+            bIlluminanceMsgValid = true;
+        }
+        bIlluminanceGetPending = false;
+        publish(PSTR("unitilluminance"), illuminanceMsg);
+    }
+
+    void publishSampleMode() {
+        char buf[16];
+        strcpy_P(buf, ldrSampleModeNames[sampleMode]);
+        if (sampleMode != SAMPLE_SINGLE) {
+            unsigned int len = strlen(buf);
+            snprintf_P(buf + len, sizeof(buf) - len, PSTR(",%u"), (unsigned int)sampleCount);
+        }
+        publish(PSTR("sampling"), buf);
+    }
+
+    void measureFlicker() {
+        // one slice per tick, 100 samples at 2 kHz: the shortest burst that holds an integer
+        // number of periods of both 100 and 120 Hz, so the two bins do not leak into each other.
+        // The slices are not phase coherent, their amplitudes are combined as RMS.
+        const unsigned int count = 100;
+        const double rate = 2000.0;
+        Goertzel g100(100.0, rate);
+        Goertzel g120(120.0, rate);
+        if (!flickerSlice) {
+            flickerSum = 0.0;
+            flickerPower100 = 0.0;
+            flickerPower120 = 0.0;
+        }
+        BurstSampler::sample([this]() { return analogRead(port) / (adRange - 1.0); }, count,
+                             (unsigned long)(1000000.0 / rate), [&](double v) {
+                                 g100.add(v);
+                                 g120.add(v);
+                                 flickerSum += v;
+                             });
+        flickerPower100 += g100.amplitude() * g100.amplitude();
+        flickerPower120 += g120.amplitude() * g120.amplitude();
+        if (++flickerSlice < LDR_FLICKER_SLICES) {
+            return;
+        }
+        flickerSlice = 0;
+        double mean = flickerSum / (count * LDR_FLICKER_SLICES);
+        double a100 = sqrt(flickerPower100 / LDR_FLICKER_SLICES);
+        double a120 = sqrt(flickerPower120 / LDR_FLICKER_SLICES);
+        double amplitude = a100 > a120 ? a100 : a120;
+        // percent flicker (max-min)/(max+min) and flicker index (area above mean / total
+        // area) of the dominant sinusoidal ripple
+        double percent = mean > 0.0 ? 100.0 * amplitude / mean : 0.0;
+        double index = mean > 0.0 ? amplitude / (M_PI * mean) : 0.0;
+        char buf[128];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"percent\":%.1f,\"index\":%.3f,\"hz\":%d,\"a100\":%.4f,\"a120\":%.4f,"
+                        "\"mean\":%5.3f}"),
+                   percent, index, a100 > a120 ? 100 : 120, a100, a120, mean);
+        publish(PSTR("flicker"), buf);
+    }
+
+    void setPipelineStage(const char *command, uint8_t stage, const String &msg) {
+        if (!pipeline.setParameter(stage, msg.c_str())) {
+            publishError(command, PSTR("invalid stage or parameter"));
+            return;
+        }
+        outlierMode = (OutlierMode)pipeline.outlier.mode;
+        saveConfig();
+        publishPipelineStage(pipeline, stage);
+    }
+
+    void publishError(const char *command, const char *reason) {
+        // reason in flash
+        char buf[SENSOR_TOPIC_SIZE + 32];
+        int len = snprintf_P(buf, sizeof(buf), PSTR("%s: "), command);
+        if (len < (int)sizeof(buf)) {
+            strncpy_P(buf + len, reason, sizeof(buf) - len);
+        }
+        buf[sizeof(buf) - 1] = 0;
+        publish(PSTR("error"), buf);
+    }
+
+    void publishOutlierMode() {
+        publish_P(PSTR("outlier"), filterOutlierModeNames[outlierMode]);
+    }
+
+    void publishTimeConstant() {
+        char buf[24];
+        snprintf_P(buf, sizeof(buf), PSTR("%.3f"), smoothing.timeConstant);
+        publish(PSTR("timeconstant"), buf);
+    }
+
+    void publishDeadband() {
         char buf[32];
-        sprintf(buf, "%5.3f", ldrvalue);
-        pSched->publish(name + "/sensor/unitilluminance", buf);
+        if (deadband < -1.5) {
+            snprintf_P(buf, sizeof(buf), PSTR("auto,%.4f"), illuminanceSensor.eps);
+            publish(PSTR("deadband"), buf);
+        } else if (deadband < 0.0) {
+            publish_P(PSTR("deadband"), PSTR("default"));
+        } else {
+            snprintf_P(buf, sizeof(buf), PSTR("%.4f"), deadband);
+            publish(PSTR("deadband"), buf);
+        }
     }
 
-    void publishFilterMode() {
-        switch (filterMode) {
-        case FilterMode::FAST:
-            pSched->publish(name + "/sensor/mode", "FAST");
-            break;
-        case FilterMode::MEDIUM:
-            pSched->publish(name + "/sensor/mode", "MEDIUM");
-            break;
-        case FilterMode::LONGTERM:
-            pSched->publish(name + "/sensor/mode", "LONGTERM");
-            break;
+    void publishNoise() {
+        char buf[80];
+        snprintf_P(buf, sizeof(buf), PSTR("{\"sigma\":%.6f,\"valid\":%s,\"deadband\":%.6f}"),
+                   noise.sigma(), noise.valid() ? "true" : "false", illuminanceSensor.eps);
+        publish(PSTR("noise"), buf);
+    }
+
+    void publishCalibration() {
+        char buf[48];
+        snprintf_P(buf, sizeof(buf), PSTR("%.4f,%.4f"), pipeline.calibrate.gain,
+                   pipeline.calibrate.offset);
+        publish(PSTR("calibration"), buf);
+    }
+
+    void publishThresholds() {
+        if (thresholdHigh <= thresholdLow) {
+            publish_P(PSTR("threshold"), PSTR("off"));
+            return;
+        }
+        char buf[48];
+        snprintf_P(buf, sizeof(buf), PSTR("%5.3f,%5.3f"), thresholdLow, thresholdHigh);
+        publish(PSTR("threshold"), buf);
+    }
+
+    void checkThresholds(double val) {
+        if (thresholdHigh <= thresholdLow) {
+            return;
+        }
+        int state = thresholdState;
+        if (val > thresholdHigh) {
+            state = 1;
+        } else if (val < thresholdLow) {
+            state = 0;
+        }
+        if (state != thresholdState && state >= 0) {
+            thresholdState = state;
+            publish_P(PSTR("threshold/state"), state ? PSTR("high") : PSTR("low"));
+        }
+    }
+
+    void publishStatisticsWindow() {
+        char buf[24];
+        snprintf_P(buf, sizeof(buf), PSTR("%lu"), statisticsWindowMs / 1000UL);
+        publish(PSTR("statistics/window"), buf);
+    }
+
+    void publishStatistics() {
+        char buf[160];
+        statistics.toJson(buf, sizeof(buf));
+        publish(PSTR("unitilluminance/statistics"), buf);
+    }
+
+#if LDR_HISTORY_SIZE > 0
+    void startHistoryQuery(String range) {
+        int sep = range.indexOf(',');
+        historyFrom = 0;
+        historyTo = 0xffffffff;
+        if (sep >= 0) {
+            historyFrom = range.substring(0, sep).toInt();
+            String to = range.substring(sep + 1);
+            to.trim();
+            if (to.length()) {
+                historyTo = to.toInt();
+            }
+        } else if (range.length()) {
+            historyFrom = range.toInt();
+        }
+        historySkip = 0;
+        historySeq = 0;
+        bHistoryQuery = true;
+    }
+
+    void publishHistoryChunk() {
+        // the query position is tracked by timestamp (and the number of samples already sent
+        // with that timestamp), so the ring buffer may be overwritten between two chunks
+        char buf[48 + LDR_HISTORY_CHUNK * 24];
+        unsigned int i = history.lowerBound(historyFrom) + historySkip;
+        unsigned int n = 0;
+        int len = snprintf_P(buf, sizeof(buf), PSTR("{\"seq\":%u,\"samples\":["), historySeq);
+        while (i < history.length() && history[i].time <= historyTo && n < LDR_HISTORY_CHUNK) {
+            len += snprintf_P(buf + len, sizeof(buf) - len, PSTR("%s[%lu,%5.3f]"), n ? "," : "",
+                              (unsigned long)history[i].time, history[i].value);
+            if (history[i].time == historyFrom) {
+                ++historySkip;
+            } else {
+                historyFrom = history[i].time;
+                historySkip = 1;
+            }
+            ++i;
+            ++n;
+        }
+        bHistoryQuery = i < history.length() && history[i].time <= historyTo;
+        snprintf_P(buf + len, sizeof(buf) - len, PSTR("],\"last\":%s}"),
+                   bHistoryQuery ? "false" : "true");
+        ++historySeq;
+        publish(PSTR("history"), buf);
+    }
+#endif
+
+#if LDR_ROLLUPS
+    void startRollupQuery(const char *tier, const String &count) {
+        unsigned int available;
+        if (!strcmp_P(tier, ldrRollupTierNames[0])) {
+            rollupQueryTier = 0;
+            available = rollups.seconds.length();
+        } else if (!strcmp_P(tier, ldrRollupTierNames[1])) {
+            rollupQueryTier = 1;
+            available = rollups.minutes.length();
+        } else if (!strcmp_P(tier, ldrRollupTierNames[2])) {
+            rollupQueryTier = 2;
+            available = rollups.hours.length();
+        } else {
+            return;
+        }
+        long n = count.toInt();
+        unsigned int first = (n > 0 && (unsigned long)n < available) ? available - n : 0;
+        rollupQueryFrom = available ? rollupBucket(first).start : 0;
+        rollupQuerySeq = 0;
+    }
+
+    unsigned int rollupLength() const {
+        switch (rollupQueryTier) {
+        case 0:
+            return rollups.seconds.length();
+        case 1:
+            return rollups.minutes.length();
+        default:
+            return rollups.hours.length();
         }
     }
 
+    const RollupBucket &rollupBucket(unsigned int i) const {
+        switch (rollupQueryTier) {
+        case 0:
+            return rollups.seconds[i];
+        case 1:
+            return rollups.minutes[i];
+        default:
+            return rollups.hours[i];
+        }
+    }
+
+    void publishRollupChunk() {
+        char buf[48 + LDR_HISTORY_CHUNK * 48];
+        unsigned int len = rollupLength();
+        unsigned int i = 0;
+        unsigned int n = 0;
+        // buckets are tracked by start time, as the tier may advance between two chunks
+        while (i < len && rollupBucket(i).start < rollupQueryFrom) {
+            ++i;
+        }
+        int pos = snprintf_P(buf, sizeof(buf), PSTR("{\"seq\":%u,\"buckets\":["), rollupQuerySeq);
+        while (i < len && n < LDR_HISTORY_CHUNK) {
+            const RollupBucket &b = rollupBucket(i);
+            pos += snprintf_P(buf + pos, sizeof(buf) - pos, PSTR("%s[%lu,%lu,%5.3f,%5.3f,%5.3f]"),
+                              n ? "," : "", (unsigned long)b.start, (unsigned long)b.count,
+                              b.minVal, b.maxVal, b.meanVal);
+            rollupQueryFrom = b.start + 1;
+            ++i;
+            ++n;
+        }
+        bool more = i < len;
+        snprintf_P(buf + pos, sizeof(buf) - pos, PSTR("],\"last\":%s}"), more ? "false" : "true");
+        ++rollupQuerySeq;
+        char topic[16];
+        strncpy_P(topic, PSTR("rollup/"), sizeof(topic));
+        strncpy_P(topic + 7, ldrRollupTierNames[rollupQueryTier], sizeof(topic) - 7);
+        publishTopic(topic, buf);
+        if (!more) {
+            rollupQueryTier = -1;
+        }
+    }
+#endif
+
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+    void startSampleLogQuery() {
+        if (!bSampleLog) {
+            return;
+        }
+        sampleLog.sync();
+        sampleLog.rewind(&sampleLogCursor);
+        sampleLogSeq = 0;
+        bSampleLogQuery = true;
+    }
+
+    void publishSampleLogChunk() {
+        char buf[48 + LDR_HISTORY_CHUNK * 48];
+        uint8_t record[255];
+        uint8_t len;
+        unsigned int n = 0;
+        bool more = true;
+        int pos = snprintf_P(buf, sizeof(buf), PSTR("{\"seq\":%u,\"buckets\":["), sampleLogSeq);
+        while (n < LDR_HISTORY_CHUNK && (more = sampleLog.read(&sampleLogCursor, record, &len))) {
+            if (len != sizeof(RollupBucket)) {
+                continue;
+            }
+            RollupBucket b;
+            memcpy(&b, record, sizeof(b));
+            pos += snprintf_P(buf + pos, sizeof(buf) - pos, PSTR("%s[%lu,%lu,%5.3f,%5.3f,%5.3f]"),
+                              n ? "," : "", (unsigned long)b.start, (unsigned long)b.count,
+                              b.minVal, b.maxVal, b.meanVal);
+            ++n;
+        }
+        bSampleLogQuery = more;
+        snprintf_P(buf + pos, sizeof(buf) - pos, PSTR("],\"last\":%s}"), more ? "false" : "true");
+        ++sampleLogSeq;
+        publish(PSTR("log"), buf);
+    }
+
+    void publishSampleLogStats() {
+        char buf[160];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"records\":%lu,\"payload\":%lu,\"written\":%lu,\"writes\":%lu,"
+                        "\"torn\":%lu,\"wa\":%4.2f}"),
+                   sampleLog.stats.records, sampleLog.stats.payloadBytes,
+                   sampleLog.stats.bytesWritten, sampleLog.stats.blockWrites,
+                   sampleLog.stats.tornBytes, sampleLog.writeAmplification());
+        publish(PSTR("log/stats"), buf);
+    }
+#endif
+
+#if LDR_ARCHIVE_BLOCK_SIZE > 0
+    void addToArchive(double val) {
+        // quantize to the A/D resolution as binary fraction: unchanged values cost one bit
+        // and changed values only a few significant mantissa bits
+        archive.add(time(nullptr), (float)(round(val * adRange) / adRange));
+    }
+
+    void startArchiveExport() {
+        bArchiveExport = archive.used > 0;
+        archiveExportBlock = 0;
+        archiveExportGeneration = archive.generation;
+        archiveExportSeq = 0;
+        if (bArchiveExport) {
+            archiveDecoder.begin(archive.blocks[archive.first], archive.counts[archive.first]);
+        } else {
+            char buf[40];
+            strncpy_P(buf, PSTR("{\"seq\":0,\"samples\":[],\"last\":true}"), sizeof(buf));
+            publish(PSTR("history/export"), buf);
+        }
+    }
+
+    void publishArchiveChunk() {
+        char buf[64 + LDR_HISTORY_CHUNK * 24];
+        bool truncated = archive.generation != archiveExportGeneration;
+        unsigned int n = 0;
+        int len = snprintf_P(buf, sizeof(buf), PSTR("{\"seq\":%u,\"samples\":["), archiveExportSeq);
+        while (!truncated && n < LDR_HISTORY_CHUNK) {
+            uint32_t t;
+            float v;
+            if (!archiveDecoder.next(&t, &v)) {
+                if (++archiveExportBlock >= archive.used) {
+                    break;
+                }
+                unsigned int block = (archive.first + archiveExportBlock) % LDR_ARCHIVE_BLOCKS;
+                archiveDecoder.begin(archive.blocks[block], archive.counts[block]);
+                continue;
+            }
+            len += snprintf_P(buf + len, sizeof(buf) - len, PSTR("%s[%lu,%5.3f]"), n ? "," : "",
+                              (unsigned long)t, v);
+            ++n;
+        }
+        bArchiveExport = !truncated && archiveExportBlock < archive.used;
+        snprintf_P(buf + len, sizeof(buf) - len,
+                   truncated ? PSTR("],\"last\":%s,\"truncated\":true}") : PSTR("],\"last\":%s}"),
+                   bArchiveExport ? "false" : "true");
+        ++archiveExportSeq;
+        publish(PSTR("history/export"), buf);
+    }
+#endif
+
     void loop() {
+        if (bActive && bDutyCycle) {
+            // duty-cycle mode: publish the value of this wake once connected, then sleep
+            if (bIlluminanceGetPending && bDutyCycleConnected) {
+                publishIlluminance();
+                if (!bDutyCyclePublished) {
+                    RtcStore::save(dutyCycleOffset, &dutyCycleState, sizeof(dutyCycleState));
+                    bDutyCyclePublished = true;
+                    dutyCyclePublishTime = millis();
+                }
+            }
+            if (bDutyCyclePublished ? millis() - dutyCyclePublishTime >= LDR_DUTY_CYCLE_LINGER_MS
+                                    : millis() - dutyCycleStart >= dutyCycleAwakeMs) {
+                deepSleep();
+            }
+            return;
+        }
         if (bActive) {
-            double val = analogRead(port) / (adRange - 1.0);
-            if (illuminanceSensor.filter(&val)) {
+            double val = readUnitIlluminance();
+            if (pipeline.process(val, millis())) {
+                processSample(val);
+            }
+            if (rtcOffset >= 0) {
+                saveWarmState();
+            }
+            if (bIlluminanceGetPending) {
+                // answer all get requests received since the last tick with one message
+                publishIlluminance();
+            }
+            if (bFlickerPending || flickerSlice) {
+                bFlickerPending = false;
+                measureFlicker();
+            }
+#if LDR_HISTORY_SIZE > 0
+            if (bHistoryQuery) {
+                publishHistoryChunk();
+            }
+#endif
+#if LDR_ROLLUPS
+            if (rollupQueryTier >= 0) {
+                publishRollupChunk();
+            }
+#endif
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+            if (bSampleLogQuery) {
+                publishSampleLogChunk();
+            }
+#endif
+#if LDR_ARCHIVE_BLOCK_SIZE > 0
+            if (bArchiveExport) {
+                publishArchiveChunk();
+            }
+#endif
+        }
+    }
+
+    void updateAutoDeadband() {
+        if (deadband > -1.5 || !noise.valid()) {
+            return;
+        }
+        // the filter mode smoothing is an exponential average that reduces the noise variance
+        // by the factor (2 - alpha) / alpha
+        double n;
+        if (smoothing.timeConstant > 0.0 && taskIntervalUs) {
+            n = 2.0 * smoothing.timeConstant / (taskIntervalUs / 1000000.0) + 1.0;
+        } else {
+            n = 2.0 * illuminanceSensor.smoothInterval + 1.0;
+        }
+        double eps = LDR_AUTO_DEADBAND_SIGMAS * noise.sigma() / sqrt(n);
+        // at least half an A/D step, at most 5% of the range
+        double minEps = 0.5 / (adRange - 1);
+        illuminanceSensor.eps = eps < minEps ? minEps : (eps > 0.05 ? 0.05 : eps);
+    }
+
+    void processSample(double val) {
+#if LDR_ROLLUPS
+        int completed = rollups.add(time(nullptr), val);
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+        if (bSampleLog && (completed & Rollups<>::MINUTE)) {
+            const RollupBucket &b = rollups.minutes[rollups.minutes.length() - 1];
+            sampleLog.append(&b, sizeof(b));
+        }
+#else
+        (void)completed;
+#endif
+#endif
+        if (statisticsWindowMs) {
+            statistics.add(val);
+            if (millis() - statisticsWindowStart >= statisticsWindowMs) {
+                publishStatistics();
+                statistics.reset();
+                statisticsWindowStart += statisticsWindowMs;
+            }
+        }
+        if (smoothing.timeConstant > 0.0) {
+            smoothing.process(val, millis());
+        }
+        noise.add(val);
+        updateAutoDeadband();
+        if (illuminanceSensor.filter(&val)) {
+            if (val != ldrvalue) {
                 ldrvalue = val;
+                bIlluminanceMsgValid = false;
+            }
+#if LDR_HISTORY_SIZE > 0
+            history.add(time(nullptr), val);
+#endif
+            checkThresholds(val);
+#if LDR_ARCHIVE_BLOCK_SIZE > 0
+            addToArchive(val);
+#endif
+            if (!statisticsWindowMs) {
                 publishIlluminance();
             }
         }
     }
 
-    void subsMsg(String topic, String msg, String originator) {
-        if (topic == name + "/sensor/unitilluminance/get") {
-            publishIlluminance();
+    void onCommand(const char *command, const String &msg) {
+        if (!strcmp_P(command, PSTR("unitilluminance/get"))) {
+            bIlluminanceGetPending = true;
         }
-        if (topic == name + "/sensor/mode/get") {
-            publishIlluminance();
+        if (!strcmp_P(command, PSTR("sampling/get"))) {
+            publishSampleMode();
         }
-        if (topic == name + "/sensor/mode/set") {
-            if (msg == "fast" || msg == "FAST") {
-                setFilterMode(FilterMode::FAST);
+        if (!strcmp_P(command, PSTR("sampling/set"))) {
+            int sep = msg.indexOf(',');
+            String mode = sep >= 0 ? msg.substring(0, sep) : msg;
+            long count = sep >= 0 ? msg.substring(sep + 1).toInt() : 8;
+            if (!strcasecmp_P(mode.c_str(), ldrSampleModeNames[SAMPLE_MAINS_50HZ])) {
+                setSampleMode(SAMPLE_MAINS_50HZ, count);
+            } else if (!strcasecmp_P(mode.c_str(), ldrSampleModeNames[SAMPLE_MAINS_60HZ])) {
+                setSampleMode(SAMPLE_MAINS_60HZ, count);
             } else {
-                if (msg == "medium" || msg == "MEDIUM") {
-                    setFilterMode(FilterMode::MEDIUM);
-                } else {
-                    setFilterMode(FilterMode::LONGTERM);
-                }
+                setSampleMode(SAMPLE_SINGLE, count);
+            }
+        }
+        if (!strcmp_P(command, PSTR("flicker/get"))) {
+            bFlickerPending = true;
+        }
+        if (!strcmp_P(command, PSTR("pipeline/get"))) {
+            publishPipeline(pipeline);
+        }
+        if (!strcmp_P(command, PSTR("pipeline/set"))) {
+            setPipeline(msg.c_str());
+        }
+        if (!strncmp_P(command, PSTR("pipeline/"), 9)) {
+            char stage[16];
+            if (splitAction(command + 9, PSTR("/get"), stage, sizeof(stage))) {
+                publishPipelineStage(pipeline, pipeline.find(stage));
+            } else if (splitAction(command + 9, PSTR("/set"), stage, sizeof(stage))) {
+                setPipelineStage(command, pipeline.find(stage), msg);
+            }
+        }
+        if (!strcmp_P(command, PSTR("outlier/get"))) {
+            publishOutlierMode();
+        }
+        if (!strcmp_P(command, PSTR("outlier/set"))) {
+            if (!pipeline.contains(pipeline.OUTLIER)) {
+                publishError(command, PSTR("no outlier stage in the pipeline"));
+            } else if (!strcasecmp_P(msg.c_str(), filterOutlierModeNames[OUTLIER_MEDIAN])) {
+                setOutlierMode(OUTLIER_MEDIAN);
+            } else if (!strcasecmp_P(msg.c_str(), filterOutlierModeNames[OUTLIER_HAMPEL])) {
+                setOutlierMode(OUTLIER_HAMPEL);
+            } else {
+                setOutlierMode(OUTLIER_OFF);
+            }
+        }
+        if (!strcmp_P(command, PSTR("timeconstant/get"))) {
+            publishTimeConstant();
+        }
+        if (!strcmp_P(command, PSTR("timeconstant/set"))) {
+            setTimeConstant(msg.toFloat());
+        }
+        if (!strcmp_P(command, PSTR("deadband/get"))) {
+            publishDeadband();
+        }
+        if (!strcmp_P(command, PSTR("deadband/set"))) {
+            if (!strcmp_P(msg.c_str(), PSTR("auto"))) {
+                setDeadband(-2.0);
+            } else {
+                setDeadband(!strcmp_P(msg.c_str(), PSTR("default")) ? -1.0 : msg.toFloat());
+            }
+        }
+        if (!strcmp_P(command, PSTR("noise/get"))) {
+            publishNoise();
+        }
+        if (!strcmp_P(command, PSTR("calibration/get"))) {
+            publishCalibration();
+        }
+        if (!strcmp_P(command, PSTR("calibration/set"))) {
+            int sep = msg.indexOf(',');
+            if (!pipeline.contains(pipeline.CALIBRATE)) {
+                publishError(command, PSTR("no calibrate stage in the pipeline"));
+            } else if (sep > 0) {
+                setCalibration(msg.substring(0, sep).toFloat(), msg.substring(sep + 1).toFloat());
+            }
+        }
+        if (!strcmp_P(command, PSTR("threshold/get"))) {
+            publishThresholds();
+        }
+        if (!strcmp_P(command, PSTR("threshold/set"))) {
+            int sep = msg.indexOf(',');
+            if (sep > 0) {
+                setThresholds(msg.substring(0, sep).toFloat(), msg.substring(sep + 1).toFloat());
+            } else {
+                setThresholds(0.0, 0.0);
+            }
+        }
+        if (!strcmp_P(command, PSTR("statistics/window/get"))) {
+            publishStatisticsWindow();
+        }
+        if (!strcmp_P(command, PSTR("statistics/window/set"))) {
+            long seconds = msg.toInt();
+            setStatisticsWindow(seconds > 0 ? seconds : 0);
+        }
+#if LDR_HISTORY_SIZE > 0
+        if (!strcmp_P(command, PSTR("history/get"))) {
+            startHistoryQuery(msg);
+        }
+#endif
+#if LDR_ROLLUPS
+        if (!strncmp_P(command, PSTR("rollup/"), 7)) {
+            char tier[8];
+            if (splitAction(command + 7, PSTR("/get"), tier, sizeof(tier))) {
+                startRollupQuery(tier, msg);
             }
         }
+#endif
+#if LDR_SAMPLE_LOG_BLOCK_SIZE > 0
+        if (!strcmp_P(command, PSTR("log/get"))) {
+            startSampleLogQuery();
+        }
+        if (!strcmp_P(command, PSTR("log/stats/get"))) {
+            publishSampleLogStats();
+        }
+#endif
+#if LDR_ARCHIVE_BLOCK_SIZE > 0
+        if (!strcmp_P(command, PSTR("history/export/get"))) {
+            startArchiveExport();
+        }
+#endif
     };
 };  // IlluminanceLdr
 
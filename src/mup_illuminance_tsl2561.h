@@ -0,0 +1,875 @@
+// mup_illuminance_tsl2561.h - muwerk TSL2561 illuminance sensor mupplet
+#pragma once
+
+#include "scheduler.h"
+#include "sensors.h"
+#include "helper/i2c_bus.h"
+#include "helper/i2c_bus_manager.h"
+#include "helper/filter_pipeline.h"
+#include "helper/sensor_mupplet.h"
+
+#ifndef TSL2561_MARGIN_MS
+#define TSL2561_MARGIN_MS 2  //!< Added to the integration time before the channels are read
+#endif
+#ifndef TSL2561_MAX_RETRIES
+#define TSL2561_MAX_RETRIES 3  //!< Failed transfers in a row until the sensor is considered offline
+#endif
+#ifndef TSL2561_BACKOFF_MAX_SEC
+#define TSL2561_BACKOFF_MAX_SEC 60  //!< Maximum time between attempts to reach an offline sensor
+#endif
+#ifndef TSL2561_INT_PERSISTENCE
+#define TSL2561_INT_PERSISTENCE 2  //!< Interrupt mode: integration periods out of threshold
+#endif
+#ifndef TSL2561_INT_BAND
+#define TSL2561_INT_BAND 0.05  //!< Interrupt mode: relative threshold band around the value
+#endif
+#ifndef TSL2561_RANGE_DOWN
+#define TSL2561_RANGE_DOWN 0.9  //!< Auto-ranging: fraction of full scale to leave the range
+#endif
+#ifndef TSL2561_RANGE_UP
+#define TSL2561_RANGE_UP 0.4  //!< Auto-ranging: maximum predicted fraction of full scale to enter
+#endif
+#ifndef TSL2561_OUTLIER_WINDOW
+#define TSL2561_OUTLIER_WINDOW 7  //!< Window size of the outlier stage of the pipeline
+#endif
+
+#define TSL2561_MAX_INTERRUPTS 4  // number of sensors in interrupt mode
+
+#if defined(__ESP__)
+#define TSL2561_ISR_ATTR IRAM_ATTR
+#else
+#define TSL2561_ISR_ATTR
+#endif
+
+namespace ustd {
+
+static const char TSL2561_VERSION[] PROGMEM = "0.1.0";
+// sensorprocessor parameters of FAST, MEDIUM and LONGTERM
+static const SensorFilterParameters tsl2561FilterParameters[] PROGMEM = {
+    {1, 15, 0.1}, {4, 300, 0.5}, {50, 600, 1.0}};
+
+// INT line events, counted by the interrupt service routines
+static volatile unsigned long tsl2561IrqCount[TSL2561_MAX_INTERRUPTS];
+static uint8_t tsl2561IrqSlots = 0;
+
+#if !defined(__UNIXOID__)
+static void TSL2561_ISR_ATTR tsl2561Irq0() {
+    ++tsl2561IrqCount[0];
+}
+static void TSL2561_ISR_ATTR tsl2561Irq1() {
+    ++tsl2561IrqCount[1];
+}
+static void TSL2561_ISR_ATTR tsl2561Irq2() {
+    ++tsl2561IrqCount[2];
+}
+static void TSL2561_ISR_ATTR tsl2561Irq3() {
+    ++tsl2561IrqCount[3];
+}
+static void (*const tsl2561IrqTable[TSL2561_MAX_INTERRUPTS])() = {tsl2561Irq0, tsl2561Irq1,
+                                                                  tsl2561Irq2, tsl2561Irq3};
+#endif
+
+// clang - format off
+/*! \brief mupplet-sensor TSL2561 illuminance sensor
+
+The illuminance_tsl2561 mupplet measures illuminance with a TAOS/AMS TSL2561 light-to-digital
+converter via I2C. The lux value is computed from the broadband and the infrared channel with
+the approximation of the datasheet for the package of the sensor (T/FN/CL or CS, detected by
+the ID register).
+
+The sensor is driven by a non-blocking state machine: at each sample the mupplet powers the
+sensor up, which starts an integration, and returns to the scheduler. The channels are
+collected by a later tick as soon as the integration time (13.7, 101 or 402 ms) has elapsed,
+then the sensor is powered down again. If the sample interval is not longer than the
+integration time, the sensor stays powered up and the channels are read after every
+integration period. No tick blocks for more than a few short I2C transfers, in contrast to
+drivers that `delay()` for the duration of the integration.
+
+By default, gain (1x or 16x) and integration time are selected automatically: after each
+sample the mupplet predicts the counts every range would have produced for the same light and
+selects the most sensitive range that stays below `TSL2561_RANGE_UP` of its full scale. The
+current range is kept until it exceeds `TSL2561_RANGE_DOWN` of its full scale, so the range
+does not toggle at a boundary. The decision needs no additional test conversions; only a
+saturated sample is repeated immediately in the least sensitive range. Only integration times
+that fit into the sample interval are used. Setting the gain or the integration time
+explicitly switches auto-ranging off.
+
+#### Interrupt mode
+
+With `setInterruptMode()` the mupplet does not poll the sensor. It stays powered up, and
+after each sample the threshold registers are programmed to a band of `TSL2561_INT_BAND`
+(at least the `eps` of the filter mode) around the last published value, with a persistence
+of `TSL2561_INT_PERSISTENCE` integration periods. The sensor is only read when its INT line
+signals that the light left the band, so constant light causes no I2C traffic at all. With
+auto-ranging, the band is narrowed so that the interrupt also fires when another range
+becomes due. Since unchanged values are not read, they are not republished periodically
+either.
+
+```cpp
+tsl.setInterruptMode(D5);  // INT of the sensor connected to D5
+tsl.begin(&sched);
+```
+
+The sensor can be connected via an own I2CBus (`TwoWire` instance) or via a shared
+I2CBusManager.
+
+#### Messages sent by illuminance_tsl2561 mupplet:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<mupplet-name>/sensor/illuminance` | illuminance [lux] | Float value encoded as string, sent on change according to the filter mode
+| `<mupplet-name>/sensor/channels` | JSON object | Raw counts of the last sample: `ch0` (broadband), `ch1` (infrared), `saturated`, `gain`, `integration`
+| `<mupplet-name>/sensor/range` | JSON object | Range of the sample, sent with every illuminance value: `gain`, `integration` [ms], `auto`
+| `<mupplet-name>/sensor/mode` | `FAST`, `MEDIUM`, or `LONGTERM` | Integration time for illuminance values
+| `<mupplet-name>/sensor/gain` | `1` or `16` | Gain of the sensor
+| `<mupplet-name>/sensor/integration` | `13`, `101` or `402` | Integration time of the sensor [ms]
+| `<mupplet-name>/sensor/status` | `OK` or `OFFLINE` | Sent on change, `OFFLINE` if the sensor does not answer
+| `<mupplet-name>/sensor/pipeline` | list of stages | Processing stages applied to lux values of samples
+| `<mupplet-name>/sensor/pipeline/<stage>` | parameter | Parameter of a pipeline stage, see `DynamicPipeline`
+
+#### Messages received by illuminance_tsl2561 mupplet:
+
+| topic | message body | comment
+| ----- | ------------ | -------
+| `<mupplet-name>/sensor/illuminance/get` | - | Returns the illuminance
+| `<mupplet-name>/sensor/channels/get` | - | Returns the raw counts of the last sample
+| `<mupplet-name>/sensor/mode/get` | - | Returns filterMode: `FAST`, `MEDIUM`, or `LONGTERM`
+| `<mupplet-name>/sensor/mode/set` | `FAST`, `MEDIUM`, or `LONGTERM` | Set integration time for illuminance values
+| `<mupplet-name>/sensor/range/get` | - | Returns the range
+| `<mupplet-name>/sensor/range/set` | `auto` or `manual` | Switches auto-ranging on, or off keeping the current range
+| `<mupplet-name>/sensor/gain/get` | - | Returns the gain
+| `<mupplet-name>/sensor/gain/set` | `1` or `16` | Sets the gain, switches auto-ranging off
+| `<mupplet-name>/sensor/integration/get` | - | Returns the integration time
+| `<mupplet-name>/sensor/integration/set` | `13`, `101` or `402` | Sets the integration time [ms], switches auto-ranging off
+| `<mupplet-name>/sensor/status/get` | - | Returns the status
+| `<mupplet-name>/sensor/pipeline/get` | - | Returns the list of processing stages
+| `<mupplet-name>/sensor/pipeline/set` | list of stages | Sets the processing stages applied to the lux value of every sample before the filter mode smoothing, any sequence of `oversample`, `calibrate`, `outlier`, `ema` and `deadband`. Default: none
+| `<mupplet-name>/sensor/pipeline/<stage>/get` | - | Returns the parameter of a pipeline stage
+| `<mupplet-name>/sensor/pipeline/<stage>/set` | parameter | Sets the parameter of a pipeline stage, see `DynamicPipeline`
+
+Sample code:
+```cpp
+#include "scheduler.h"
+#include "mup_illuminance_tsl2561.h"
+
+ustd::Scheduler sched(10, 16, 32);
+ustd::IlluminanceTSL2561 tsl("tsl", 0x39);
+
+void setup() {
+    Wire.begin();
+    tsl.begin(&sched);
+}
+```
+
+On hosts (`__UNIXOID__`), the mupplet is connected to an I2CBus with an attached
+Tsl2561Simulator (see `helper/tsl2561_simulator.h`).
+*/
+// clang-format on
+class IlluminanceTSL2561 : public SensorMupplet<IlluminanceTSL2561> {
+    friend class SensorMupplet<IlluminanceTSL2561>;
+
+  public:
+    enum Gain { GAIN_1X = 0x00, GAIN_16X = 0x10 };
+    enum IntegrationTime { INTEG_13MS = 0x00, INTEG_101MS = 0x01, INTEG_402MS = 0x02 };
+    // I2C operations
+    enum Op : uint8_t {
+        OP_ID,
+        OP_TIMING,
+        OP_POWER_ON,
+        OP_READ_CH0,
+        OP_READ_CH1,
+        OP_POWER_OFF,
+        OP_THRESHOLD_LOW,
+        OP_THRESHOLD_HIGH,
+        OP_INTERRUPT
+    };
+    // sampling phase
+    enum Phase {
+        PH_IDLE,
+        PH_STARTING,
+        PH_INTEGRATING,
+        PH_READING,
+        PH_ARMING,
+        PH_WAIT_INT,
+        PH_BACKOFF
+    };
+
+  private:
+    uint8_t address;
+    I2CBus *pBus = nullptr;
+    I2CBusManager *pManager = nullptr;
+#if !defined(__UNIXOID__)
+    I2CBus ownBus;
+#endif
+    bool bInitialized = false;
+    bool bPowered = false;
+    bool bTimingValid = false;
+    bool bAutoRange = true;
+    bool bCsPackage = false;
+    bool bOffline = false;
+    bool bPending = false;  // transaction queued at the bus manager
+    Phase phase = PH_IDLE;
+    uint8_t ops[4];
+    uint8_t opsLen = 0;
+    uint8_t opsPos = 0;
+    uint8_t retries = 0;
+    unsigned long phaseStart = 0;
+    unsigned long lastSample = 0;
+    unsigned long backoffMs = 0;
+    unsigned long sampleIntervalMs;
+    Gain gain = GAIN_1X;
+    IntegrationTime integrationTime = INTEG_402MS;
+    uint8_t timing = 0;         // timing register of the sensor, range of the last sample
+    uint8_t timingWritten = 0;  // timing register value in transfer
+    int8_t irqSlot = -1;  // interrupt mode, if not negative
+    uint8_t persistence = TSL2561_INT_PERSISTENCE;
+    unsigned long irqSeen = 0;
+    uint16_t thresholdLow = 0;
+    uint16_t thresholdHigh = 0;
+    double sampleLux = 0.0;  // unfiltered illuminance of the last sample
+    uint16_t ch0 = 0;
+    uint16_t ch1 = 0;
+    bool bSaturated = false;
+    double lux = 0.0;
+
+  public:
+    ustd::sensorprocessor illuminanceSensor = ustd::sensorprocessor(4, 600, 0.5);
+    DynamicPipeline<TSL2561_OUTLIER_WINDOW> pipeline;  //!< Stages applied to lux values of samples
+    unsigned long errors = 0;  //!< Number of failed transfers
+
+    IlluminanceTSL2561(String name, uint8_t address = 0x39, unsigned long sampleIntervalMs = 1000,
+                       FilterMode filterMode = FilterMode::MEDIUM)
+        : SensorMupplet(name), address(address), sampleIntervalMs(sampleIntervalMs) {
+        /*! Instantiate a TSL2561 sensor mupplet
+        @param name Name used for pub/sub messages
+        @param address I2C address of the sensor: 0x29 (ADDR to GND), 0x39 (ADDR floating) or
+        0x49 (ADDR to VDD)
+        @param sampleIntervalMs Interval between samples [ms]. If it is not longer than the
+        integration time, the sensor integrates continuously
+        @param filterMode FAST, MEDIUM or LONGTERM filtering of sensor values
+        */
+        setFilter(&illuminanceSensor, tsl2561FilterParameters);
+        setFilterMode(filterMode, true);
+    }
+
+    ~IlluminanceTSL2561() {
+    }
+
+#if !defined(__UNIXOID__)
+    void begin(Scheduler *_pSched, TwoWire *pWire = &Wire) {
+        /*! Start measuring illuminance
+        @param _pSched Pointer to the muwerk scheduler
+        @param pWire TwoWire instance the sensor is connected to, must already be initialized
+        */
+        ownBus.begin(pWire);
+        begin(_pSched, &ownBus);
+    }
+#endif
+
+    void begin(Scheduler *_pSched, I2CBusManager *_pManager) {
+        /*! Start measuring illuminance via a shared I2C bus manager
+        @param _pSched Pointer to the muwerk scheduler
+        @param _pManager I2C bus manager of the bus the sensor is connected to
+        */
+        pManager = _pManager;
+        begin(_pSched, &pManager->bus);
+    }
+
+    void begin(Scheduler *_pSched, I2CBus *_pBus) {
+        /*! Start measuring illuminance
+        @param _pSched Pointer to the muwerk scheduler
+        @param _pBus I2C bus the sensor is connected to
+        */
+        pBus = _pBus;
+        lastSample = millis() - sampleIntervalMs;
+        startTask(_pSched, 10000);  // 10ms
+    }
+
+    void setGain(Gain value, bool silent = false) {
+        /*! Set the gain of the sensor
+        @param value GAIN_1X or GAIN_16X
+        @param silent If true, the new gain is not published
+        */
+        gain = value;
+        bAutoRange = false;
+        if (!silent)
+            publishGain();
+    }
+
+    void setIntegrationTime(IntegrationTime value, bool silent = false) {
+        /*! Set the integration time of the sensor
+        @param value INTEG_13MS, INTEG_101MS or INTEG_402MS
+        @param silent If true, the new integration time is not published
+        */
+        integrationTime = value;
+        bAutoRange = false;
+        if (!silent)
+            publishIntegrationTime();
+    }
+
+    void setAutoRange(bool enable, bool silent = false) {
+        /*! Enable or disable automatic selection of gain and integration time
+        @param enable If false, the current gain and integration time are kept
+        @param silent If true, the new range is not published
+        */
+        bAutoRange = enable;
+        if (!silent)
+            publishRange();
+    }
+
+    bool setInterruptMode(uint8_t pin, uint8_t persistence = TSL2561_INT_PERSISTENCE) {
+        /*! Read the sensor only if its INT line signals a change of the light
+
+        Call before begin(). On hosts no interrupt is attached, call interrupt() instead.
+        @param pin GPIO the INT line of the sensor is connected to (active low, open drain)
+        @param persistence Number of integration periods (1..15) the light must be out of
+        the threshold band before the interrupt is asserted
+        @return false if too many sensors use interrupt mode
+        */
+        if (irqSlot < 0) {
+            if (tsl2561IrqSlots >= TSL2561_MAX_INTERRUPTS) {
+                return false;
+            }
+            irqSlot = tsl2561IrqSlots++;
+#if !defined(__UNIXOID__)
+            pinMode(pin, INPUT_PULLUP);
+            attachInterrupt(digitalPinToInterrupt(pin), tsl2561IrqTable[irqSlot], FALLING);
+#else
+            (void)pin;  // hosts: the test calls interrupt()
+#endif
+        }
+        this->persistence = persistence < 1 ? 1 : (persistence > 15 ? 15 : persistence);
+        return true;
+    }
+
+    void interrupt() {
+        /*! Signal that the INT line of the sensor has been asserted
+
+        Done by the interrupt service routine on Arduino, for hosts with a simulated sensor.
+        */
+        if (irqSlot >= 0) {
+            ++tsl2561IrqCount[irqSlot];
+        }
+    }
+
+    double getIlluminance() {
+        /*! @return Filtered illuminance [lux] */
+        return lux;
+    }
+
+    static unsigned long integrationMs(IntegrationTime value) {
+        /*! @return Duration of an integration [ms], rounded up */
+        static const unsigned long ms[] = {14, 101, 402};
+        return ms[value];
+    }
+
+    static double calculateLux(uint16_t ch0, uint16_t ch1, Gain gain,
+                               IntegrationTime integrationTime, bool csPackage) {
+        /*! Calculate the illuminance from the channel counts
+        @param ch0 Broadband channel count
+        @param ch1 Infrared channel count
+        @param gain Gain the counts were measured with
+        @param integrationTime Integration time the counts were measured with
+        @param csPackage true for the CS package, false for T/FN/CL
+        @return Illuminance [lux] according to the approximation of the datasheet
+        */
+        // normalize to 402 ms and 16x gain
+        double s = sensitivity(gain | integrationTime);
+        double c0 = ch0 / s;
+        double c1 = ch1 / s;
+        if (c0 <= 0.0) {
+            return 0.0;
+        }
+        double r = c1 / c0;
+        double l;
+        if (csPackage) {
+            if (r <= 0.52) {
+                l = 0.0315 * c0 - 0.0593 * c0 * pow(r, 1.4);
+            } else if (r <= 0.65) {
+                l = 0.0229 * c0 - 0.0291 * c1;
+            } else if (r <= 0.80) {
+                l = 0.0157 * c0 - 0.0180 * c1;
+            } else if (r <= 1.30) {
+                l = 0.00338 * c0 - 0.00260 * c1;
+            } else {
+                l = 0.0;
+            }
+        } else {
+            if (r <= 0.50) {
+                l = 0.0304 * c0 - 0.062 * c0 * pow(r, 1.4);
+            } else if (r <= 0.61) {
+                l = 0.0224 * c0 - 0.031 * c1;
+            } else if (r <= 0.80) {
+                l = 0.0128 * c0 - 0.0153 * c1;
+            } else if (r <= 1.30) {
+                l = 0.00146 * c0 - 0.00112 * c1;
+            } else {
+                l = 0.0;
+            }
+        }
+        return l > 0.0 ? l : 0.0;
+    }
+
+  private:
+    static uint16_t saturation(uint8_t timing) {
+        static const uint16_t clip[] = {5047, 37177, 65535, 65535};
+        return clip[timing & 0x03];
+    }
+
+    static double sensitivity(uint8_t timing) {
+        // counts relative to 402 ms and 16x gain
+        static const double scale[] = {13.7 / 402.0, 101.0 / 402.0, 1.0, 1.0};
+        return scale[timing & 0x03] * (timing & GAIN_16X ? 1.0 : 1.0 / 16.0);
+    }
+
+    bool timingDirty() {
+        return !bTimingValid || (gain | integrationTime) != timing;
+    }
+
+    bool continuous() {
+        return irqSlot >= 0 ||
+               sampleIntervalMs <= integrationMs(integrationTime) + TSL2561_MARGIN_MS;
+    }
+
+    void loop() {
+        if (bPending) {
+            // waiting for the completion callback of the bus manager
+            return;
+        }
+        unsigned long now = millis();
+        switch (phase) {
+        case PH_IDLE:
+            if (now - lastSample < sampleIntervalMs) {
+                return;
+            }
+            lastSample = now;
+            opsLen = 0;
+            if (!bInitialized) {
+                ops[opsLen++] = OP_ID;
+            }
+            if (timingDirty()) {
+                if (bPowered) {
+                    // restart the integration with the new range
+                    ops[opsLen++] = OP_POWER_OFF;
+                }
+                ops[opsLen++] = OP_TIMING;
+                ops[opsLen++] = OP_POWER_ON;
+            } else if (!bPowered) {
+                ops[opsLen++] = OP_POWER_ON;
+            }
+            if (!opsLen) {
+                // powered up, integrating continuously
+                phase = PH_INTEGRATING;
+                return;
+            }
+            startOps(PH_STARTING);
+            break;
+        case PH_STARTING:
+        case PH_READING:
+        case PH_ARMING:
+            // retry of a failed transfer
+            runOps();
+            break;
+        case PH_INTEGRATING:
+            if (now - phaseStart < integrationMs(integrationTime) + TSL2561_MARGIN_MS) {
+                return;
+            }
+            opsLen = 0;
+            ops[opsLen++] = OP_READ_CH0;
+            ops[opsLen++] = OP_READ_CH1;
+            if (!continuous()) {
+                ops[opsLen++] = OP_POWER_OFF;
+            }
+            startOps(PH_READING);
+            break;
+        case PH_WAIT_INT:
+            if (timingDirty()) {
+                // range changed by command
+                lastSample = now - sampleIntervalMs;
+                phase = PH_IDLE;
+            } else if (tsl2561IrqCount[irqSlot] != irqSeen) {
+                // the sensor keeps the counts of the last integration period
+                irqSeen = tsl2561IrqCount[irqSlot];
+                opsLen = 0;
+                ops[opsLen++] = OP_READ_CH0;
+                ops[opsLen++] = OP_READ_CH1;
+                startOps(PH_READING);
+            }
+            break;
+        case PH_BACKOFF:
+            if (now - phaseStart >= backoffMs) {
+                // probe the sensor again
+                lastSample = now - sampleIntervalMs;
+                phase = PH_IDLE;
+            }
+            break;
+        }
+    }
+
+    void startOps(Phase newPhase) {
+        phase = newPhase;
+        opsPos = 0;
+        runOps();
+    }
+
+    void runOps() {
+        // direct transfers are completed synchronously, a bus manager calls back
+        while (opsPos < opsLen && !bPending) {
+            uint8_t data[4];
+            uint8_t writeLen = 1;
+            uint8_t readLen = 0;
+            switch (ops[opsPos]) {
+            case OP_ID:
+                data[0] = 0x8A;  // command, ID register
+                readLen = 1;
+                break;
+            case OP_TIMING:
+                data[0] = 0x81;  // command, TIMING register
+                data[1] = timingWritten = gain | integrationTime;
+                writeLen = 2;
+                break;
+            case OP_POWER_ON:
+                data[0] = 0x80;  // command, CONTROL register
+                data[1] = 0x03;
+                writeLen = 2;
+                break;
+            case OP_READ_CH0:
+                data[0] = 0xAC;  // command, word, DATA0LOW register
+                readLen = 2;
+                break;
+            case OP_READ_CH1:
+                data[0] = 0xAE;  // command, word, DATA1LOW register
+                readLen = 2;
+                break;
+            case OP_POWER_OFF:
+                data[0] = 0x80;
+                data[1] = 0x00;
+                writeLen = 2;
+                break;
+            case OP_THRESHOLD_LOW:
+                data[0] = 0xA2;  // command, word, THRESHLOWLOW register
+                data[1] = thresholdLow & 0xFF;
+                data[2] = thresholdLow >> 8;
+                writeLen = 3;
+                break;
+            case OP_THRESHOLD_HIGH:
+                data[0] = 0xA4;  // command, word, THRESHHIGHLOW register
+                data[1] = thresholdHigh & 0xFF;
+                data[2] = thresholdHigh >> 8;
+                writeLen = 3;
+                break;
+            case OP_INTERRUPT:
+                data[0] = 0xC6;  // command, clear interrupt, INTERRUPT register
+                data[1] = 0x10 | persistence;  // level interrupt
+                writeLen = 2;
+                break;
+            }
+            if (pManager) {
+                if (pManager->submit(address, data, writeLen, readLen, 0, onTransaction, this)) {
+                    bPending = true;
+                }
+                // queue full: try again on the next tick
+                return;
+            }
+            bool ok = pBus->write(address, data, writeLen);
+            uint8_t response[2];
+            if (ok && readLen) {
+                ok = pBus->read(address, response, readLen) == readLen;
+            }
+            if (!opCompleted(ok, response)) {
+                return;
+            }
+        }
+    }
+
+    static void onTransaction(void *context, const I2CTransaction &t, bool ok) {
+        IlluminanceTSL2561 *self = (IlluminanceTSL2561 *)context;
+        self->bPending = false;
+        if (self->opCompleted(ok, t.readData)) {
+            self->runOps();
+        }
+    }
+
+    bool opCompleted(bool ok, const uint8_t *data) {
+        unsigned long now = millis();
+        if (!ok) {
+            transferFailed(now);
+            return false;
+        }
+        retries = 0;
+        backoffMs = 0;
+        if (bOffline) {
+            bOffline = false;
+            publishStatus();
+        }
+        switch (ops[opsPos]) {
+        case OP_ID:
+            // PARTNO 0000 or 0001: CS package
+            bCsPackage = (data[0] & 0xE0) == 0x00;
+            bInitialized = true;
+            break;
+        case OP_TIMING:
+            timing = timingWritten;
+            bTimingValid = true;
+            break;
+        case OP_POWER_ON:
+            bPowered = true;
+            break;
+        case OP_READ_CH0:
+            ch0 = data[0] | (data[1] << 8);
+            break;
+        case OP_READ_CH1:
+            ch1 = data[0] | (data[1] << 8);
+            break;
+        case OP_POWER_OFF:
+            bPowered = false;
+            break;
+        }
+        if (++opsPos < opsLen) {
+            return true;
+        }
+        if (phase == PH_STARTING) {
+            // the integration starts with power up or a new timing
+            phaseStart = now;
+            phase = PH_INTEGRATING;
+        } else if (phase == PH_ARMING) {
+            phase = PH_WAIT_INT;
+        } else {
+            bool repeat = processSample();
+            if (irqSlot >= 0 && !timingDirty()) {
+                // continue with the new threshold transfers
+                armInterrupt();
+                return true;
+            }
+            if (continuous() && !timingDirty()) {
+                phaseStart = now;
+                phase = PH_INTEGRATING;
+            } else {
+                phase = PH_IDLE;
+                if (repeat || bPowered) {
+                    // switch the range right away
+                    lastSample = now - sampleIntervalMs;
+                }
+            }
+        }
+        return true;
+    }
+
+    void transferFailed(unsigned long now) {
+        ++errors;
+        if (++retries < TSL2561_MAX_RETRIES) {
+            // retry the same transfer on the next tick
+            return;
+        }
+        retries = 0;
+        bInitialized = false;
+        bPowered = false;
+        bTimingValid = false;
+        if (!bOffline) {
+            bOffline = true;
+            publishStatus();
+        }
+        backoffMs = backoffMs ? backoffMs * 2 : 1000;
+        if (backoffMs > TSL2561_BACKOFF_MAX_SEC * 1000UL) {
+            backoffMs = TSL2561_BACKOFF_MAX_SEC * 1000UL;
+        }
+        phaseStart = now;
+        phase = PH_BACKOFF;
+    }
+
+    bool processSample() {
+        // returns true if the sample should be repeated right away in a new range
+        uint16_t clip = saturation(timing);
+        bSaturated = ch0 >= clip || ch1 >= clip;
+        if (bAutoRange) {
+            autoRange();
+        }
+        if (bSaturated) {
+            // the lux value of a saturated channel is meaningless
+            return timingDirty();
+        }
+        double val = calculateLux(ch0, ch1, (Gain)(timing & GAIN_16X),
+                                  (IntegrationTime)(timing & 0x03), bCsPackage);
+        sampleLux = val;
+        if (!pipeline.process(val, millis())) {
+            return false;
+        }
+        if (illuminanceSensor.filter(&val)) {
+            lux = val;
+            publishIlluminance();
+            publishRange();
+        }
+        return false;
+    }
+
+    void armInterrupt() {
+        // threshold band around the last published value in counts of the current range, while
+        // the filtered value lags behind the light, the sample is outside and reads continue
+        double c = sampleLux > 0.0 ? ch0 * lux / sampleLux : ch0;
+        double rel = TSL2561_INT_BAND;
+        if (lux > 0.0 && illuminanceSensor.eps / lux > rel) {
+            rel = illuminanceSensor.eps / lux;
+        }
+        double delta = c * rel < 2.0 ? 2.0 : c * rel;
+        double low = c - delta;
+        double high = c + delta;
+        if (bAutoRange) {
+            // wake up before the range saturates or when the next range becomes due
+            const uint8_t *ladder;
+            uint8_t len = rangeLadder(&ladder);
+            if (high > TSL2561_RANGE_DOWN * saturation(timing)) {
+                high = TSL2561_RANGE_DOWN * saturation(timing);
+            }
+            for (uint8_t i = 0; i + 1 < len; i++) {
+                if (ladder[i] == timing) {
+                    double up = TSL2561_RANGE_UP * saturation(ladder[i + 1]) * sensitivity(timing) /
+                                sensitivity(ladder[i + 1]);
+                    low = low < up ? up : low;
+                }
+            }
+        }
+        thresholdLow = low <= 0.0 ? 0 : (uint16_t)low;
+        thresholdHigh = high >= 65535.0 ? 65535 : (uint16_t)(high + 0.5);
+        // events up to here are answered by this sample
+        irqSeen = tsl2561IrqCount[irqSlot];
+        opsLen = 0;
+        ops[opsLen++] = OP_THRESHOLD_LOW;
+        ops[opsLen++] = OP_THRESHOLD_HIGH;
+        ops[opsLen++] = OP_INTERRUPT;
+        opsPos = 0;
+        phase = PH_ARMING;
+    }
+
+    uint8_t rangeLadder(const uint8_t **ladder) {
+        // ranges by increasing sensitivity, 13.7 ms is only used if 101 ms does not fit into
+        // the sample interval, since its clipping at 5047 counts gives it no more headroom
+        static const uint8_t ladder13[] = {GAIN_1X | INTEG_13MS, GAIN_16X | INTEG_13MS};
+        static const uint8_t ladder101[] = {GAIN_1X | INTEG_101MS, GAIN_16X | INTEG_101MS};
+        static const uint8_t ladder402[] = {GAIN_1X | INTEG_101MS, GAIN_1X | INTEG_402MS,
+                                            GAIN_16X | INTEG_101MS, GAIN_16X | INTEG_402MS};
+        if (sampleIntervalMs >= integrationMs(INTEG_402MS) + TSL2561_MARGIN_MS) {
+            *ladder = ladder402;
+            return sizeof(ladder402);
+        }
+        if (sampleIntervalMs >= integrationMs(INTEG_101MS) + TSL2561_MARGIN_MS) {
+            *ladder = ladder101;
+            return sizeof(ladder101);
+        }
+        *ladder = ladder13;
+        return sizeof(ladder13);
+    }
+
+    void autoRange() {
+        const uint8_t *ladder;
+        uint8_t len = rangeLadder(&ladder);
+        uint8_t next = ladder[0];
+        if (!bSaturated) {
+            // light in counts of the most sensitive range, predict the counts of every range
+            double light = (ch0 > ch1 ? ch0 : ch1) / sensitivity(timing);
+            for (int i = len - 1; i >= 0; i--) {
+                double limit = ladder[i] == timing ? TSL2561_RANGE_DOWN : TSL2561_RANGE_UP;
+                if (light * sensitivity(ladder[i]) <= limit * saturation(ladder[i])) {
+                    next = ladder[i];
+                    break;
+                }
+            }
+        }
+        gain = (Gain)(next & GAIN_16X);
+        integrationTime = (IntegrationTime)(next & 0x03);
+    }
+
+    void publishIlluminance() {
+        char buf[32];
+        snprintf_P(buf, sizeof(buf), PSTR("%.2f"), lux);
+        publish(PSTR("illuminance"), buf);
+    }
+
+    void publishChannels() {
+        char buf[96];
+        snprintf_P(buf, sizeof(buf),
+                   PSTR("{\"ch0\":%u,\"ch1\":%u,\"saturated\":%s,\"gain\":%u,\"integration\":%u}"),
+                   ch0, ch1, bSaturated ? "true" : "false", timing & GAIN_16X ? 16 : 1,
+                   nominalMs(timing));
+        publish(PSTR("channels"), buf);
+    }
+
+    void publishRange() {
+        char buf[64];
+        snprintf_P(buf, sizeof(buf), PSTR("{\"gain\":%u,\"integration\":%u,\"auto\":%s}"),
+                   timing & GAIN_16X ? 16 : 1, nominalMs(timing),
+                   bAutoRange ? "true" : "false");
+        publish(PSTR("range"), buf);
+    }
+
+    static unsigned int nominalMs(uint8_t timing) {
+        // nominal integration time of a timing register value [ms]
+        static const uint16_t ms[] = {13, 101, 402, 402};
+        return ms[timing & 0x03];
+    }
+
+    void publishGain() {
+        publish_P(PSTR("gain"), gain == GAIN_16X ? PSTR("16") : PSTR("1"));
+    }
+
+    void publishIntegrationTime() {
+        char buf[8];
+        snprintf_P(buf, sizeof(buf), PSTR("%u"), nominalMs(integrationTime));
+        publish(PSTR("integration"), buf);
+    }
+
+    void publishStatus() {
+        publish_P(PSTR("status"), bOffline ? PSTR("OFFLINE") : PSTR("OK"));
+    }
+
+    void onCommand(const char *command, const String &msg) {
+        if (!strcmp_P(command, PSTR("illuminance/get"))) {
+            publishIlluminance();
+        }
+        if (!strcmp_P(command, PSTR("channels/get"))) {
+            publishChannels();
+        }
+        if (!strcmp_P(command, PSTR("range/get"))) {
+            publishRange();
+        }
+        if (!strcmp_P(command, PSTR("range/set"))) {
+            const char *m = msg.c_str();
+            setAutoRange(!strcasecmp_P(m, PSTR("auto")) || !strcmp_P(m, PSTR("on")) ||
+                         !strcmp_P(m, PSTR("true")));
+        }
+        if (!strcmp_P(command, PSTR("gain/get"))) {
+            publishGain();
+        }
+        if (!strcmp_P(command, PSTR("gain/set"))) {
+            setGain(msg.toInt() >= 16 ? GAIN_16X : GAIN_1X);
+        }
+        if (!strcmp_P(command, PSTR("integration/get"))) {
+            publishIntegrationTime();
+        }
+        if (!strcmp_P(command, PSTR("integration/set"))) {
+            long ms = msg.toInt();
+            setIntegrationTime(ms < 50 ? INTEG_13MS : (ms < 250 ? INTEG_101MS : INTEG_402MS));
+        }
+        if (!strcmp_P(command, PSTR("status/get"))) {
+            publishStatus();
+        }
+        if (!strcmp_P(command, PSTR("pipeline/get"))) {
+            publishPipeline(pipeline);
+        }
+        if (!strcmp_P(command, PSTR("pipeline/set"))) {
+            pipeline.configure(msg.c_str());
+            publishPipeline(pipeline);
+        }
+        if (!strncmp_P(command, PSTR("pipeline/"), 9)) {
+            char stage[16];
+            if (splitAction(command + 9, PSTR("/get"), stage, sizeof(stage))) {
+                publishPipelineStage(pipeline, pipeline.find(stage));
+            } else if (splitAction(command + 9, PSTR("/set"), stage, sizeof(stage))) {
+                if (pipeline.setParameter(pipeline.find(stage), msg.c_str())) {
+                    publishPipelineStage(pipeline, pipeline.find(stage));
+                }
+            }
+        }
+    };
+};  // IlluminanceTSL2561
+
+}  // namespace ustd
@@ -0,0 +1,92 @@
+// bench_compression.cpp - compression ratio and speed of the LDR archive encoding
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "helper/timeseries_compression.h"
+
+// synthetic day of 200 ms ticks of a 10 bit LDR, filtered with the MEDIUM deadband
+const int TICKS = 432000;
+const double DEADBAND = 0.005;
+const double AD_RANGE = 1023.0;
+
+static uint32_t times[TICKS];
+static float values[TICKS];
+
+template <unsigned int BLOCK_SIZE, unsigned int BLOCKS>
+static int verify(ustd::CompressedSeries<BLOCK_SIZE, BLOCKS> &series, int n, const uint32_t *t,
+                  const float *v) {
+    // decode all blocks and compare bitwise with the newest series.length() samples
+    int errors = 0;
+    unsigned long k = n - series.length();
+    for (unsigned int u = 0; u < series.used; u++) {
+        unsigned int block = (series.first + u) % BLOCKS;
+        ustd::TimeSeriesDecoder decoder;
+        decoder.begin(series.blocks[block], series.counts[block]);
+        uint32_t time;
+        float value;
+        while (decoder.next(&time, &value)) {
+            if (time != t[k] || memcmp(&value, &v[k], sizeof(value))) {
+                errors++;
+            }
+            k++;
+        }
+    }
+    return errors + (k != (unsigned long)n);
+}
+
+static int dayTrace() {
+    static ustd::CompressedSeries<4096, 2> series;
+    srand(3);
+    int n = 0;
+    double last = -1.0;
+    for (int i = 0; i < TICKS; i++) {
+        double t = i * 0.2;
+        double v = 0.5 + 0.45 * sin(t / 86400.0 * 2.0 * M_PI) + (rand() % 3 - 1) / AD_RANGE;
+        v = round(v * AD_RANGE) / AD_RANGE;
+        if (fabs(v - last) > DEADBAND) {
+            last = v;
+            times[n] = (uint32_t)(1700000000 + t);
+            // the archive quantizes to the A/D step as a binary fraction
+            values[n] = (float)(round(v * 1024.0) / 1024.0);
+            n++;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+        series.add(times[i], values[i]);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / n;
+    printf("day trace: %lu samples in %lu bytes, ratio %.1f, encode %.1f ns/sample\n",
+           series.length(), series.bytes(), series.length() * 8.0 / series.bytes(), ns);
+    int errors = verify(series, n, times, values);
+    printf("day trace: %d round-trip errors\n", errors);
+    return errors;
+}
+
+static int randomTrace() {
+    // random gaps and values, repeated values and block rollover
+    static ustd::CompressedSeries<256, 3> series;
+    const int n = 5000;
+    srand(5);
+    uint32_t t = 5;
+    for (int i = 0; i < n; i++) {
+        t += rand() % 100000;
+        times[i] = t;
+        values[i] = (rand() % 2) ? (float)rand() / RAND_MAX * 1000 : (i ? values[i - 1] : 0);
+        series.add(times[i], values[i]);
+    }
+    int errors = verify(series, n, times, values);
+    printf("random: %lu samples kept, %d round-trip errors\n", series.length(), errors);
+    return errors;
+}
+
+int main() {
+    int errors = dayTrace() + randomTrace();
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+// bench_sliding_median.cpp - incremental sliding median against re-sorting the window
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "helper/sliding_median.h"
+#include "sensors.h"
+
+static void reference(const double *window, int n, double *median, double *mad) {
+    // median and MAD by sorting the window, lower median for even lengths
+    double sorted[64];
+    memcpy(sorted, window, n * sizeof(double));
+    std::sort(sorted, sorted + n);
+    *median = sorted[(n - 1) / 2];
+    for (int i = 0; i < n; i++) {
+        sorted[i] = fabs(sorted[i] - *median);
+    }
+    std::sort(sorted, sorted + n);
+    *mad = sorted[(n - 1) / 2];
+}
+
+static int verify() {
+    // 2000 runs of 30 samples with many duplicates, window 7: 60000 windows
+    const int W = 7;
+    int errors = 0;
+    srand(7);
+    for (int run = 0; run < 2000; run++) {
+        ustd::SlidingMedian<W> sm;
+        double window[W];
+        int n = 0;
+        for (int i = 0; i < 30; i++) {
+            double x = rand() % 10;
+            sm.add(x);
+            if (n == W) {
+                memmove(window, window + 1, (W - 1) * sizeof(double));
+                window[W - 1] = x;
+            } else {
+                window[n++] = x;
+            }
+            double median, mad;
+            reference(window, n, &median, &mad);
+            if (median != sm.median() || mad != sm.mad()) {
+                errors++;
+            }
+        }
+    }
+    printf("60000 windows: %d mismatches against the re-sort reference\n", errors);
+    return errors;
+}
+
+static void bench() {
+    const int W = 9;
+    const int M = 1000000;
+    std::vector<double> input(M);
+    for (auto &v : input) {
+        v = rand() % 1024 / 1023.0;
+    }
+
+    // current path: the samples go straight into the smoothing of the sensorprocessor
+    ustd::sensorprocessor direct(50, 0, 0.0);
+    double sum0 = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (double v : input) {
+        if (direct.filter(&v)) {
+            sum0 += v;
+        }
+    }
+    auto smoothed = std::chrono::steady_clock::now();
+
+    // Hampel stage before the smoothing
+    ustd::HampelFilter<W> staged;
+    ustd::sensorprocessor smoothing(50, 0, 0.0);
+    double sum3 = 0.0;
+    for (double v : input) {
+        v = staged.filter(v);
+        if (smoothing.filter(&v)) {
+            sum3 += v;
+        }
+    }
+    auto begin = std::chrono::steady_clock::now();
+
+    ustd::HampelFilter<W> hampel;
+    double sum1 = 0.0;
+    for (double v : input) {
+        sum1 += hampel.filter(v);
+    }
+    auto mid = std::chrono::steady_clock::now();
+
+    double window[W];
+    int head = 0, n = 0;
+    double sum2 = 0.0;
+    for (double v : input) {
+        window[head] = v;
+        head = (head + 1) % W;
+        if (n < W) {
+            n++;
+        }
+        double median, mad;
+        reference(window, n, &median, &mad);
+        sum2 += fabs(v - median) > 3.0 * 1.4826 * mad ? median : v;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    printf("%d samples: sensorprocessor %.1f ns/sample, with Hampel stage %.1f ns/sample\n", M,
+           std::chrono::duration<double, std::nano>(smoothed - start).count() / M,
+           std::chrono::duration<double, std::nano>(begin - smoothed).count() / M);
+    printf("window %d, %d samples: incremental %.1f ns/sample, re-sort %.1f ns/sample\n", W, M,
+           std::chrono::duration<double, std::nano>(mid - begin).count() / M,
+           std::chrono::duration<double, std::nano>(end - mid).count() / M);
+    // keep the smoothed outputs
+    if (sum0 < 0.0 || sum3 < 0.0) {
+        printf("negative output\n");
+    }
+    if (sum1 != sum2) {
+        printf("outputs differ: %f %f\n", sum1, sum2);
+    }
+}
+
+int main() {
+    int errors = verify();
+    bench();
+    return errors ? 1 : 0;
+}
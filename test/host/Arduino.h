@@ -0,0 +1,154 @@
+// Arduino.h - minimal stand-in of the Arduino core for host tests of the mupplets
+//
+// Only what the mupplets use on hosts (`__UNIXOID__`): a `String` on top of std::string, a
+// simulated clock and a simulated A/D converter. The clock only advances with host::advance(),
+// delay() and delayMicroseconds(), so the tests are deterministic and run in no time.
+#pragma once
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <functional>
+#include <string>
+
+class String : public std::string {
+  public:
+    String() {
+    }
+    String(const char *s) : std::string(s ? s : "") {
+    }
+    String(const std::string &s) : std::string(s) {
+    }
+    String(char c) : std::string(1, c) {
+    }
+    String(int v) : std::string(std::to_string(v)) {
+    }
+    String(unsigned int v) : std::string(std::to_string(v)) {
+    }
+    String(long v) : std::string(std::to_string(v)) {
+    }
+    String(unsigned long v) : std::string(std::to_string(v)) {
+    }
+    String(double v, unsigned char decimals = 2) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+        assign(buf);
+    }
+    unsigned int length() const {
+        return size();
+    }
+    long toInt() const {
+        return atol(c_str());
+    }
+    float toFloat() const {
+        return atof(c_str());
+    }
+    double toDouble() const {
+        return atof(c_str());
+    }
+    int indexOf(char c, unsigned int from = 0) const {
+        size_t pos = find(c, from);
+        return pos == npos ? -1 : (int)pos;
+    }
+    int indexOf(const String &s, unsigned int from = 0) const {
+        size_t pos = find(s, from);
+        return pos == npos ? -1 : (int)pos;
+    }
+    String substring(unsigned int from) const {
+        return from > size() ? String() : String(substr(from));
+    }
+    String substring(unsigned int from, unsigned int to) const {
+        return from > size() ? String() : String(substr(from, to - from));
+    }
+    bool startsWith(const String &s) const {
+        return compare(0, s.size(), s) == 0;
+    }
+    bool endsWith(const String &s) const {
+        return size() >= s.size() && compare(size() - s.size(), s.size(), s) == 0;
+    }
+    void toLowerCase() {
+        for (char &c : *this) {
+            c = tolower(c);
+        }
+    }
+    void toUpperCase() {
+        for (char &c : *this) {
+            c = toupper(c);
+        }
+    }
+    void trim() {
+        while (size() && isspace(back())) {
+            pop_back();
+        }
+        while (size() && isspace(front())) {
+            erase(0, 1);
+        }
+    }
+    char charAt(unsigned int i) const {
+        return i < size() ? (*this)[i] : 0;
+    }
+    bool equals(const String &s) const {
+        return *this == s;
+    }
+};
+
+inline String operator+(const String &a, const String &b) {
+    return String(std::string(a) + std::string(b));
+}
+inline String operator+(const String &a, const char *b) {
+    return String(std::string(a) + b);
+}
+inline String operator+(const char *a, const String &b) {
+    return String(a + std::string(b));
+}
+
+#define A0 17
+
+namespace host {
+
+inline unsigned long &clockUs() {
+    // simulated time since the start of the test [µs]
+    static unsigned long us = 0;
+    return us;
+}
+
+inline void advance(unsigned long us) {
+    // advance the simulated clock
+    clockUs() += us;
+}
+
+inline std::function<int(uint8_t)> &analogInput() {
+    // source of analogRead(), e.g. a lambda returning a constant or a simulated flicker
+    static std::function<int(uint8_t)> input = [](uint8_t) { return 0; };
+    return input;
+}
+
+}  // namespace host
+
+inline unsigned long micros() {
+    return host::clockUs();
+}
+
+inline unsigned long millis() {
+    return host::clockUs() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+    host::advance(ms * 1000);
+}
+
+inline void delayMicroseconds(unsigned int us) {
+    host::advance(us);
+}
+
+inline void yield() {
+}
+
+inline int analogRead(uint8_t port) {
+    return host::analogInput()(port);
+}
@@ -0,0 +1,116 @@
+// scheduler.h - minimal stand-in of the muwerk scheduler for host tests of the mupplets
+//
+// Tasks run when their interval has elapsed on the simulated clock of Arduino.h, published
+// messages are queued and delivered to the subscribers at the start of the next loop(), as by
+// the muwerk scheduler. Every published message is also recorded for the checks of the tests.
+#pragma once
+
+#include "Arduino.h"
+
+#include <deque>
+#include <vector>
+
+namespace ustd {
+
+typedef std::function<void()> T_TASK;
+typedef std::function<void(String, String, String)> T_SUBS;
+
+class Scheduler {
+  public:
+    struct Message {
+        String topic;
+        String msg;
+    };
+    std::vector<Message> published;  // all messages published since the last clear()
+
+  private:
+    struct Task {
+        T_TASK task;
+        unsigned long intervalUs;
+        unsigned long lastUs;
+        bool started;
+    };
+    struct Subscription {
+        String topic;
+        T_SUBS subs;
+    };
+    std::vector<Task> tasks;
+    std::vector<Subscription> subscriptions;
+    std::deque<Message> queue;
+
+  public:
+    Scheduler(int = 0, int = 0, int = 0) {
+    }
+
+    int add(T_TASK task, String, unsigned long minMicroSecs = 0, int = 0) {
+        tasks.push_back({task, minMicroSecs, 0, false});
+        return tasks.size();
+    }
+
+    int subscribe(int, String topic, T_SUBS subs, String = "") {
+        subscriptions.push_back({topic, subs});
+        return subscriptions.size();
+    }
+
+    bool publish(String topic, String msg = "", String = "") {
+        published.push_back({topic, msg});
+        queue.push_back({topic, msg});
+        return true;
+    }
+
+    void loop() {
+        // deliver the messages queued so far, then run the tasks that are due
+        for (size_t n = queue.size(); n; n--) {
+            Message m = queue.front();
+            queue.pop_front();
+            for (size_t i = 0; i < subscriptions.size(); i++) {
+                if (matches(subscriptions[i].topic, m.topic)) {
+                    subscriptions[i].subs(m.topic, m.msg, "");
+                }
+            }
+        }
+        unsigned long now = micros();
+        for (size_t i = 0; i < tasks.size(); i++) {
+            Task &t = tasks[i];
+            if (!t.started || now - t.lastUs >= t.intervalUs) {
+                t.started = true;
+                t.lastUs = now;
+                t.task();
+            }
+        }
+    }
+
+    void clear() {
+        published.clear();
+    }
+
+    const Message *last(const char *topic) const {
+        // the last message published on topic, nullptr if none
+        for (size_t i = published.size(); i; i--) {
+            if (published[i - 1].topic == topic) {
+                return &published[i - 1];
+            }
+        }
+        return nullptr;
+    }
+
+    unsigned int count(const char *topic) const {
+        // number of messages published on topic
+        unsigned int n = 0;
+        for (const Message &m : published) {
+            n += m.topic == topic ? 1 : 0;
+        }
+        return n;
+    }
+
+  private:
+    static bool matches(const String &pattern, const String &topic) {
+        // exact match or a trailing `#` wildcard
+        if (pattern.endsWith("#")) {
+            return topic.startsWith(pattern.substring(0, pattern.length() - 1));
+        }
+        return pattern == topic;
+    }
+};
+
+}  // namespace ustd
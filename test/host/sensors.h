@@ -0,0 +1,59 @@
+// sensors.h - the sensorprocessor of ustd for host tests of the mupplets
+#pragma once
+
+#include "Arduino.h"
+
+namespace ustd {
+
+class sensorprocessor {
+    // same algorithm as ustd::sensorprocessor: running mean of smoothInterval values, a new
+    // value is reported when it differs from the last by more than eps or after pollTimeSec
+  public:
+    unsigned int noVals = 0;
+    unsigned int smoothInterval;
+    unsigned int pollTimeSec;
+    double sum = 0.0;
+    double eps;
+    bool first = true;
+    double meanVal = 0;
+    double lastVal = -99999.0;
+    unsigned long last;
+
+    sensorprocessor(unsigned int smoothInterval = 5, unsigned int pollTimeSec = 60,
+                    double eps = 0.1)
+        : smoothInterval(smoothInterval), pollTimeSec(pollTimeSec), eps(eps) {
+        reset();
+    }
+
+    bool filter(double *pvalue) {
+        meanVal = (meanVal * noVals + (*pvalue)) / (noVals + 1);
+        if (noVals < smoothInterval) {
+            ++noVals;
+        }
+        double delta = lastVal - meanVal;
+        if (delta < 0.0) {
+            delta = -delta;
+        }
+        if (delta > eps || first) {
+            first = false;
+            lastVal = meanVal;
+            *pvalue = meanVal;
+            last = time(nullptr);
+            return true;
+        }
+        if (pollTimeSec != 0 && (unsigned long)time(nullptr) - last > pollTimeSec) {
+            lastVal = meanVal;
+            *pvalue = meanVal;
+            last = time(nullptr);
+            return true;
+        }
+        return false;
+    }
+
+    void reset() {
+        noVals = 0;
+        first = true;
+    }
+};
+
+}  // namespace ustd
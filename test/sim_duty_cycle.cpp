@@ -0,0 +1,93 @@
+// sim_duty_cycle.cpp - simulate LDR duty-cycle configurations on a day of illuminance values
+//
+// Usage: sim_duty_cycle [trace]
+// trace: text file with one `<seconds> <unit illuminance>` pair per line, sorted by time. Without
+// a trace, a synthetic day (sun, passing clouds, A/D noise of a 10 bit converter) is used.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "helper/duty_cycle.h"
+
+struct Sample {
+    double time;   // [s]
+    double value;  // unit illuminance
+};
+
+static std::vector<Sample> trace;
+
+static void syntheticDay() {
+    srand(11);
+    double cloud = 0.0;
+    for (int t = 0; t < 86400; t++) {
+        double sun = sin((t - 6 * 3600) / 43200.0 * M_PI);
+        if (sun < 0.0) {
+            sun = 0.0;
+        }
+        // clouds: random walk between 0 (clear) and 0.6 (overcast)
+        cloud += (rand() % 201 - 100) / 20000.0;
+        cloud = cloud < 0.0 ? 0.0 : (cloud > 0.6 ? 0.6 : cloud);
+        double v = 0.02 + 0.9 * sun * (1.0 - cloud) + (rand() % 3 - 1) / 1023.0;
+        trace.push_back({(double)t, round(v * 1023.0) / 1023.0});
+    }
+}
+
+static bool readTrace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    Sample s;
+    while (fscanf(f, "%lf %lf", &s.time, &s.value) == 2) {
+        trace.push_back(s);
+    }
+    fclose(f);
+    return trace.size() > 1;
+}
+
+static double valueAt(double t, size_t *pos) {
+    // last sample at or before t
+    while (*pos + 1 < trace.size() && trace[*pos + 1].time <= t) {
+        ++*pos;
+    }
+    return trace[*pos].value;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        if (!readTrace(argv[1])) {
+            fprintf(stderr, "cannot read trace %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        syntheticDay();
+    }
+    double duration = trace.back().time - trace.front().time;
+    const unsigned long sleeps[] = {30, 60, 300, 900};
+    const double deadbands[] = {0.005, 0.01, 0.02};
+    const unsigned long pollTimeSec = 3600;  // forced publish at least once per hour
+    ustd::DutyCycleProfile profile;
+
+    printf("trace: %zu samples, %.1f h\n\n", trace.size(), duration / 3600.0);
+    printf("sleep[s] deadband wakes/h publish%% awake[s/h]  mA avg  mWh/h  days/2000mAh\n");
+    for (unsigned long sleepSec : sleeps) {
+        for (double deadband : deadbands) {
+            ustd::DutyCycleController controller(deadband, pollTimeSec / sleepSec);
+            size_t pos = 0;
+            for (double t = trace.front().time; t <= trace.back().time; t += sleepSec) {
+                controller.decide(valueAt(t, &pos));
+            }
+            double ratio = (double)controller.state.publishes / controller.state.wakes;
+            ustd::DutyCycleEstimate e =
+                ustd::DutyCycleController::estimate(profile, sleepSec, ratio);
+            printf("%8lu %8.3f %7.1f %8.1f %11.1f %7.3f %6.2f %13.0f\n", sleepSec, deadband,
+                   e.wakesPerHour, ratio * 100.0, e.awakeSecPerHour, e.mAhPerHour, e.mWhPerHour,
+                   2000.0 / e.mAhPerHour / 24.0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+// test_gdk101.cpp - host test of the GDK101 mupplet against simulated sensors
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mup_gamma_gdk101.h"
+#include "helper/gdk101_simulator.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+typedef ustd::GammaGDK101 Gdk;
+
+static void run(ustd::Scheduler &sched, unsigned long ms) {
+    // advance the simulated clock in steps of 5 ms
+    for (unsigned long t = 0; t < ms; t += 5) {
+        host::advance(5000);
+        sched.loop();
+    }
+}
+
+static String last(ustd::Scheduler &sched, const char *topic) {
+    const ustd::Scheduler::Message *m = sched.last(topic);
+    return m ? m->msg : String("-");
+}
+
+static bool near(double a, double b) {
+    return fabs(a - b) < 1e-9;
+}
+
+static void testRegisters() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sim(0x18);
+    bus.attach(&sim);
+    sim.doseRate10 = 0.12;
+    sim.doseRate1 = 0.15;
+    sim.vibration = true;
+    sim.fwMajor = 1;
+    sim.fwMinor = 2;
+    sim.advance(700);
+    Gdk gamma("gamma");
+    gamma.begin(&sched, &bus);
+    run(sched, 1000);
+
+    // firmware on start, then the first poll reads all four registers
+    const Gdk::Device *d = gamma.getDevice(0);
+    CHECK(d->fwMajor == 1 && d->fwMinor == 2);
+    CHECK(d->status == Gdk::NORMAL);
+    CHECK(d->vibration);
+    CHECK(near(d->doseRate10, 0.12));
+    CHECK(near(d->doseRate1, 0.15));
+    CHECK(d->measuringTime == 700);
+    CHECK(gamma.polls == 1);
+    CHECK(sim.writes == 5);
+    CHECK(last(sched, "gamma/sensor/firmware") == "1.2");
+    CHECK(last(sched, "gamma/sensor/status") == "NORMAL");
+    CHECK(last(sched, "gamma/sensor/vibration") == "1");
+    CHECK(last(sched, "gamma/sensor/doserate10min") == "0.12");
+    CHECK(last(sched, "gamma/sensor/doserate1min") == "0.15");
+    CHECK(last(sched, "gamma/sensor/device/0/doserate1min") == "0.15");
+
+    // the next poll only reads status and 1-minute average, the slow registers every minute
+    sim.doseRate1 = 0.25;
+    run(sched, 10000);
+    CHECK(gamma.polls == 2);
+    CHECK(sim.writes == 7);
+    CHECK(last(sched, "gamma/sensor/doserate1min") == "0.25");
+    run(sched, 50000);
+    CHECK(gamma.polls == 7);
+    CHECK(sim.writes == 5 + 6 * 2 + 2);
+    CHECK(gamma.errors == 0);
+}
+
+static void testOfflineBackoff() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sim(0x18);
+    bus.attach(&sim);
+    sim.doseRate1 = 0.1;
+    sim.advance(700);
+    Gdk gamma("gamma");
+    gamma.begin(&sched, &bus);
+    run(sched, 1000);
+    CHECK(gamma.getStatus() == Gdk::NORMAL);
+    CHECK(gamma.getOnlineCount() == 1);
+
+    // GDK101_MAX_RETRIES failed transfers in a row take the sensor offline
+    sim.responding = false;
+    sched.clear();
+    run(sched, 10000);
+    const Gdk::Device *d = gamma.getDevice(0);
+    CHECK(gamma.errors == GDK101_MAX_RETRIES);
+    CHECK(d->status == Gdk::OFFLINE);
+    CHECK(d->busState == Gdk::BUS_BACKOFF);
+    CHECK(d->backoffMs == 1000);
+    CHECK(gamma.getStatus() == Gdk::OFFLINE);
+    CHECK(gamma.getOnlineCount() == 0);
+    CHECK(last(sched, "gamma/sensor/status") == "OFFLINE");
+    CHECK(last(sched, "gamma/sensor/devices") == "{\"count\":1,\"online\":0,\"failed\":[0]}");
+
+    // every probe fails again: the interval doubles up to GDK101_BACKOFF_MAX_SEC
+    unsigned long expected = 1000;
+    unsigned long probes = 0;
+    unsigned long backoffStart = d->stateStart;
+    bool backoff = true;
+    for (int i = 0; i < 600000 / 5; i++) {
+        run(sched, 5);
+        if (d->busState == Gdk::BUS_BACKOFF && !backoff) {
+            // the previous backoff and the failed transfers of the probe
+            unsigned long elapsed = d->stateStart - backoffStart;
+            CHECK(elapsed >= expected && elapsed < expected + 100);
+            expected = expected * 2 > GDK101_BACKOFF_MAX_SEC * 1000UL
+                           ? GDK101_BACKOFF_MAX_SEC * 1000UL
+                           : expected * 2;
+            CHECK(d->backoffMs == expected);
+            backoffStart = d->stateStart;
+            ++probes;
+        }
+        backoff = d->busState == Gdk::BUS_BACKOFF;
+    }
+    printf("offline: %lu probes in 10 minutes, backoff %lu ms\n", probes, d->backoffMs);
+    CHECK(d->backoffMs == GDK101_BACKOFF_MAX_SEC * 1000UL);
+    CHECK(gamma.errors == (probes + 1) * GDK101_MAX_RETRIES);
+    // 1 + 2 + ... + 32 s, then every 60 s
+    CHECK(probes == 6 + (600 - 63) / 60);
+
+    // recovery: the next probe reads the firmware, then the sensor is polled again
+    sim.responding = true;
+    sim.doseRate1 = 0.3;
+    unsigned long writes = sim.writes;
+    for (int i = 0; i < 70000 / 5 && d->status == Gdk::OFFLINE; i++) {
+        run(sched, 5);
+    }
+    run(sched, 100);
+    CHECK(d->status == Gdk::NORMAL);
+    CHECK(d->busState == Gdk::BUS_IDLE);
+    CHECK(d->backoffMs == 0);
+    CHECK(d->retries == 0);
+    CHECK(sim.writes - writes == 5);
+    CHECK(gamma.getOnlineCount() == 1);
+    CHECK(last(sched, "gamma/sensor/devices") == "{\"count\":1,\"online\":1,\"failed\":[]}");
+    CHECK(last(sched, "gamma/sensor/doserate1min") == "0.30");
+}
+
+static void testReset() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sim(0x18);
+    bus.attach(&sim);
+    sim.advance(700);
+    Gdk gamma("gamma");
+    gamma.begin(&sched, &bus, true);
+    // reset on start: reset and firmware, then the first poll
+    run(sched, 1000);
+    CHECK(sim.writes == 6);
+    CHECK(gamma.getDevice(0)->measuringTime == 0);
+    CHECK(gamma.getStatus() == Gdk::READY);
+
+    // a stuck sensor acknowledges the command, but the response never arrives
+    sim.advance(700);
+    sim.stuck = true;
+    run(sched, 10000);
+    CHECK(gamma.getStatus() == Gdk::OFFLINE);
+    sim.stuck = false;
+    // the reset command is sent again with the next probe of the offline sensor
+    sched.publish("gamma/sensor/reset/set");
+    run(sched, 2000);
+    CHECK(sim.measuringTime == 0);
+    CHECK(gamma.getStatus() == Gdk::READY);
+    CHECK(last(sched, "gamma/sensor/status") == "READY");
+}
+
+static void testMedian() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sims[4] = {0x18, 0x19, 0x1A, 0x1B};
+    const double rates1[4] = {0.10, 0.20, 0.30, 5.00};  // the last sensor is defective
+    Gdk gamma("gamma", 0x18);
+    for (uint8_t i = 0; i < 4; i++) {
+        bus.attach(&sims[i]);
+        sims[i].doseRate1 = rates1[i];
+        sims[i].doseRate10 = rates1[i];
+        sims[i].advance(700);
+        if (i) {
+            CHECK(gamma.addDevice(sims[i].address));
+        }
+    }
+    CHECK(!gamma.addDevice(0x1C));
+    gamma.begin(&sched, &bus);
+    run(sched, 1000);
+    CHECK(gamma.getOnlineCount() == 4);
+    // even number of sensors: mean of the two middle values
+    CHECK(near(gamma.getDoseRate1Min(), 0.25));
+    CHECK(last(sched, "gamma/sensor/doserate1min") == "0.25");
+
+    // sensors that stop answering drop out of the median
+    bus.detach(&sims[3]);
+    run(sched, 10000);
+    CHECK(gamma.getOnlineCount() == 3);
+    CHECK(near(gamma.getDoseRate1Min(), 0.20));
+    bus.detach(&sims[2]);
+    run(sched, 10000);
+    CHECK(gamma.getOnlineCount() == 2);
+    CHECK(near(gamma.getDoseRate1Min(), 0.15));
+    CHECK(last(sched, "gamma/sensor/devices") == "{\"count\":4,\"online\":2,\"failed\":[2,3]}");
+
+    bus.detach(&sims[1]);
+    run(sched, 10000);
+    CHECK(near(gamma.getDoseRate1Min(), 0.10));
+
+    // no sensor answers: the last values are kept
+    bus.detach(&sims[0]);
+    run(sched, 10000);
+    CHECK(gamma.getStatus() == Gdk::OFFLINE);
+    CHECK(near(gamma.getDoseRate1Min(), 0.10));
+}
+
+static void testMedianNormal() {
+    // the 10-minute average of sensors in their first 10 minutes is not yet valid
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sims[4] = {0x18, 0x19, 0x1A, 0x1B};
+    const double rates10[4] = {0.10, 0.12, 0.50, 0.60};
+    Gdk gamma("gamma", 0x18);
+    for (uint8_t i = 0; i < 4; i++) {
+        bus.attach(&sims[i]);
+        sims[i].doseRate1 = 0.1;
+        sims[i].doseRate10 = rates10[i];
+        sims[i].advance(i < 2 ? 700 : 100);  // 0, 1: NORMAL, 2, 3: WAITING
+        if (i) {
+            gamma.addDevice(sims[i].address);
+        }
+    }
+    gamma.begin(&sched, &bus);
+    run(sched, 1000);
+    CHECK(gamma.getStatus() == Gdk::NORMAL);
+    // median of the NORMAL sensors only, of all four it would be 0.31
+    CHECK(near(gamma.getDoseRate10Min(), 0.11));
+    CHECK(last(sched, "gamma/sensor/doserate10min") == "0.11");
+
+    // without a NORMAL sensor, the median of all sensors that answer
+    bus.detach(&sims[0]);
+    bus.detach(&sims[1]);
+    run(sched, 10000);
+    CHECK(gamma.getStatus() == Gdk::WAITING);
+    CHECK(near(gamma.getDoseRate10Min(), 0.55));
+}
+
+static void testDose() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sim(0x18);
+    bus.attach(&sim);
+    sim.doseRate1 = 3.6;  // 0.001 µSv per second
+    sim.advance(700);
+    Gdk gamma("gamma");
+    gamma.begin(&sched, &bus);
+    run(sched, 3600000);
+    printf("dose: %.4f µSv after one hour at 3.6 µSv/h\n", gamma.getDose());
+    // integrated up to the last poll
+    CHECK(gamma.getDose() > 3.6 - 0.011 && gamma.getDose() <= 3.6);
+    double published = atof(last(sched, "gamma/sensor/dose").c_str());
+    CHECK(gamma.getDose() - published < GDK101_DOSE_PUBLISH_MIN);
+
+    // periods without an answering sensor are not counted
+    double before = gamma.getDose();
+    sim.responding = false;
+    run(sched, 600000);
+    CHECK(gamma.getStatus() == Gdk::OFFLINE);
+    CHECK(gamma.getDose() - before < 0.011);
+    sim.responding = true;
+    sim.doseRate1 = 7.2;
+    before = gamma.getDose();
+    run(sched, 600000);
+    CHECK(gamma.getStatus() == Gdk::NORMAL);
+    CHECK(gamma.getDose() - before > 1.2 - 0.2 && gamma.getDose() - before < 1.2);
+
+    sched.publish("gamma/sensor/dose/get");
+    run(sched, 5);
+    unsigned long seconds = atol(last(sched, "gamma/sensor/dose/time").c_str());
+    CHECK(seconds > 4200 - 100 && seconds < 4200);
+    sched.publish("gamma/sensor/dose/reset/set");
+    run(sched, 5);
+    CHECK(gamma.getDose() == 0.0);
+    CHECK(last(sched, "gamma/sensor/dose") == "0.0000");
+}
+
+static void testAlarm() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Gdk101Simulator sim(0x18);
+    bus.attach(&sim);
+    sim.doseRate1 = 0.8;
+    sim.advance(700);
+    Gdk gamma("gamma");
+    gamma.begin(&sched, &bus);
+    sched.publish("gamma/sensor/alarm/threshold/set", "1.0,0.5");
+    run(sched, 1000);
+    CHECK(last(sched, "gamma/sensor/alarm/threshold") == "1.000,0.500");
+    CHECK(!gamma.isAlarm());
+
+    // raised at the high threshold, cleared only at the low threshold
+    const double rates[] = {1.0, 0.7, 1.2, 0.51, 0.5, 0.9};
+    const bool alarms[] = {true, true, true, true, false, false};
+    for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        sim.doseRate1 = rates[i];
+        run(sched, 10000);
+        CHECK(gamma.isAlarm() == alarms[i]);
+    }
+    CHECK(sched.count("gamma/sensor/alarm") == 2);
+    CHECK(last(sched, "gamma/sensor/alarm") == "off");
+
+    // without a low threshold it is 80% of the high threshold, off clears a raised alarm
+    sched.publish("gamma/sensor/alarm/threshold/set", "0.5");
+    run(sched, 10000);
+    CHECK(last(sched, "gamma/sensor/alarm/threshold") == "0.500,0.400");
+    CHECK(gamma.isAlarm());
+    sched.publish("gamma/sensor/alarm/threshold/set", "off");
+    run(sched, 5);
+    CHECK(!gamma.isAlarm());
+    CHECK(last(sched, "gamma/sensor/alarm") == "off");
+    CHECK(last(sched, "gamma/sensor/alarm/threshold") == "off");
+}
+
+int main() {
+    testRegisters();
+    testOfflineBackoff();
+    testReset();
+    testMedian();
+    testMedianNormal();
+    testDose();
+    testAlarm();
+    if (failures) {
+        printf("test_gdk101: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_gdk101: ok\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+// test_i2c_bus_manager.cpp - host test of the shared I2C bus manager with simulated devices
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "helper/i2c_bus_manager.h"
+#include "helper/gdk101_simulator.h"
+#include "mup_gamma_gdk101.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+struct Completion {
+    unsigned int calls;
+    unsigned int failed;
+    unsigned long at;  // time of the last completion [ms]
+    uint8_t data[2];
+};
+
+static void onComplete(void *context, const ustd::I2CTransaction &t, bool ok) {
+    Completion *c = (Completion *)context;
+    ++c->calls;
+    c->failed += ok ? 0 : 1;
+    c->at = millis();
+    memcpy(c->data, t.readData, sizeof(c->data));
+}
+
+static void run(ustd::Scheduler &sched, unsigned long ms) {
+    // advance the simulated clock in steps of 1 ms
+    for (unsigned long t = 0; t < ms; t++) {
+        host::advance(1000);
+        sched.loop();
+    }
+}
+
+static String last(ustd::Scheduler &sched, const char *topic) {
+    const ustd::Scheduler::Message *m = sched.last(topic);
+    return m ? m->msg : String("-");
+}
+
+static void testQueueFull() {
+    ustd::Scheduler sched;
+    ustd::I2CBusManager i2c("i2c");
+    ustd::Gdk101Simulator sim(0x18);
+    i2c.bus.attach(&sim);
+    i2c.begin(&sched);
+    Completion c;
+    memset(&c, 0, sizeof(c));
+    const uint8_t cmd = 0xB4;  // firmware version
+    for (unsigned int i = 0; i < I2C_QUEUE_SIZE; i++) {
+        CHECK(i2c.submit(0x18, &cmd, 1, 2, 0, onComplete, &c));
+    }
+    // the queue is full: rejected and counted, the callback is not called
+    CHECK(!i2c.submit(0x18, &cmd, 1, 2, 0, onComplete, &c));
+    // too long transfers are rejected without being counted
+    uint8_t data[8] = {0};
+    CHECK(!i2c.submit(0x18, data, 5, 0, 0, onComplete, &c));
+    CHECK(!i2c.submit(0x18, data, 1, 9, 0, onComplete, &c));
+    run(sched, 5);
+    CHECK(c.calls == I2C_QUEUE_SIZE);
+    CHECK(c.failed == 0);
+    CHECK(c.data[0] == 0 && c.data[1] == 6);
+    // room again
+    CHECK(i2c.submit(0x18, &cmd, 1, 2, 0, onComplete, &c));
+    run(sched, 5);
+    sched.publish("i2c/stats/get");
+    run(sched, 5);
+    String stats = last(sched, "i2c/stats");
+    printf("queue full: %s\n", stats.c_str());
+    CHECK(stats.indexOf("\"transactions\":17,") >= 0);
+    CHECK(stats.indexOf("\"rejected\":1,") >= 0);
+    CHECK(stats.indexOf("\"maxdepth\":16}") >= 0);
+
+    sched.publish("i2c/stats/reset/set");
+    sched.publish("i2c/stats/get");
+    run(sched, 5);
+    CHECK(last(sched, "i2c/stats").indexOf("\"rejected\":0,") >= 0);
+}
+
+static void testReadDelay() {
+    ustd::Scheduler sched;
+    ustd::I2CBusManager i2c("i2c");
+    ustd::Gdk101Simulator slow(0x18);
+    ustd::Gdk101Simulator fast(0x19);
+    i2c.bus.attach(&slow);
+    i2c.bus.attach(&fast);
+    i2c.begin(&sched);
+    Completion cs, cf, cm;
+    memset(&cs, 0, sizeof(cs));
+    memset(&cf, 0, sizeof(cf));
+    memset(&cm, 0, sizeof(cm));
+    const uint8_t cmd = 0xB4;
+    unsigned long start = millis();
+    CHECK(i2c.submit(0x18, &cmd, 1, 2, 20, onComplete, &cs));
+    CHECK(i2c.submit(0x18, &cmd, 1, 2, 0, onComplete, &cs));
+    CHECK(i2c.submit(0x19, &cmd, 1, 2, 0, onComplete, &cf));
+    CHECK(i2c.submit(0x1A, &cmd, 1, 2, 0, onComplete, &cm));
+    run(sched, 5);
+    // the bus is free while 0x18 prepares its response, its next transaction waits
+    CHECK(cf.calls == 1);
+    CHECK(cs.calls == 0);
+    // a missing device fails, the callback reports it
+    CHECK(cm.calls == 1 && cm.failed == 1);
+    run(sched, 30);
+    CHECK(cs.calls == 2 && cs.failed == 0);
+    CHECK(cs.at - start >= 20);
+}
+
+static void testCallbackContinues() {
+    // the GDK101 continues its transactions in the completion callbacks of the manager
+    ustd::Scheduler sched;
+    ustd::I2CBusManager i2c("i2c");
+    ustd::Gdk101Simulator sim(0x18);
+    i2c.bus.attach(&sim);
+    sim.doseRate1 = 0.2;
+    sim.advance(700);
+    ustd::GammaGDK101 gamma("gamma");
+    // the first poll of the sensor finds the queue full and is submitted again later
+    Completion c;
+    memset(&c, 0, sizeof(c));
+    const uint8_t cmd = 0xB0;
+    for (unsigned int i = 0; i < I2C_QUEUE_SIZE; i++) {
+        CHECK(i2c.submit(0x19, &cmd, 1, 2, 0, onComplete, &c));
+    }
+    gamma.begin(&sched, &i2c);
+    i2c.begin(&sched);
+    run(sched, 1000);
+    CHECK(c.calls == I2C_QUEUE_SIZE);
+    CHECK(gamma.polls == 1);
+    CHECK(gamma.errors == 0);
+    CHECK(gamma.getStatus() == ustd::GammaGDK101::NORMAL);
+    CHECK(last(sched, "gamma/sensor/doserate1min") == "0.20");
+    // firmware and the four registers of the first poll
+    CHECK(sim.writes == 5 && sim.reads == 5);
+    sched.publish("i2c/stats/get");
+    run(sched, 10000);
+    String stats = last(sched, "i2c/stats");
+    CHECK(stats.indexOf("\"rejected\":1,") >= 0);
+    CHECK(gamma.polls == 2);
+
+    // a sensor that stops answering fails in the callback and goes offline
+    sim.responding = false;
+    run(sched, 10000);
+    CHECK(gamma.errors == GDK101_MAX_RETRIES);
+    CHECK(gamma.getStatus() == ustd::GammaGDK101::OFFLINE);
+}
+
+int main() {
+    testQueueFull();
+    testReadDelay();
+    testCallbackContinues();
+    if (failures) {
+        printf("test_i2c_bus_manager: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_i2c_bus_manager: ok\n");
+    return 0;
+}
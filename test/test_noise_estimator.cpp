@@ -0,0 +1,104 @@
+// test_noise_estimator.cpp - host test of the noise estimator
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helper/noise_estimator.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+static double gauss() {
+    // Box-Muller, deterministic sequence by fixed seed
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static double quantize(double x) {
+    // 10 bit A/D converter
+    return round(x * 1023.0) / 1023.0;
+}
+
+static void testConstantStart() {
+    // a dark LDR: constant readings, then the noise appears
+    ustd::NoiseEstimator noise;
+    noise.minLimit = 1.0 / 1023.0;
+    srand(1);
+    for (int i = 0; i < 100; i++) {
+        noise.add(0.0);
+    }
+    CHECK(noise.valid());
+    CHECK(noise.sigma() == 0.0);
+    for (int i = 0; i < 2000; i++) {
+        noise.add(quantize(0.5 + 0.01 * gauss()));
+    }
+    printf("constant start: sigma %.5f\n", noise.sigma());
+    CHECK(fabs(noise.sigma() - 0.01) < 0.002);
+}
+
+static void testConstantStartNoFloor() {
+    // without a minimum limit, a zero estimate must not block all residuals
+    ustd::NoiseEstimator noise;
+    srand(2);
+    for (int i = 0; i < 100; i++) {
+        noise.add(0.25);
+    }
+    for (int i = 0; i < 2000; i++) {
+        noise.add(0.25 + 0.01 * gauss());
+    }
+    printf("constant start, no floor: sigma %.5f\n", noise.sigma());
+    CHECK(fabs(noise.sigma() - 0.01) < 0.002);
+}
+
+static void testStepInWarmup() {
+    // a large step within the first samples must not inflate the estimate
+    ustd::NoiseEstimator noise;
+    srand(3);
+    for (int i = 0; i < 200; i++) {
+        noise.add((i < 5 ? 0.1 : 0.9) + 0.01 * gauss());
+        if (i == 20) {
+            printf("step in warm-up: sigma %.5f after 20 samples\n", noise.sigma());
+            CHECK(noise.sigma() < 0.02);
+        }
+    }
+    printf("step in warm-up: sigma %.5f after 200 samples\n", noise.sigma());
+    CHECK(fabs(noise.sigma() - 0.01) < 0.002);
+}
+
+static void testStepsAndRamp() {
+    ustd::NoiseEstimator noise;
+    srand(4);
+    double x = 0.2;
+    for (int i = 0; i < 5000; i++) {
+        x += 0.00005;
+        if (i % 1000 == 500) {
+            x += 0.2;
+        }
+        noise.add(x + 0.01 * gauss());
+    }
+    printf("ramp and steps: sigma %.5f\n", noise.sigma());
+    CHECK(fabs(noise.sigma() - 0.01) < 0.002);
+}
+
+int main() {
+    testConstantStart();
+    testConstantStartNoFloor();
+    testStepInWarmup();
+    testStepsAndRamp();
+    if (failures) {
+        printf("test_noise_estimator: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_noise_estimator: ok\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+// test_rtc_store.cpp - host test of the RTC store and the warm start of the LDR
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "helper/rtc_store.h"
+#include "mup_illuminance_ldr.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+struct Block {
+    uint32_t counter;
+    double value;
+    char text[12];
+};
+
+static void testRoundTrip() {
+    Block saved = {42, 3.25, "warm"};
+    Block loaded;
+    CHECK(ustd::RtcStore::save(4, &saved, sizeof(saved)));
+    memset(&loaded, 0, sizeof(loaded));
+    CHECK(ustd::RtcStore::load(4, &loaded, sizeof(loaded)));
+    CHECK(!memcmp(&saved, &loaded, sizeof(saved)));
+    // blocks beyond the end of the region are rejected
+    CHECK(!ustd::RtcStore::save(RTC_STORE_SIZE / 4 - 2, &saved, sizeof(saved)));
+}
+
+static void testBadCrc() {
+    Block saved = {7, 1.5, "crc"};
+    Block loaded;
+    CHECK(ustd::RtcStore::save(4, &saved, sizeof(saved)));
+    CHECK(ustd::RtcStore::load(4, &loaded, sizeof(loaded)));
+    // a block of another length does not match the checksum
+    CHECK(!ustd::RtcStore::load(4, &loaded, sizeof(loaded) - 4));
+    // damaged data: a block saved at offset 5 overwrites the first data word of the block
+    uint32_t garbage = 0x12345678;
+    CHECK(ustd::RtcStore::save(5, &garbage, sizeof(garbage)));
+    CHECK(!ustd::RtcStore::load(4, &loaded, sizeof(loaded)));
+    // invalidated
+    CHECK(ustd::RtcStore::save(4, &saved, sizeof(saved)));
+    ustd::RtcStore::invalidate(4);
+    CHECK(!ustd::RtcStore::load(4, &loaded, sizeof(loaded)));
+}
+
+static double runLdr(ustd::IlluminanceLdr &ldr, ustd::Scheduler &sched, int ticks) {
+    for (int i = 0; i < ticks; i++) {
+        host::advance(200000);
+        sched.loop();
+    }
+    return ldr.getUnitIlluminance();
+}
+
+static void testLdrWarmStart() {
+    const uint8_t offset = 16;
+    // warm state: 12 words plus checksum, the version is byte 2
+    const uint16_t stateSize = 48;
+    ustd::RtcStore::invalidate(offset);
+    host::analogInput() = [](uint8_t) { return 800; };
+    double value;
+    {
+        ustd::Scheduler sched;
+        ustd::IlluminanceLdr ldr("ldr", A0, ustd::IlluminanceLdr::MEDIUM);
+        CHECK(!ldr.enableWarmStart(offset));
+        ldr.begin(&sched);
+        value = runLdr(ldr, sched, 20);
+        CHECK(fabs(value - 800 / 1023.0) < 0.001);
+    }
+    host::analogInput() = [](uint8_t) { return 0; };
+    {
+        // warm: the restored value is available at once and the mean of the smoothing is kept
+        ustd::Scheduler sched;
+        ustd::IlluminanceLdr ldr("ldr", A0, ustd::IlluminanceLdr::MEDIUM);
+        CHECK(ldr.enableWarmStart(offset));
+        CHECK(ldr.getUnitIlluminance() == value);
+        ldr.begin(&sched);
+        double first = runLdr(ldr, sched, 1);
+        printf("warm start: restored %.4f, first value %.4f\n", value, first);
+        CHECK(first > 0.5 * value);
+    }
+    {
+        // cold: the first value is the new reading
+        ustd::Scheduler sched;
+        ustd::IlluminanceLdr ldr("ldr", A0, ustd::IlluminanceLdr::MEDIUM);
+        ldr.begin(&sched);
+        CHECK(runLdr(ldr, sched, 1) == 0.0);
+    }
+    {
+        // the state was saved with MEDIUM, another filter mode does not restore it
+        ustd::IlluminanceLdr ldr("ldr", A0, ustd::IlluminanceLdr::LONGTERM);
+        CHECK(!ldr.enableWarmStart(offset));
+    }
+    {
+        // a state of another layout version is not restored
+        uint8_t raw[stateSize];
+        CHECK(ustd::RtcStore::load(offset, raw, sizeof(raw)));
+        raw[2] += 1;
+        CHECK(ustd::RtcStore::save(offset, raw, sizeof(raw)));
+        ustd::IlluminanceLdr ldr("ldr", A0, ustd::IlluminanceLdr::MEDIUM);
+        CHECK(!ldr.enableWarmStart(offset));
+        raw[2] -= 1;
+        CHECK(ustd::RtcStore::save(offset, raw, sizeof(raw)));
+        CHECK(ldr.enableWarmStart(offset));
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testBadCrc();
+    testLdrWarmStart();
+    if (failures) {
+        printf("test_rtc_store: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_rtc_store: ok\n");
+    return 0;
+}
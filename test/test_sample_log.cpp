@@ -0,0 +1,182 @@
+// test_sample_log.cpp - host test of the flash sample log, files below the current directory
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helper/sample_log.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+static const char *PREFIX = "/test_sample_log";
+static const uint8_t SEGMENTS = 4;
+
+static void removeSegments() {
+    char path[48];
+    for (uint8_t i = 0; i < SEGMENTS; i++) {
+        snprintf(path, sizeof(path), "%s.%u.log", PREFIX, (unsigned int)i);
+        ustd::FlashFile::remove(path);
+    }
+}
+
+static void segmentFile(uint8_t segment, char *path) {
+    // host file of a segment, see FlashFile
+    snprintf(path, 48, "%s/%s.%u.log", FLASH_FILE_HOST_DIR, PREFIX + 1, (unsigned int)segment);
+}
+
+static bool truncateFile(FILE *f, long size) {
+    fflush(f);
+    return ftruncate(fileno(f), size) == 0;
+}
+
+static unsigned int readAll(ustd::SampleLog<256> &log, uint32_t *first, uint32_t *last) {
+    // read all records (each a uint32_t counter), check they are consecutive
+    ustd::SampleLog<256>::Cursor cursor;
+    uint8_t payload[255];
+    uint8_t len;
+    unsigned int n = 0;
+    log.rewind(&cursor);
+    while (log.read(&cursor, payload, &len)) {
+        uint32_t v;
+        CHECK(len == sizeof(v));
+        memcpy(&v, payload, sizeof(v));
+        if (!n) {
+            *first = v;
+        } else {
+            CHECK(v == *last + 1);
+        }
+        *last = v;
+        n++;
+    }
+    return n;
+}
+
+static void testAppendRotateRead() {
+    removeSegments();
+    ustd::SampleLog<256> log;
+    CHECK(log.begin(PREFIX, SEGMENTS, 1024));
+    // 7 bytes per record, 1024 byte segments: about 145 records per segment, 4 segments
+    for (uint32_t i = 0; i < 2000; i++) {
+        CHECK(log.append(&i, sizeof(i)));
+    }
+    CHECK(log.sync());
+    uint32_t first = 0, last = 0;
+    unsigned int n = readAll(log, &first, &last);
+    printf("append and rotate: %u records readable, %u..%u\n", n, first, last);
+    CHECK(last == 1999);
+    CHECK(n == last - first + 1);
+    CHECK(n > 3 * 140 && n <= 4 * 146);  // the oldest segments were overwritten
+
+    // reopen: the state is recovered from the files
+    ustd::SampleLog<256> reopened;
+    CHECK(reopened.begin(PREFIX, SEGMENTS, 1024));
+    uint32_t v = 2000;
+    CHECK(reopened.append(&v, sizeof(v)));
+    CHECK(reopened.sync());
+    unsigned int m = readAll(reopened, &first, &last);
+    CHECK(last == 2000);
+    CHECK(m == last - first + 1);
+    CHECK(reopened.stats.tornBytes == 0);
+}
+
+static void testTornTail(bool truncate) {
+    removeSegments();
+    uint32_t first = 0, last = 0;
+    {
+        ustd::SampleLog<256> log;
+        CHECK(log.begin(PREFIX, SEGMENTS, 16384));
+        for (uint32_t i = 0; i < 100; i++) {
+            log.append(&i, sizeof(i));
+        }
+        CHECK(log.sync());
+    }
+    // damage the last record of the only segment: cut it or flip a payload bit
+    char path[48];
+    segmentFile(0, path);
+    FILE *f = fopen(path, "r+b");
+    CHECK(f != nullptr);
+    if (!f) {
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if (truncate) {
+        CHECK(truncateFile(f, size - 2));
+    } else {
+        fseek(f, size - 3, SEEK_SET);
+        int c = fgetc(f);
+        fseek(f, size - 3, SEEK_SET);
+        fputc(c ^ 0x10, f);
+    }
+    fclose(f);
+
+    ustd::SampleLog<256> log;
+    CHECK(log.begin(PREFIX, SEGMENTS, 16384));
+    printf("%s tail: %lu bytes discarded\n", truncate ? "truncated" : "corrupted",
+           log.stats.tornBytes);
+    CHECK(log.stats.tornBytes == (truncate ? 5 : 7));
+    unsigned int n = readAll(log, &first, &last);
+    CHECK(n == 99);
+    CHECK(last == 98);
+    // writing continues in a fresh segment behind the intact records
+    uint32_t v = 99;
+    CHECK(log.append(&v, sizeof(v)));
+    CHECK(log.sync());
+    n = readAll(log, &first, &last);
+    CHECK(n == 100);
+    CHECK(last == 99);
+}
+
+static void testWriteAmplification() {
+    // 8 byte payloads synced per record against block buffered writes
+    const unsigned int count = 1000;
+    removeSegments();
+    ustd::SampleLog<256> synced;
+    CHECK(synced.begin(PREFIX, SEGMENTS, 65536));
+    uint8_t payload[8] = {0};
+    for (unsigned int i = 0; i < count; i++) {
+        synced.append(payload, sizeof(payload));
+        synced.sync();
+    }
+    removeSegments();
+    ustd::SampleLog<256> buffered;
+    CHECK(buffered.begin(PREFIX, SEGMENTS, 65536));
+    for (unsigned int i = 0; i < count; i++) {
+        buffered.append(payload, sizeof(payload));
+    }
+    buffered.sync();
+    printf("write amplification, %u records of 8 bytes, 256 byte pages:\n", count);
+    printf("  sync per record: %5.2f (%lu writes, %lu pages)\n", synced.writeAmplification(),
+           synced.stats.blockWrites, synced.stats.pagesWritten);
+    printf("  256 byte block:  %5.2f (%lu writes, %lu pages)\n", buffered.writeAmplification(),
+           buffered.stats.blockWrites, buffered.stats.pagesWritten);
+    CHECK(buffered.stats.bytesWritten == 8 + count * 11);
+    // 11 framed bytes per 8 payload bytes, and the 8 byte segment header shifts every block
+    // across a page boundary: at most 2 * 11 / 8
+    CHECK(buffered.writeAmplification() < 2.0 * 11 / 8 + 0.1);
+    CHECK(synced.writeAmplification() > 10.0 * buffered.writeAmplification());
+}
+
+int main() {
+    testAppendRotateRead();
+    testTornTail(true);
+    testTornTail(false);
+    testWriteAmplification();
+    removeSegments();
+    if (failures) {
+        printf("test_sample_log: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_sample_log: ok\n");
+    return 0;
+}
@@ -0,0 +1,327 @@
+// test_tsl2561.cpp - host test of the TSL2561 mupplet against the simulated sensor
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mup_illuminance_tsl2561.h"
+#include "helper/tsl2561_simulator.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+typedef ustd::IlluminanceTSL2561 Tsl;
+
+static unsigned long maxTickUs = 0;  // longest scheduler loop in simulated time
+
+static void run(ustd::Scheduler &sched, unsigned long ms) {
+    // advance the simulated clock in steps of 1 ms
+    for (unsigned long t = 0; t < ms; t++) {
+        host::advance(1000);
+        unsigned long start = micros();
+        sched.loop();
+        if (micros() - start > maxTickUs) {
+            maxTickUs = micros() - start;
+        }
+    }
+}
+
+static String last(ustd::Scheduler &sched, const char *topic) {
+    const ustd::Scheduler::Message *m = sched.last(topic);
+    return m ? m->msg : String("-");
+}
+
+static unsigned long nextSample(ustd::Scheduler &sched, ustd::Tsl2561Simulator &sim) {
+    // run up to the tick that reads the channels, returns its time
+    unsigned long reads = sim.reads;
+    for (int i = 0; i < 3000 && sim.reads - reads < 2; i++) {
+        run(sched, 1);
+    }
+    return millis();
+}
+
+static void testIntegrationTiming(Tsl::IntegrationTime integration) {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    sim.broadband = 1000.0;
+    sim.infrared = 100.0;
+    Tsl tsl("tsl", 0x39, 1000, Tsl::FAST);
+    tsl.setGain(Tsl::GAIN_16X, true);
+    tsl.setIntegrationTime(integration, true);
+    tsl.begin(&sched, &bus);
+
+    // the ID is read and the sensor powered up in the first tick, the channels are read in
+    // the first tick after the integration has elapsed
+    unsigned long poweredAt = 0, readAt = 0, poweredOffAt = 0;
+    unsigned long reads = 0;
+    maxTickUs = 0;
+    for (int i = 0; i < 3000 && !poweredOffAt; i++) {
+        bool powered = sim.powered();
+        run(sched, 1);
+        if (!powered && sim.powered() && !poweredAt) {
+            poweredAt = millis();
+            reads = sim.reads;
+        }
+        if (poweredAt && sim.reads != reads && !readAt) {
+            readAt = millis();
+            CHECK(sim.reads - reads == 2);
+        }
+        if (powered && !sim.powered()) {
+            poweredOffAt = millis();
+        }
+    }
+    unsigned long ms = Tsl::integrationMs(integration);
+    printf("integration %lu ms: powered at %lu ms, read at %lu ms, longest tick %lu us\n", ms,
+           poweredAt, readAt, maxTickUs);
+    CHECK(poweredAt && readAt);
+    CHECK(readAt - poweredAt >= ms + TSL2561_MARGIN_MS);
+    CHECK(readAt - poweredAt < ms + TSL2561_MARGIN_MS + 10);
+    // no tick waits for the sensor
+    CHECK(maxTickUs == 0);
+    // sample interval longer than the integration: powered down after the sample
+    CHECK(poweredOffAt == readAt);
+    CHECK(tsl.getIlluminance() > 0.0);
+    CHECK(last(sched, "tsl/sensor/illuminance") != "-");
+}
+
+static void testContinuous() {
+    // sample interval not longer than the integration: the sensor stays powered up
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    sim.broadband = 1000.0;
+    Tsl tsl("tsl", 0x39, 100, Tsl::FAST);
+    tsl.setGain(Tsl::GAIN_16X, true);
+    tsl.setIntegrationTime(Tsl::INTEG_101MS, true);
+    tsl.begin(&sched, &bus);
+    run(sched, 100);
+    unsigned long writes = sim.writes;
+    unsigned long reads = sim.reads;
+    run(sched, 1000);
+    CHECK(sim.powered());
+    // two channel reads per integration period, no power cycling
+    CHECK(sim.writes - writes == sim.reads - reads);
+    unsigned long samples = (sim.reads - reads) / 2;
+    printf("continuous: %lu samples of 101 ms in 1 s\n", samples);
+    CHECK(samples >= 1000 / (Tsl::integrationMs(Tsl::INTEG_101MS) + TSL2561_MARGIN_MS + 10));
+    CHECK(samples <= 1000 / (Tsl::integrationMs(Tsl::INTEG_101MS) + TSL2561_MARGIN_MS));
+}
+
+static void testSaturation() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    sim.broadband = 16 * 100000.0;
+    sim.infrared = 16 * 10000.0;
+    Tsl tsl("tsl", 0x39, 1000, Tsl::FAST);
+    tsl.begin(&sched, &bus);
+
+    // the first sample in 1x/402 ms clips at the saturation of the range
+    unsigned long first = nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x02);
+    sched.publish("tsl/sensor/channels/get");
+    run(sched, 1);
+    CHECK(last(sched, "tsl/sensor/channels") ==
+          "{\"ch0\":65535,\"ch1\":10000,\"saturated\":true,\"gain\":1,\"integration\":402}");
+    CHECK(last(sched, "tsl/sensor/illuminance") == "-");
+
+    // repeated right away in the least sensitive range
+    unsigned long second = nextSample(sched, sim);
+    printf("saturation: repeated after %lu ms\n", second - first);
+    CHECK(second - first < Tsl::integrationMs(Tsl::INTEG_101MS) + TSL2561_MARGIN_MS + 20);
+    CHECK(sim.regs[0x01] == 0x01);
+    sched.publish("tsl/sensor/channels/get");
+    run(sched, 1);
+    CHECK(last(sched, "tsl/sensor/channels") ==
+          "{\"ch0\":25124,\"ch1\":2512,\"saturated\":false,\"gain\":1,\"integration\":101}");
+    CHECK(last(sched, "tsl/sensor/illuminance") != "-");
+    CHECK(last(sched, "tsl/sensor/range") == "{\"gain\":1,\"integration\":101,\"auto\":true}");
+
+    // saturated in the least sensitive range: no value, no repetition
+    sim.broadband = 16 * 200000.0;
+    unsigned long values = sched.count("tsl/sensor/illuminance");
+    unsigned long third = nextSample(sched, sim);
+    CHECK(third - second >= 1000);
+    sched.publish("tsl/sensor/channels/get");
+    run(sched, 1);
+    CHECK(last(sched, "tsl/sensor/channels") ==
+          "{\"ch0\":37177,\"ch1\":2512,\"saturated\":true,\"gain\":1,\"integration\":101}");
+    CHECK(nextSample(sched, sim) - third >= 1000);
+    CHECK(sim.regs[0x01] == 0x01);
+    CHECK(sched.count("tsl/sensor/illuminance") == values);
+}
+
+static void testRangeUp() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    const double full = 65535.0;
+    sim.broadband = 0.98 * TSL2561_RANGE_UP * full;
+    Tsl tsl("tsl", 0x39, 1000, Tsl::FAST);
+    tsl.begin(&sched, &bus);
+
+    // below TSL2561_RANGE_UP of full scale in the most sensitive range: 16x/402 ms
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x02);
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x12);
+
+    // between TSL2561_RANGE_UP and TSL2561_RANGE_DOWN the range is kept
+    sim.broadband = 0.8 * full;
+    nextSample(sched, sim);
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x12);
+
+    // above TSL2561_RANGE_DOWN: the most sensitive range that predicts less than
+    // TSL2561_RANGE_UP of its full scale, 16x/101 ms would be at 42%
+    sim.broadband = 0.95 * full;
+    nextSample(sched, sim);
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x02);
+    sched.publish("tsl/sensor/range/get");
+    run(sched, 1);
+    CHECK(last(sched, "tsl/sensor/range") == "{\"gain\":1,\"integration\":402,\"auto\":true}");
+
+    // just above TSL2561_RANGE_UP of 16x/402 ms: one step less, 16x/101 ms
+    sim.broadband = 1.02 * TSL2561_RANGE_UP * full;
+    nextSample(sched, sim);
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x11);
+
+    // a fixed range is kept
+    tsl.setGain(Tsl::GAIN_1X);
+    CHECK(last(sched, "tsl/sensor/gain") == "1");
+    sim.broadband = 100.0;
+    nextSample(sched, sim);
+    nextSample(sched, sim);
+    CHECK(sim.regs[0x01] == 0x01);
+    sched.publish("tsl/sensor/range/get");
+    run(sched, 1);
+    CHECK(last(sched, "tsl/sensor/range") == "{\"gain\":1,\"integration\":101,\"auto\":false}");
+}
+
+// the interrupt slots are shared by all instances: four instances in interrupt mode at most
+
+static void testPersistence(uint8_t persistence, uint8_t expected) {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    sim.broadband = 10000.0;
+    Tsl tsl("tsl", 0x39, 1000, Tsl::FAST);
+    tsl.setGain(Tsl::GAIN_16X, true);
+    CHECK(tsl.setInterruptMode(5, persistence));
+    tsl.begin(&sched, &bus);
+    nextSample(sched, sim);
+    run(sched, 20);
+    CHECK(sim.regs[0x06] == (0x10 | expected));
+}
+
+static void testInterrupt() {
+    ustd::Scheduler sched;
+    ustd::I2CBus bus;
+    ustd::Tsl2561Simulator sim(0x39);
+    bus.attach(&sim);
+    sim.broadband = 10000.0;
+    Tsl tsl("tsl", 0x39, 1000, Tsl::FAST);
+    tsl.setGain(Tsl::GAIN_16X, true);
+    tsl.setIntegrationTime(Tsl::INTEG_402MS, true);
+    CHECK(tsl.setInterruptMode(5, 2));
+    tsl.begin(&sched, &bus);
+
+    // after the first sample the thresholds are armed 5% around the counts
+    nextSample(sched, sim);
+    run(sched, 20);
+    CHECK(last(sched, "tsl/sensor/illuminance") == "304.00");
+    CHECK((sim.regs[0x02] | (sim.regs[0x03] << 8)) == 9500);
+    CHECK((sim.regs[0x04] | (sim.regs[0x05] << 8)) == 10500);
+    CHECK(sim.regs[0x06] == 0x12);
+    CHECK(sim.powered());
+
+    // no transfers while the light stays in the band
+    unsigned long reads = sim.reads;
+    unsigned long writes = sim.writes;
+    for (int i = 0; i < 10; i++) {
+        sim.broadband = i % 2 ? 9600.0 : 10400.0;
+        sim.integrate();
+        run(sched, 1000);
+    }
+    CHECK(!sim.interrupt);
+    CHECK(sim.reads == reads && sim.writes == writes);
+
+    // out of the band for one period: below the persistence
+    sim.broadband = 12000.0;
+    sim.integrate();
+    CHECK(!sim.interrupt);
+    sim.integrate();
+    CHECK(sim.interrupt);
+    // the INT line is not seen until the interrupt service routine runs
+    run(sched, 1000);
+    CHECK(sim.reads == reads);
+    tsl.interrupt();
+    run(sched, 20);
+    CHECK(sim.reads - reads == 2);
+    // armed again around the counts of the filtered value, the interrupt is cleared
+    CHECK(last(sched, "tsl/sensor/illuminance") == "334.40");
+    CHECK(!sim.interrupt);
+    CHECK((sim.regs[0x02] | (sim.regs[0x03] << 8)) == 10449);
+    CHECK((sim.regs[0x04] | (sim.regs[0x05] << 8)) == 11550);
+
+    // while the filtered value lags behind, the light stays out of the band until the value
+    // is within TSL2561_INT_BAND
+    int events = 1;
+    for (int i = 0; i < 20; i++) {
+        sim.integrate();
+        sim.integrate();
+        if (sim.interrupt) {
+            ++events;
+            tsl.interrupt();
+            run(sched, 20);
+        }
+    }
+    printf("interrupt: %d events until %s lux\n", events,
+           last(sched, "tsl/sensor/illuminance").c_str());
+    CHECK(events >= 2 && events < 20);
+    CHECK(fabs(tsl.getIlluminance() - 364.8) <= TSL2561_INT_BAND * 364.8);
+    CHECK(sim.reads - reads == 2 * (unsigned long)events);
+}
+
+static void testInterruptSlots() {
+    Tsl a("a");
+    CHECK(a.setInterruptMode(5));
+    // a sensor keeps its slot
+    CHECK(a.setInterruptMode(5, 3));
+    Tsl b("b");
+    CHECK(!b.setInterruptMode(6));
+}
+
+int main() {
+    testIntegrationTiming(Tsl::INTEG_13MS);
+    testIntegrationTiming(Tsl::INTEG_101MS);
+    testIntegrationTiming(Tsl::INTEG_402MS);
+    testContinuous();
+    testSaturation();
+    testRangeUp();
+    testPersistence(20, 15);
+    testPersistence(0, 1);
+    testInterrupt();
+    testInterruptSlots();
+    if (failures) {
+        printf("test_tsl2561: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_tsl2561: ok\n");
+    return 0;
+}